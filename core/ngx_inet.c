@@ -9,11 +9,80 @@
 #include <ngx_core.h>
 
 
+#define NGX_CIDR_TREE_CHILD  0x80000000
+#define NGX_CIDR_TREE_LEAF   0xffffffff
+
+
+typedef struct {
+    ngx_uint_t                len;
+    ngx_uint_t                index;
+} ngx_cidr_tree_prefix_t;
+
+
+/* two decimal digits of 0..99, and hexadecimal digits */
+
+static u_char  ngx_inet_digits[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+static u_char  ngx_inet_hex[] = "0123456789abcdef";
+
+/* the value of a hexadecimal digit, or 0xff */
+
+static u_char  ngx_inet_hex_value[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+
 static ngx_int_t ngx_parse_unix_domain_url(ngx_pool_t *pool, ngx_url_t *u);
 static ngx_int_t ngx_parse_inet_url(ngx_pool_t *pool, ngx_url_t *u);
 static ngx_int_t ngx_parse_inet6_url(ngx_pool_t *pool, ngx_url_t *u);
 static ngx_int_t ngx_inet_add_addr(ngx_pool_t *pool, ngx_url_t *u,
     struct sockaddr *sockaddr, socklen_t socklen, ngx_uint_t total);
+static u_char *ngx_inet_ntop4(u_char *addr, u_char *text);
+static u_char *ngx_inet_hex16(u_char *p, ngx_uint_t n);
+static ngx_int_t ngx_cidr_prefix_len(u_char *mask, size_t size);
+static int ngx_libc_cdecl ngx_cidr_tree_cmp(const void *one,
+    const void *two);
+static ngx_int_t ngx_cidr_tree_insert(ngx_array_t *nodes, ngx_int_t *root,
+    u_char *addr, ngx_uint_t len, uint32_t value);
+static ngx_int_t ngx_cidr_tree_node(ngx_array_t *nodes, uint32_t value);
+static ngx_int_t ngx_cidr_tree_compress(ngx_array_t *trie,
+    ngx_array_t *nodes, ngx_array_t *entries, ngx_uint_t n);
+static ngx_int_t ngx_cidr_tree_single(uint32_t *node, ngx_uint_t *b,
+    uint32_t *miss);
 
 const char rfc4291_pfx[] = {    0x00, 0x00, 0x00, 0x00,
                                 0x00, 0x00, 0x00, 0x00,
@@ -136,19 +205,13 @@ ngx_inet6_addr(u_char *p, size_t len, u_char *addr)
             return NGX_ERROR;
         }
 
-        if (c >= '0' && c <= '9') {
-            word = word * 16 + (c - '0');
-            continue;
-        }
-
-        c |= 0x20;
+        c = ngx_inet_hex_value[c];
 
-        if (c >= 'a' && c <= 'f') {
-            word = word * 16 + (c - 'a') + 10;
-            continue;
+        if (c == 0xff) {
+            return NGX_ERROR;
         }
 
-        return NGX_ERROR;
+        word = word * 16 + c;
     }
 
     if (nibbles == 0 && zero == NULL) {
@@ -205,6 +268,19 @@ ngx_sock_ntop(struct sockaddr *sa, socklen_t socklen, u_char *text, size_t len,
         sin = (struct sockaddr_in *) sa;
         p = (u_char *) &sin->sin_addr;
 
+        /* the formatters below need room for the longest output */
+
+        if (len >= NGX_INET_ADDRSTRLEN + sizeof(":65535") - 1) {
+            p = ngx_inet_ntop4(p, text);
+
+            if (port) {
+                *p++ = ':';
+                p = ngx_inet_port_ntop(p, ntohs(sin->sin_port));
+            }
+
+            return (p - text);
+        }
+
         if (port) {
             p = ngx_snprintf(text, len, "%ud.%ud.%ud.%ud:%d",
                              p[0], p[1], p[2], p[3], ntohs(sin->sin_port));
@@ -230,8 +306,12 @@ ngx_sock_ntop(struct sockaddr *sa, socklen_t socklen, u_char *text, size_t len,
         n = ngx_inet6_ntop(sin6->sin6_addr.s6_addr, &text[n], len);
 
         if (port) {
-            n = ngx_sprintf(&text[1 + n], "]:%d",
-                            ntohs(sin6->sin6_port)) - text;
+            p = &text[1 + n];
+
+            *p++ = ']';
+            *p++ = ':';
+
+            n = ngx_inet_port_ntop(p, ntohs(sin6->sin6_port)) - text;
         }
 
         return n;
@@ -276,6 +356,10 @@ ngx_inet_ntop(int family, void *addr, u_char *text, size_t len)
 
         p = addr;
 
+        if (len >= NGX_INET_ADDRSTRLEN) {
+            return ngx_inet_ntop4(p, text) - text;
+        }
+
         return ngx_snprintf(text, len, "%ud.%ud.%ud.%ud",
                             p[0], p[1], p[2], p[3])
                - text;
@@ -357,7 +441,7 @@ ngx_inet6_ntop(u_char *p, u_char *text, size_t len)
             continue;
         }
 
-        dst = ngx_sprintf(dst, "%xd", p[i] * 256 + p[i + 1]);
+        dst = ngx_inet_hex16(dst, p[i] * 256 + p[i + 1]);
 
         if (i < 14) {
             *dst++ = ':';
@@ -365,7 +449,7 @@ ngx_inet6_ntop(u_char *p, u_char *text, size_t len)
     }
 
     if (n == 12) {
-        dst = ngx_sprintf(dst, "%ud.%ud.%ud.%ud", p[12], p[13], p[14], p[15]);
+        dst = ngx_inet_ntop4(&p[12], dst);
     }
 
     return dst - text;
@@ -374,6 +458,92 @@ ngx_inet6_ntop(u_char *p, u_char *text, size_t len)
 #endif
 
 
+/*
+ * the formatters write the same text as ngx_sprintf() with "%ud"
+ * and "%xd" would, without bounds checks; the caller provides room
+ */
+
+static u_char *
+ngx_inet_ntop4(u_char *addr, u_char *text)
+{
+    ngx_uint_t  i, n;
+
+    for (i = 0; i < 4; i++) {
+        n = addr[i];
+
+        if (n >= 100) {
+            *text++ = (u_char) ('0' + n / 100);
+            n %= 100;
+            *text++ = ngx_inet_digits[n * 2];
+            *text++ = ngx_inet_digits[n * 2 + 1];
+
+        } else if (n >= 10) {
+            *text++ = ngx_inet_digits[n * 2];
+            *text++ = ngx_inet_digits[n * 2 + 1];
+
+        } else {
+            *text++ = (u_char) ('0' + n);
+        }
+
+        if (i < 3) {
+            *text++ = '.';
+        }
+    }
+
+    return text;
+}
+
+
+u_char *
+ngx_inet_port_ntop(u_char *p, in_port_t port)
+{
+    u_char      *d, buf[sizeof("65535") - 1];
+    ngx_uint_t   n;
+
+    n = port;
+    d = buf + sizeof(buf);
+
+    while (n >= 100) {
+        d -= 2;
+        d[0] = ngx_inet_digits[(n % 100) * 2];
+        d[1] = ngx_inet_digits[(n % 100) * 2 + 1];
+        n /= 100;
+    }
+
+    if (n >= 10) {
+        d -= 2;
+        d[0] = ngx_inet_digits[n * 2];
+        d[1] = ngx_inet_digits[n * 2 + 1];
+
+    } else {
+        *--d = (u_char) ('0' + n);
+    }
+
+    return ngx_cpymem(p, d, buf + sizeof(buf) - d);
+}
+
+
+static u_char *
+ngx_inet_hex16(u_char *p, ngx_uint_t n)
+{
+    if (n >= 0x1000) {
+        *p++ = ngx_inet_hex[n >> 12];
+    }
+
+    if (n >= 0x100) {
+        *p++ = ngx_inet_hex[(n >> 8) & 0xf];
+    }
+
+    if (n >= 0x10) {
+        *p++ = ngx_inet_hex[(n >> 4) & 0xf];
+    }
+
+    *p++ = ngx_inet_hex[n & 0xf];
+
+    return p;
+}
+
+
 ngx_int_t
 ngx_ptocidr(ngx_str_t *text, ngx_cidr_t *cidr)
 {
@@ -561,6 +731,561 @@ ngx_cidr_match(struct sockaddr *sa, ngx_array_t *cidrs)
 }
 
 
+ngx_cidr_tree_t *
+ngx_cidr_tree_create(ngx_pool_t *pool, ngx_array_t *cidrs)
+{
+    u_char                  *addr;
+    ngx_int_t                len, *root;
+    ngx_uint_t               i, n;
+    ngx_pool_t              *temp;
+    ngx_cidr_t              *cidr;
+    ngx_array_t              trie, nodes, entries;
+    ngx_cidr_tree_t         *tree;
+    ngx_cidr_tree_prefix_t  *prefixes;
+
+    tree = ngx_pcalloc(pool, sizeof(ngx_cidr_tree_t));
+    if (tree == NULL) {
+        return NULL;
+    }
+
+    tree->in = NGX_DECLINED;
+#if (NGX_HAVE_INET6)
+    tree->in6 = NGX_DECLINED;
+#endif
+#if (NGX_HAVE_UNIX_DOMAIN)
+    tree->unix_domain = NGX_DECLINED;
+#endif
+
+    if (cidrs->nelts == 0) {
+        return tree;
+    }
+
+    if (cidrs->nelts >= NGX_CIDR_TREE_CHILD - 1) {
+        return NULL;
+    }
+
+    prefixes = ngx_alloc(cidrs->nelts * sizeof(ngx_cidr_tree_prefix_t),
+                         pool->log);
+    if (prefixes == NULL) {
+        return NULL;
+    }
+
+    temp = NULL;
+
+    cidr = cidrs->elts;
+    n = 0;
+
+    for (i = 0; i < cidrs->nelts; i++) {
+
+        switch (cidr[i].family) {
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            len = ngx_cidr_prefix_len(cidr[i].u.in6.mask.s6_addr, 16);
+            break;
+#endif
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+        case AF_UNIX:
+            if (tree->unix_domain == NGX_DECLINED) {
+                tree->unix_domain = i;
+            }
+
+            continue;
+#endif
+
+        default: /* AF_INET */
+            len = ngx_cidr_prefix_len((u_char *) &cidr[i].u.in.mask, 4);
+            break;
+        }
+
+        /* only contiguous masks, as made by ngx_ptocidr(), are supported */
+
+        if (len == NGX_ERROR) {
+            goto failed;
+        }
+
+        prefixes[n].len = len;
+        prefixes[n].index = i;
+        n++;
+    }
+
+    /*
+     * shorter prefixes go first, so a longer one overrides them,
+     * and a new node inherits the prefix covering its parent entry
+     */
+
+    ngx_qsort(prefixes, n, sizeof(ngx_cidr_tree_prefix_t),
+              ngx_cidr_tree_cmp);
+
+    /*
+     * the arrays grow by doubling, so they are built in a temporary
+     * pool and copied to the pool once, without the outgrown copies
+     */
+
+    temp = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, pool->log);
+    if (temp == NULL) {
+        goto failed;
+    }
+
+    if (ngx_array_init(&trie, temp, 16, 256 * sizeof(uint32_t)) != NGX_OK) {
+        goto failed;
+    }
+
+    for (i = 0; i < n; i++) {
+        cidr = (ngx_cidr_t *) cidrs->elts + prefixes[i].index;
+
+        switch (cidr->family) {
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            root = &tree->in6;
+            addr = cidr->u.in6.addr.s6_addr;
+            break;
+#endif
+
+        default: /* AF_INET */
+            root = &tree->in;
+            addr = (u_char *) &cidr->u.in.addr;
+            break;
+        }
+
+        if (ngx_cidr_tree_insert(&trie, root, addr, prefixes[i].len,
+                                 (uint32_t) prefixes[i].index + 1)
+            != NGX_OK)
+        {
+            goto failed;
+        }
+    }
+
+    /* the trie is then copied with the single way chains compressed */
+
+    if (ngx_array_init(&nodes, temp, 16, sizeof(ngx_cidr_tree_node_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    if (ngx_array_init(&entries, temp, 16, 256 * sizeof(uint32_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    if (tree->in != NGX_DECLINED) {
+        tree->in = ngx_cidr_tree_compress(&trie, &nodes, &entries, tree->in);
+
+        if (tree->in == NGX_ERROR) {
+            goto failed;
+        }
+    }
+
+#if (NGX_HAVE_INET6)
+    if (tree->in6 != NGX_DECLINED) {
+        tree->in6 = ngx_cidr_tree_compress(&trie, &nodes, &entries,
+                                           tree->in6);
+
+        if (tree->in6 == NGX_ERROR) {
+            goto failed;
+        }
+    }
+#endif
+
+    if (nodes.nelts) {
+        tree->nodes = ngx_palloc(pool, nodes.nelts * nodes.size);
+        if (tree->nodes == NULL) {
+            goto failed;
+        }
+
+        ngx_memcpy(tree->nodes, nodes.elts, nodes.nelts * nodes.size);
+    }
+
+    if (entries.nelts) {
+        tree->entries = ngx_palloc(pool, entries.nelts * entries.size);
+        if (tree->entries == NULL) {
+            goto failed;
+        }
+
+        ngx_memcpy(tree->entries, entries.elts,
+                   entries.nelts * entries.size);
+    }
+
+    ngx_destroy_pool(temp);
+    ngx_free(prefixes);
+
+    return tree;
+
+failed:
+
+    if (temp) {
+        ngx_destroy_pool(temp);
+    }
+
+    ngx_free(prefixes);
+
+    return NULL;
+}
+
+
+/*
+ * returns the index in the array of the longest prefix
+ * which matches the address, or NGX_DECLINED
+ */
+
+ngx_int_t
+ngx_cidr_tree_match(ngx_cidr_tree_t *tree, struct sockaddr *sa)
+{
+    u_char                *p;
+    uint32_t               entry;
+    ngx_int_t              n;
+    ngx_uint_t             level, i;
+    ngx_cidr_tree_node_t  *node;
+
+    switch (sa->sa_family) {
+
+    case AF_INET:
+        p = (u_char *) &((struct sockaddr_in *) sa)->sin_addr.s_addr;
+        n = tree->in;
+        break;
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        p = ((struct sockaddr_in6 *) sa)->sin6_addr.s6_addr;
+
+        if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *) p)) {
+            p += 12;
+            n = tree->in;
+
+        } else {
+            n = tree->in6;
+        }
+
+        break;
+#endif
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    case AF_UNIX:
+        return tree->unix_domain;
+#endif
+
+    default:
+        return NGX_DECLINED;
+    }
+
+    if (n == NGX_DECLINED) {
+        return NGX_DECLINED;
+    }
+
+    /* a lookup reads a node and an entry per byte of the address at most */
+
+    level = 0;
+
+    for ( ;; ) {
+        node = &tree->nodes[n];
+
+        for (i = 0; i < node->skip; i++) {
+            if (p[level + i] != node->bytes[i]) {
+                break;
+            }
+        }
+
+        if (i < node->skip) {
+            entry = node->miss;
+            break;
+        }
+
+        level += node->skip;
+
+        if (node->entries == NGX_CIDR_TREE_LEAF) {
+            entry = node->leaf;
+
+        } else {
+            entry = tree->entries[node->entries + p[level++]];
+        }
+
+        if (!(entry & NGX_CIDR_TREE_CHILD)) {
+            break;
+        }
+
+        n = entry & ~NGX_CIDR_TREE_CHILD;
+    }
+
+    if (entry == 0) {
+        return NGX_DECLINED;
+    }
+
+    return entry - 1;
+}
+
+
+static ngx_int_t
+ngx_cidr_prefix_len(u_char *mask, size_t size)
+{
+    size_t      i;
+    ngx_uint_t  len;
+
+    len = 0;
+
+    for (i = 0; i < size && mask[i] == 0xff; i++) {
+        len += 8;
+    }
+
+    if (i == size) {
+        return len;
+    }
+
+    switch (mask[i++]) {
+    case 0x00: break;
+    case 0x80: len += 1; break;
+    case 0xc0: len += 2; break;
+    case 0xe0: len += 3; break;
+    case 0xf0: len += 4; break;
+    case 0xf8: len += 5; break;
+    case 0xfc: len += 6; break;
+    case 0xfe: len += 7; break;
+    default:
+        return NGX_ERROR;
+    }
+
+    for ( /* void */ ; i < size; i++) {
+        if (mask[i]) {
+            return NGX_ERROR;
+        }
+    }
+
+    return len;
+}
+
+
+static int ngx_libc_cdecl
+ngx_cidr_tree_cmp(const void *one, const void *two)
+{
+    ngx_cidr_tree_prefix_t  *first, *second;
+
+    first = (ngx_cidr_tree_prefix_t *) one;
+    second = (ngx_cidr_tree_prefix_t *) two;
+
+    if (first->len != second->len) {
+        return (first->len < second->len) ? -1 : 1;
+    }
+
+    /* the first of equal prefixes in the array wins */
+
+    return (first->index < second->index) ? 1 : -1;
+}
+
+
+static ngx_int_t
+ngx_cidr_tree_insert(ngx_array_t *nodes, ngx_int_t *root, u_char *addr,
+    ngx_uint_t len, uint32_t value)
+{
+    uint32_t    *node, entry;
+    ngx_int_t    n, child;
+    ngx_uint_t   level, bits, start, i;
+
+    if (*root == NGX_DECLINED) {
+        *root = ngx_cidr_tree_node(nodes, 0);
+
+        if (*root == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    n = *root;
+
+    for (level = 0; /* void */ ; level++) {
+
+        node = (uint32_t *) nodes->elts + (ngx_uint_t) n * 256;
+
+        if (len <= 8 * (level + 1)) {
+
+            /* the prefix ends in this node and covers 2^(8 - bits) entries */
+
+            bits = len - 8 * level;
+            start = bits ? addr[level] & (0xff << (8 - bits)) : 0;
+
+            for (i = start; i < start + (1 << (8 - bits)); i++) {
+                node[i] = value;
+            }
+
+            return NGX_OK;
+        }
+
+        entry = node[addr[level]];
+
+        if (entry & NGX_CIDR_TREE_CHILD) {
+            n = entry & ~NGX_CIDR_TREE_CHILD;
+            continue;
+        }
+
+        child = ngx_cidr_tree_node(nodes, entry);
+
+        if (child == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        /* the nodes may have been moved */
+
+        node = (uint32_t *) nodes->elts + (ngx_uint_t) n * 256;
+        node[addr[level]] = NGX_CIDR_TREE_CHILD | (uint32_t) child;
+
+        n = child;
+    }
+}
+
+
+static ngx_int_t
+ngx_cidr_tree_node(ngx_array_t *nodes, uint32_t value)
+{
+    uint32_t    *node;
+    ngx_uint_t   i;
+
+    if (nodes->nelts >= NGX_CIDR_TREE_CHILD) {
+        return NGX_ERROR;
+    }
+
+    node = ngx_array_push(nodes);
+    if (node == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < 256; i++) {
+        node[i] = value;
+    }
+
+    return nodes->nelts - 1;
+}
+
+
+/*
+ * copies the node n of the trie and its subtree; a chain of nodes, each
+ * with one entry differing from the others which are equal along the
+ * chain, is replaced by the bytes of these entries
+ */
+
+static ngx_int_t
+ngx_cidr_tree_compress(ngx_array_t *trie, ngx_array_t *nodes,
+    ngx_array_t *entries, ngx_uint_t n)
+{
+    uint32_t              *t, *e, entry, miss, block[256];
+    ngx_int_t              child;
+    ngx_uint_t             i, b;
+    ngx_cidr_tree_node_t   node, *p;
+
+    ngx_memzero(&node, sizeof(ngx_cidr_tree_node_t));
+
+    node.entries = NGX_CIDR_TREE_LEAF;
+
+    for ( ;; ) {
+        t = (uint32_t *) trie->elts + n * 256;
+
+        if (ngx_cidr_tree_single(t, &b, &miss) != NGX_OK) {
+            break;
+        }
+
+        if (node.skip && miss != node.miss) {
+
+            /* the chain goes on with another entry on a mismatch */
+
+            child = ngx_cidr_tree_compress(trie, nodes, entries, n);
+
+            if (child == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            node.leaf = NGX_CIDR_TREE_CHILD | (uint32_t) child;
+
+            goto done;
+        }
+
+        node.miss = miss;
+        node.bytes[node.skip++] = (u_char) b;
+
+        entry = t[b];
+
+        if (!(entry & NGX_CIDR_TREE_CHILD)) {
+            node.leaf = entry;
+            goto done;
+        }
+
+        n = entry & ~NGX_CIDR_TREE_CHILD;
+    }
+
+    ngx_memcpy(block, t, sizeof(block));
+
+    for (i = 0; i < 256; i++) {
+        if (!(block[i] & NGX_CIDR_TREE_CHILD)) {
+            continue;
+        }
+
+        child = ngx_cidr_tree_compress(trie, nodes, entries,
+                                       block[i] & ~NGX_CIDR_TREE_CHILD);
+
+        if (child == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        block[i] = NGX_CIDR_TREE_CHILD | (uint32_t) child;
+    }
+
+    e = ngx_array_push(entries);
+    if (e == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(e, block, sizeof(block));
+
+    node.entries = (uint32_t) (entries->nelts - 1) * 256;
+
+done:
+
+    if (nodes->nelts >= NGX_CIDR_TREE_CHILD) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_array_push(nodes);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    *p = node;
+
+    return nodes->nelts - 1;
+}
+
+
+/* finds the entry of a node which differs from all the others */
+
+static ngx_int_t
+ngx_cidr_tree_single(uint32_t *node, ngx_uint_t *b, uint32_t *miss)
+{
+    uint32_t    m;
+    ngx_uint_t  i, n;
+
+    m = (node[0] == node[1] || node[0] == node[2]) ? node[0] : node[1];
+
+    n = 0;
+    *b = 0;
+
+    for (i = 0; i < 256; i++) {
+
+        if (node[i] == m) {
+            continue;
+        }
+
+        if (n++) {
+            return NGX_DECLINED;
+        }
+
+        *b = i;
+    }
+
+    *miss = m;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_parse_addr(ngx_pool_t *pool, ngx_addr_t *addr, u_char *text, size_t len)
 {
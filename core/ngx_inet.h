@@ -71,6 +71,36 @@ typedef struct {
 } ngx_cidr_t;
 
 
+/*
+ * a multibit trie with 8-bit strides built from an array of ngx_cidr_t;
+ * an entry holds either a child node or the index of the longest prefix
+ * covering it, plus one; chains of nodes with a single way down are
+ * compressed into the bytes skipped before the node
+ */
+
+typedef struct {
+    uint32_t                  entries;     /* NGX_CIDR_TREE_LEAF if none */
+    uint32_t                  leaf;        /* the entry if no entries */
+    uint32_t                  miss;        /* the entry if skip mismatches */
+    u_char                    skip;
+    u_char                    bytes[16];
+} ngx_cidr_tree_node_t;
+
+
+typedef struct {
+    ngx_cidr_tree_node_t     *nodes;
+    uint32_t                 *entries;
+
+    ngx_int_t                 in;
+#if (NGX_HAVE_INET6)
+    ngx_int_t                 in6;
+#endif
+#if (NGX_HAVE_UNIX_DOMAIN)
+    ngx_int_t                 unix_domain;
+#endif
+} ngx_cidr_tree_t;
+
+
 typedef struct {
     struct sockaddr          *sockaddr;
     socklen_t                 socklen;
@@ -114,8 +144,11 @@ size_t ngx_inet6_ntop(u_char *p, u_char *text, size_t len);
 size_t ngx_sock_ntop(struct sockaddr *sa, socklen_t socklen, u_char *text,
     size_t len, ngx_uint_t port);
 size_t ngx_inet_ntop(int family, void *addr, u_char *text, size_t len);
+u_char *ngx_inet_port_ntop(u_char *p, in_port_t port);
 ngx_int_t ngx_ptocidr(ngx_str_t *text, ngx_cidr_t *cidr);
 ngx_int_t ngx_cidr_match(struct sockaddr *sa, ngx_array_t *cidrs);
+ngx_cidr_tree_t *ngx_cidr_tree_create(ngx_pool_t *pool, ngx_array_t *cidrs);
+ngx_int_t ngx_cidr_tree_match(ngx_cidr_tree_t *tree, struct sockaddr *sa);
 ngx_int_t ngx_parse_addr(ngx_pool_t *pool, ngx_addr_t *addr, u_char *text,
     size_t len);
 ngx_int_t ngx_parse_addr_port(ngx_pool_t *pool, ngx_addr_t *addr,
@@ -98,6 +98,8 @@ static ngx_proxy_protocol_tlv_entry_t  ngx_proxy_protocol_tlv_ssl_entries[] = {
 #define NGX_PROXY_PROTOCOL_V2_SIG                                           \
                 "\x0D\x0A\x0D\x0A\x00\x0D\x0A\x51\x55\x49\x54\x0A"
 #define NGX_PROXY_PROTOCOL_V2_VERSION_COMMAND       0x21
+#define NGX_PROXY_PROTOCOL_V2_VERSION_LOCAL         0x20
+#define NGX_PROXY_PROTOCOL_V2_FAMILY_UNSPEC         0x00
 #define NGX_PROXY_PROTOCOL_V2_FAMILY_TRANSPORT_IPV4 0x11
 #define NGX_PROXY_PROTOCOL_V2_FAMILY_TRANSPORT_IPV6 0x21
 #define NGX_PROXY_PROTOCOL_V2_LEN_HEADER            16
@@ -352,7 +354,16 @@ ngx_proxy_protocol_write(ngx_connection_t *c, u_char *buf, u_char *last)
     port = ngx_inet_get_port(c->sockaddr);
     lport = ngx_inet_get_port(c->local_sockaddr);
 
-    return ngx_slprintf(buf, last, " %ui %ui" CRLF, port, lport);
+    /* the header size limit leaves room for the ports */
+
+    *buf++ = ' ';
+    buf = ngx_inet_port_ntop(buf, port);
+    *buf++ = ' ';
+    buf = ngx_inet_port_ntop(buf, lport);
+
+    *buf++ = CR; *buf++ = LF;
+
+    return buf;
 }
 
 
@@ -467,6 +478,34 @@ ngx_proxy_protocol_v2_write(ngx_connection_t *c, u_char *buf, u_char *last)
 }
 
 
+/*
+ * the LOCAL command is sent by the proxy on its own behalf, e.g. for
+ * health checks; the receiver uses the real connection endpoints and
+ * ignores the address block, so none is sent
+ */
+
+u_char *
+ngx_proxy_protocol_v2_write_local(u_char *buf, u_char *last)
+{
+    ngx_proxy_protocol_header_t  *header;
+
+    if (last - buf < NGX_PROXY_PROTOCOL_V2_LOCAL_HEADER) {
+        return NULL;
+    }
+
+    header = (ngx_proxy_protocol_header_t *) buf;
+
+    ngx_memcpy(header->signature, NGX_PROXY_PROTOCOL_V2_SIG, 12);
+
+    header->version_command = NGX_PROXY_PROTOCOL_V2_VERSION_LOCAL;
+    header->family_transport = NGX_PROXY_PROTOCOL_V2_FAMILY_UNSPEC;
+    header->len[0] = 0;
+    header->len[1] = 0;
+
+    return buf + sizeof(ngx_proxy_protocol_header_t);
+}
+
+
 static u_char *
 ngx_proxy_protocol_v2_read(ngx_connection_t *c, u_char *buf, u_char *last)
 {
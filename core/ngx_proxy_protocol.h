@@ -15,6 +15,7 @@
 
 #define NGX_PROXY_PROTOCOL_MAX_HEADER  107
 #define NGX_PROXY_PROTOCOL_V2_MAX_HEADER  214
+#define NGX_PROXY_PROTOCOL_V2_LOCAL_HEADER  16
 
 
 struct ngx_proxy_protocol_s {
@@ -32,6 +33,7 @@ u_char *ngx_proxy_protocol_write(ngx_connection_t *c, u_char *buf,
     u_char *last);
 u_char *ngx_proxy_protocol_v2_write(ngx_connection_t *c, u_char *buf,
     u_char *last);
+u_char *ngx_proxy_protocol_v2_write_local(u_char *buf, u_char *last);
 ngx_int_t ngx_proxy_protocol_get_tlv(ngx_connection_t *c, ngx_str_t *name,
     ngx_str_t *value);
 
@@ -10,9 +10,50 @@
 #include <ngx_stream.h>
 
 
+#if (NGX_LINUX)
+#include <netinet/udp.h>
+#define NGX_STREAM_PROXY_UDP_BATCH_MAX  64
+#else
+#define NGX_STREAM_PROXY_UDP_BATCH_MAX  1
+#endif
+
+#define NGX_STREAM_PROXY_UDP_GSO_MAX    65000
+#define NGX_STREAM_PROXY_UDP_GRO_SLOT   65535
+#define NGX_STREAM_PROXY_UDP_GRO_SLOTS  4
+#define NGX_STREAM_PROXY_UDP_CACHE_PEERS  16
+#define NGX_STREAM_PROXY_UDP_ID_MAX     8
+#define NGX_STREAM_PROXY_UDP_IDS        16
+
+#define NGX_STREAM_PROXY_QOS_CLASS        0
+#define NGX_STREAM_PROXY_QOS_WAIT         1
+#define NGX_STREAM_PROXY_QOS_CLASS_BYTES  2
+#define NGX_STREAM_PROXY_QOS_CLASS_WAIT   3
+
+#define NGX_STREAM_PROXY_HEDGE_SLOTS      64
+#define NGX_STREAM_PROXY_HEDGE_BUCKETS    16
+#define NGX_STREAM_PROXY_HEDGE_SAMPLES    20
+#define NGX_STREAM_PROXY_HEDGE_WINDOW     1024
+
+#define NGX_STREAM_PROXY_PASS_CACHE_MISS  1
+#define NGX_STREAM_PROXY_PASS_CACHE_HIT   2
+
+#define NGX_STREAM_PROXY_BREAKER_CLOSED     0
+#define NGX_STREAM_PROXY_BREAKER_OPEN       1
+#define NGX_STREAM_PROXY_BREAKER_HALF_OPEN  2
+
+#define NGX_STREAM_PROXY_BIND_CACHE         16
+
+
+typedef struct ngx_stream_proxy_udp_shared_s  ngx_stream_proxy_udp_shared_t;
+
+
 typedef struct {
     ngx_addr_t                      *addr;
+    ngx_uint_t                       naddrs;
+    ngx_uint_t                       next;
     ngx_stream_complex_value_t      *value;
+    ngx_addr_t                      *cache;
+    ngx_uint_t                       ncache;
 #if (NGX_HAVE_TRANSPARENT_PROXY)
     ngx_uint_t                       transparent; /* unsigned  transparent:1; */
 #endif
@@ -20,12 +61,468 @@ typedef struct {
 
 
 typedef struct {
+    ngx_uint_t                       iov;
+    ngx_uint_t                       last;
+    size_t                           size;
+} ngx_stream_proxy_udp_dgram_t;
+
+
+typedef struct {
+    ngx_msec_t                       last;
+    off_t                            excess;
+    size_t                           rate;
+} ngx_stream_proxy_bucket_t;
+
+
+typedef struct {
+    u_char                           color;
+    u_char                           dummy;
+    u_short                          len;
+    ngx_queue_t                      queue;
+    ngx_uint_t                       count;
+    ngx_stream_proxy_bucket_t        bucket[2];
+    u_char                           data[1];
+} ngx_stream_proxy_rate_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+} ngx_stream_proxy_rate_shctx_t;
+
+
+typedef struct {
+    ngx_stream_proxy_rate_shctx_t   *sh;
+    ngx_slab_pool_t                 *shpool;
+    ngx_stream_complex_value_t       key;
+} ngx_stream_proxy_rate_zone_t;
+
+
+/*
+ * connect outcomes of a peer, shared by all workers; "start" is
+ * the start of the counting window while closed, or the time
+ * the state was entered while open or half-open
+ */
+
+typedef struct {
+    u_char                           color;
+    u_char                           dummy;
+    u_short                          len;
+    ngx_queue_t                      queue;
+    ngx_uint_t                       state;
+    ngx_msec_t                       start;
+    ngx_uint_t                       requests;
+    ngx_uint_t                       failures;
+    ngx_uint_t                       probes;
+    u_char                           data[1];
+} ngx_stream_proxy_breaker_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+} ngx_stream_proxy_breaker_shctx_t;
+
+
+typedef struct {
+    ngx_stream_proxy_breaker_shctx_t *sh;
+    ngx_slab_pool_t                 *shpool;
+} ngx_stream_proxy_breaker_zone_t;
+
+
+typedef struct {
+    ngx_shm_zone_t                  *shm_zone;
+
+    ngx_uint_t                       failures;  /* percent */
+    ngx_uint_t                       requests;
+    ngx_msec_t                       latency;
+    ngx_msec_t                       window;
+    ngx_msec_t                       open;
+    ngx_uint_t                       probes;
+} ngx_stream_proxy_breaker_t;
+
+
+typedef struct {
+    ngx_stream_proxy_breaker_t      *breaker;
+
+    void                            *data;
+
+    ngx_event_get_peer_pt            original_get_peer;
+    ngx_event_free_peer_pt           original_free_peer;
+
+#if (NGX_STREAM_SSL)
+    ngx_event_set_peer_session_pt    original_set_session;
+    ngx_event_save_peer_session_pt   original_save_session;
+#endif
+} ngx_stream_proxy_breaker_peer_data_t;
+
+
+typedef struct {
+    ngx_str_t                        name;
+    ngx_uint_t                       weight;
+
+    /* sessions waiting for their turn in this worker */
+    ngx_queue_t                      queue;
+    off_t                            deficit;
+
+    /* per-worker counters */
+    off_t                            bytes;
+    ngx_msec_t                       wait;
+} ngx_stream_proxy_qos_class_t;
+
+
+typedef struct {
+    ngx_array_t                      qos_classes;
+    ngx_event_t                      qos_event;
+
+    /* per-worker counter of read budget yields */
+    ngx_uint_t                       budget_yields;
+
+    ngx_array_t                      prewarm;
+                                         /* ngx_stream_proxy_prewarm_t * */
+    ngx_array_t                      health_checks;
+                                         /* ngx_stream_proxy_health_t * */
+
+    /* "host:port" of upstream blocks, for variable proxy_pass */
+    ngx_hash_t                       upstreams;
+} ngx_stream_proxy_main_conf_t;
+
+
+/*
+ * connect times of a peer, bucket n holds times below 2^n milliseconds;
+ * the counts are halved once the window is full, so recent connects
+ * weigh more; the loser of a race counts with the time it was given,
+ * otherwise the slow connects hedged away would lower the threshold
+ */
+
+typedef struct {
+    uint32_t                         hash;
+    ngx_uint_t                       total;
+    ngx_uint_t                       count[NGX_STREAM_PROXY_HEDGE_BUCKETS];
+} ngx_stream_proxy_hedge_slot_t;
+
+
+typedef struct {
+    ngx_connection_t                *connection;
+    struct sockaddr                 *sockaddr;
+    socklen_t                        socklen;
+    ngx_str_t                       *name;
+    ngx_stream_upstream_rr_peer_t   *peer;
+
+    /* s->upstream_states may be reallocated by the next attempt */
+    ngx_uint_t                       state;
+
+    ngx_msec_t                       start_time;
+} ngx_stream_proxy_attempt_t;
+
+
+typedef struct {
+    ngx_stream_session_t            *session;
+
+    /* staggered parallel connect, the earlier attempt is kept aside */
+    ngx_event_t                      stagger;
+    ngx_stream_proxy_attempt_t       attempt;
+
+    /* upload and download buckets of the session */
+    ngx_stream_proxy_bucket_t        bucket[2];
+
+    ngx_stream_proxy_rate_zone_t    *rate_zone;
+    ngx_stream_proxy_rate_node_t    *rate_node;
+
+    ngx_stream_proxy_qos_class_t    *qos_class;
+    ngx_queue_t                      qos_queue;
+    ngx_msec_t                       qos_start;
+    ngx_msec_t                       qos_wait;
+    off_t                            qos_cost;
+    off_t                            qos_credit[2];
+
+    /* write coalescing, indexed by from_upstream */
+    ngx_event_t                      flush[2];
+    off_t                            held[2];
+    off_t                            read_avg[2];
+
+    /* a session on a shared UDP socket to upstream */
+    ngx_stream_proxy_udp_shared_t   *udp_shared;
+
+    unsigned                         rate_init:1;
+    unsigned                         coalesce:1;
+    unsigned                         qos_queued:1;
+    unsigned                         qos_upstream:1;
+    unsigned                         qos_downstream:1;
+    unsigned                         udp_gso_off:1;
+} ngx_stream_proxy_ctx_t;
+
+
+typedef struct {
+    ngx_uint_t                       max_cached;   /* per peer */
+    ngx_msec_t                       timeout;
+
+    /* sockets are shared by sessions if set */
+    ngx_uint_t                       id_offset;
+    ngx_uint_t                       id_len;
+
+    ngx_queue_t                      cache;
+    ngx_queue_t                      free;
+} ngx_stream_proxy_udp_cache_t;
+
+
+typedef struct {
+    ngx_stream_proxy_udp_cache_t    *cache;
+
+    ngx_queue_t                      queue;
+    ngx_connection_t                *connection;
+
+    socklen_t                        socklen;
+    ngx_sockaddr_t                   sockaddr;
+
+    /* a shared socket: ids of requests in flight and their sessions */
+    ngx_rbtree_t                     ids;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      sessions;
+    ngx_uint_t                       nsessions;
+
+    unsigned                         failed:1;
+} ngx_stream_proxy_udp_cache_item_t;
+
+
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_connection_t                *connection;   /* NULL if unused */
+    u_char                           id[NGX_STREAM_PROXY_UDP_ID_MAX];
+} ngx_stream_proxy_udp_id_t;
+
+
+struct ngx_stream_proxy_udp_shared_s {
+    ngx_queue_t                         queue;
+    ngx_connection_t                   *connection;
+    ngx_stream_proxy_udp_cache_item_t  *item;
+
+    /* the last requests of the session */
+    ngx_stream_proxy_udp_id_t           ids[NGX_STREAM_PROXY_UDP_IDS];
+    ngx_uint_t                          nids;
+};
+
+
+typedef struct {
+    ngx_stream_proxy_udp_cache_t    *cache;
+    ngx_stream_session_t            *session;
+
+    void                            *data;
+
+    ngx_event_get_peer_pt            original_get_peer;
+    ngx_event_free_peer_pt           original_free_peer;
+} ngx_stream_proxy_udp_cache_peer_data_t;
+
+
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+
+    ngx_uint_t                       max;
+    ngx_uint_t                       count;
+
+    ngx_uint_t                       hits;
+    ngx_uint_t                       misses;
+} ngx_stream_proxy_pass_cache_t;
+
+
+typedef struct {
+    ngx_str_node_t                   sn;
+    ngx_queue_t                      queue;
+
+    ngx_str_t                        host;
+    in_port_t                        port;
+    ngx_uint_t                       no_port;
+
+    struct sockaddr                 *sockaddr;
+    socklen_t                        socklen;
+    ngx_str_t                        name;
+
+    u_char                           data[1];
+} ngx_stream_proxy_pass_node_t;
+
+
+typedef struct {
+    ngx_pool_t                      *pool;
+    ngx_str_t                        host;
+
+    /* peer.data points to the peers, used to init round-robin */
+    ngx_stream_upstream_srv_conf_t   upstream;
+
+    ngx_uint_t                       refs;
+    unsigned                         stale:1;
+} ngx_stream_proxy_peer_set_t;
+
+
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+
+    ngx_uint_t                       max;
+    ngx_uint_t                       count;
+} ngx_stream_proxy_resolve_cache_t;
+
+
+typedef struct {
+    ngx_str_node_t                   sn;
+    ngx_queue_t                      queue;
+
+    ngx_stream_proxy_resolve_cache_t *cache;
+    ngx_stream_proxy_peer_set_t     *set;
+
+    time_t                           valid;
+    time_t                           grace;
+
+    /* refresh in progress */
+    ngx_resolver_ctx_t              *ctx;
+    ngx_resolver_t                  *resolver;
+    ngx_msec_t                       timeout;
+
+    ngx_str_t                        host;
+    in_port_t                        port;
+    unsigned                         interleave:1;
+
+    u_char                           data[1];
+} ngx_stream_proxy_resolve_node_t;
+
+
+typedef struct ngx_stream_proxy_srv_conf_s  ngx_stream_proxy_srv_conf_t;
+typedef struct ngx_stream_proxy_health_s    ngx_stream_proxy_health_t;
+
+
+typedef struct {
+    ngx_stream_proxy_health_t       *health;
+
+    ngx_stream_upstream_rr_peers_t  *peers;
+    ngx_stream_upstream_rr_peer_t   *peer;
+
+    ngx_peer_connection_t            pc;
+    size_t                           sent;
+    size_t                           received;
+    u_char                          *buf;
+
+    ngx_uint_t                       fails;
+    ngx_uint_t                       passes;
+
+    /* the peer was marked down by the health check */
+    unsigned                         down:1;
+} ngx_stream_proxy_health_peer_t;
+
+
+struct ngx_stream_proxy_health_s {
+    ngx_stream_proxy_srv_conf_t     *conf;
+
+    ngx_msec_t                       interval;
+    ngx_msec_t                       timeout;
+    ngx_uint_t                       fails;
+    ngx_uint_t                       passes;
+    ngx_str_t                        send;
+    ngx_str_t                        expect;
+
+    /* the PROXY protocol header, if any, followed by "send" */
+    ngx_str_t                        request;
+
+    ngx_event_t                      event;
+
+    ngx_stream_proxy_health_peer_t  *peers;
+    ngx_uint_t                       npeers;
+};
+
+
+typedef struct {
+    ngx_stream_proxy_srv_conf_t     *conf;
+
+    /* connects to a peer which has less than conf->prewarm connections */
+    ngx_event_t                      event;
+
+    ngx_queue_t                      idle;
+    ngx_queue_t                      connecting;
+    ngx_queue_t                      free;
+} ngx_stream_proxy_prewarm_t;
+
+
+typedef struct {
+    ngx_stream_proxy_prewarm_t      *prewarm;
+
+    ngx_queue_t                      queue;
+    ngx_peer_connection_t            peer;
+
+    socklen_t                        socklen;
+    ngx_sockaddr_t                   sockaddr;
+} ngx_stream_proxy_prewarm_item_t;
+
+
+typedef struct {
+    ngx_stream_proxy_prewarm_t      *prewarm;
+
+    void                            *data;
+
+    ngx_event_get_peer_pt            original_get_peer;
+    ngx_event_free_peer_pt           original_free_peer;
+
+#if (NGX_STREAM_SSL)
+    ngx_event_set_peer_session_pt    original_set_session;
+    ngx_event_save_peer_session_pt   original_save_session;
+#endif
+} ngx_stream_proxy_prewarm_peer_data_t;
+
+
+#if (NGX_STREAM_SSL)
+
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_queue_t                      queue;
+
+    ngx_str_t                        cert;
+    ngx_str_t                        key;
+    ngx_array_t                     *passwords;
+
+    time_t                           cert_mtime;
+    time_t                           key_mtime;
+    time_t                           valid;
+    time_t                           accessed;
+
+    X509                            *x509;
+    STACK_OF(X509)                  *chain;
+    EVP_PKEY                        *pkey;
+} ngx_stream_proxy_ssl_cert_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+    ngx_uint_t                       count;
+
+    ngx_uint_t                       max;
+    time_t                           inactive;
+    time_t                           valid;
+} ngx_stream_proxy_ssl_cert_cache_t;
+
+#endif
+
+
+struct ngx_stream_proxy_srv_conf_s {
     ngx_msec_t                       connect_timeout;
+    ngx_msec_t                       connect_stagger;
+    ngx_uint_t                       connect_hedge;
+    ngx_stream_proxy_hedge_slot_t   *hedge;
     ngx_msec_t                       timeout;
     ngx_msec_t                       next_upstream_timeout;
     size_t                           buffer_size;
+    size_t                           read_budget;
+    ngx_uint_t                       read_budget_iterations;
+    size_t                           coalesce;
+    ngx_msec_t                       coalesce_timeout;
     ngx_stream_complex_value_t      *upload_rate;
     ngx_stream_complex_value_t      *download_rate;
+    ngx_stream_complex_value_t      *qos;
+    size_t                           rate_burst;
+    ngx_shm_zone_t                  *rate_zone;
     ngx_uint_t                       requests;
     ngx_uint_t                       responses;
     ngx_uint_t                       next_upstream_tries;
@@ -34,7 +531,23 @@ typedef struct {
     ngx_uint_t                       proxy_protocol_version;
     ngx_str_t                        proxy_protocol_tlv_alpn;
     ngx_str_t                        proxy_protocol_tlv_auth;
+    ngx_array_t                     *proxy_protocol_trusted;
+    ngx_cidr_tree_t                 *proxy_protocol_trusted_tree;
     ngx_flag_t                       half_close;
+    ngx_uint_t                       udp_batch;
+    ngx_flag_t                       udp_gso;
+    ngx_flag_t                       udp_gro;
+    ngx_uint_t                       udp_socket_cache;
+    ngx_msec_t                       udp_socket_cache_timeout;
+    ngx_uint_t                       udp_id_offset;
+    ngx_uint_t                       udp_id_len;
+    ngx_stream_proxy_udp_cache_t    *udp_cache;
+    ngx_uint_t                       prewarm;
+    ngx_msec_t                       prewarm_timeout;
+    ngx_uint_t                       prewarm_rate;
+    ngx_stream_proxy_prewarm_t      *prewarm_pool;
+    ngx_stream_proxy_breaker_t      *breaker;
+    ngx_stream_proxy_health_t       *health;
     ngx_stream_upstream_local_t     *local;
     ngx_flag_t                       socket_keepalive;
 
@@ -53,14 +566,20 @@ typedef struct {
     ngx_stream_complex_value_t      *ssl_certificate;
     ngx_stream_complex_value_t      *ssl_certificate_key;
     ngx_array_t                     *ssl_passwords;
+    ngx_stream_proxy_ssl_cert_cache_t  *ssl_certificate_cache;
     ngx_array_t                     *ssl_conf_commands;
+    ngx_flag_t                       ssl_ktls;
 
     ngx_ssl_t                       *ssl;
 #endif
 
     ngx_stream_upstream_srv_conf_t  *upstream;
     ngx_stream_complex_value_t      *upstream_value;
-} ngx_stream_proxy_srv_conf_t;
+    ngx_uint_t                       pass_cache_size;
+    ngx_stream_proxy_pass_cache_t   *pass_cache;
+    ngx_uint_t                       resolve_cache_size;
+    ngx_stream_proxy_resolve_cache_t *resolve_cache;
+};
 
 typedef struct {
     uint8_t type;
@@ -69,36 +588,249 @@ typedef struct {
     uint8_t value[0];
 } ngx_proxy_protocol_pp2_tlv_t;
 
+
+/* a datagram being dispatched from a shared UDP socket to its session */
+static ngx_buf_t         *ngx_stream_proxy_udp_datagram;
+static ngx_connection_t  *ngx_stream_proxy_udp_target;
+
+
 static void ngx_stream_proxy_handler(ngx_stream_session_t *s);
 static ngx_int_t ngx_stream_proxy_eval(ngx_stream_session_t *s,
     ngx_stream_proxy_srv_conf_t *pscf);
+static ngx_int_t ngx_stream_proxy_pass_cache_lookup(ngx_stream_session_t *s,
+    ngx_stream_proxy_pass_cache_t *cache, ngx_str_t *key);
+static void ngx_stream_proxy_pass_cache_add(ngx_stream_session_t *s,
+    ngx_stream_proxy_pass_cache_t *cache, ngx_str_t *key);
 static ngx_int_t ngx_stream_proxy_set_local(ngx_stream_session_t *s,
     ngx_stream_upstream_t *u, ngx_stream_upstream_local_t *local);
+static ngx_int_t ngx_stream_proxy_cache_local(ngx_stream_session_t *s,
+    ngx_stream_upstream_t *u, ngx_stream_upstream_local_t *local,
+    ngx_str_t *val);
+static ngx_addr_t *ngx_stream_proxy_next_local(
+    ngx_stream_upstream_local_t *local);
+static ngx_int_t ngx_stream_proxy_copy_local(ngx_stream_session_t *s,
+    ngx_stream_upstream_t *u, ngx_addr_t *cached, ngx_str_t *val);
 static void ngx_stream_proxy_connect(ngx_stream_session_t *s);
 static void ngx_stream_proxy_init_upstream(ngx_stream_session_t *s);
 static void ngx_stream_proxy_resolve_handler(ngx_resolver_ctx_t *ctx);
+static ngx_int_t ngx_stream_proxy_resolve_cache_lookup(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf, ngx_stream_upstream_resolved_t *ur);
+static ngx_int_t ngx_stream_proxy_resolve_cache_add(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf, ngx_stream_upstream_resolved_t *ur,
+    time_t valid);
+static void ngx_stream_proxy_resolve_cache_refresh(
+    ngx_stream_proxy_resolve_node_t *node);
+static void ngx_stream_proxy_resolve_cache_handler(ngx_resolver_ctx_t *ctx);
+static void ngx_stream_proxy_resolve_cache_delete(
+    ngx_stream_proxy_resolve_node_t *node);
+static ngx_stream_proxy_peer_set_t *ngx_stream_proxy_peer_set_create(
+    ngx_stream_upstream_resolved_t *ur, ngx_uint_t interleave, ngx_log_t *log);
+static ngx_int_t ngx_stream_proxy_peer_set_use(ngx_stream_session_t *s,
+    ngx_stream_proxy_peer_set_t *set);
+static void ngx_stream_proxy_peer_set_release(void *data);
+static void ngx_stream_proxy_peer_set_drop(ngx_stream_proxy_peer_set_t *set);
 static void ngx_stream_proxy_upstream_handler(ngx_event_t *ev);
 static void ngx_stream_proxy_downstream_handler(ngx_event_t *ev);
 static void ngx_stream_proxy_process_connection(ngx_event_t *ev,
     ngx_uint_t from_upstream);
 static void ngx_stream_proxy_connect_handler(ngx_event_t *ev);
 static ngx_int_t ngx_stream_proxy_test_connect(ngx_connection_t *c);
+static ngx_stream_upstream_rr_peer_data_t *ngx_stream_proxy_race_data(
+    ngx_stream_upstream_t *u);
+static void ngx_stream_proxy_stagger(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf);
+static void ngx_stream_proxy_stagger_handler(ngx_event_t *ev);
+static ngx_msec_t ngx_stream_proxy_hedge_threshold(
+    ngx_stream_proxy_srv_conf_t *pscf, ngx_peer_connection_t *pc);
+static void ngx_stream_proxy_hedge_record(ngx_stream_proxy_srv_conf_t *pscf,
+    struct sockaddr *sockaddr, socklen_t socklen, ngx_msec_t time);
+static void ngx_stream_proxy_race_handler(ngx_stream_session_t *s,
+    ngx_event_t *ev);
+static void ngx_stream_proxy_attempt_resume(ngx_stream_session_t *s);
+static void ngx_stream_proxy_attempt_close(ngx_stream_session_t *s,
+    ngx_uint_t state);
+static void ngx_stream_proxy_race_release(
+    ngx_stream_upstream_rr_peer_data_t *rrp,
+    ngx_stream_upstream_rr_peer_t *peer);
+#if (NGX_HAVE_INET6)
+static ngx_int_t ngx_stream_proxy_interleave_addrs(ngx_pool_t *pool,
+    ngx_stream_upstream_resolved_t *ur);
+#endif
 static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
+static void ngx_stream_proxy_idle_timer(ngx_stream_session_t *s,
+    ngx_msec_t timeout);
 static ngx_int_t ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream);
+#if (NGX_LINUX)
+static ngx_int_t ngx_stream_proxy_udp_recv_batch(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf);
+static ngx_chain_t *ngx_stream_proxy_udp_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+#endif
+static ngx_stream_proxy_ctx_t *ngx_stream_proxy_get_ctx(
+    ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_proxy_qos_init(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf);
+static void ngx_stream_proxy_yield(ngx_stream_session_t *s, ngx_event_t *ev,
+    off_t cost);
+static void ngx_stream_proxy_qos_account(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream, off_t bytes);
+static void ngx_stream_proxy_qos_handler(ngx_event_t *ev);
+static ngx_int_t ngx_stream_proxy_coalesce_init(ngx_stream_session_t *s);
+static ngx_uint_t ngx_stream_proxy_coalesce(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream, ngx_buf_t *b, ssize_t n);
+static ngx_uint_t ngx_stream_proxy_coalesce_pending(ngx_stream_session_t *s);
+static void ngx_stream_proxy_coalesce_flushed(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream);
+static void ngx_stream_proxy_flush_handler(ngx_event_t *ev);
+static ngx_int_t ngx_stream_proxy_rate_init(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf);
+static ngx_msec_t ngx_stream_proxy_rate(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream, size_t rate, off_t n);
+static ngx_msec_t ngx_stream_proxy_rate_account(ngx_stream_proxy_bucket_t *bk,
+    size_t rate, size_t burst, off_t n);
+static off_t ngx_stream_proxy_rate_limit(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream, size_t rate);
+static ngx_uint_t ngx_stream_proxy_rate_drained(ngx_stream_proxy_bucket_t *bk);
+static ngx_stream_proxy_rate_node_t *ngx_stream_proxy_rate_lookup(
+    ngx_stream_proxy_rate_zone_t *zone, ngx_str_t *key, uint32_t hash);
+static void ngx_stream_proxy_rate_expire(ngx_stream_proxy_rate_zone_t *zone,
+    ngx_uint_t n);
+static void ngx_stream_proxy_rate_cleanup(void *data);
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
 static void ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc);
+static ngx_int_t ngx_stream_proxy_udp_cache_init_peer(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf);
+static ngx_int_t ngx_stream_proxy_get_udp_cached_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_stream_proxy_free_udp_cached_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static void ngx_stream_proxy_udp_cache_dummy_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_udp_cache_close_handler(ngx_event_t *ev);
+static ngx_int_t ngx_stream_proxy_udp_shared_join(ngx_peer_connection_t *pc,
+    ngx_stream_proxy_udp_cache_peer_data_t *cp);
+static ngx_stream_proxy_udp_cache_item_t *ngx_stream_proxy_udp_shared_open(
+    ngx_peer_connection_t *pc, ngx_stream_proxy_udp_cache_t *cache);
+static void ngx_stream_proxy_udp_shared_leave(ngx_stream_session_t *s);
+static void ngx_stream_proxy_udp_shared_close(
+    ngx_stream_proxy_udp_cache_item_t *item);
+static void ngx_stream_proxy_udp_shared_read_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_udp_shared_write_handler(ngx_event_t *ev);
+static ssize_t ngx_stream_proxy_udp_shared_recv(ngx_connection_t *c,
+    u_char *buf, size_t size);
+static uint32_t ngx_stream_proxy_udp_id_key(ngx_stream_proxy_udp_cache_t *cache,
+    u_char *p, u_char *id);
+static ngx_stream_proxy_udp_id_t *ngx_stream_proxy_udp_id_lookup(
+    ngx_rbtree_t *rbtree, u_char *id, uint32_t hash);
+static void ngx_stream_proxy_udp_id_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_stream_proxy_udp_id(ngx_stream_session_t *s, u_char *p,
+    size_t n);
+static ngx_int_t ngx_stream_proxy_prewarm_init_peer(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf);
+static ngx_int_t ngx_stream_proxy_get_prewarm_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_stream_proxy_free_prewarm_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+#if (NGX_STREAM_SSL)
+static ngx_int_t ngx_stream_proxy_prewarm_set_session(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_stream_proxy_prewarm_save_session(ngx_peer_connection_t *pc,
+    void *data);
+#endif
+static void ngx_stream_proxy_prewarm_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_prewarm_connect(ngx_stream_proxy_prewarm_t *pw);
+static void ngx_stream_proxy_prewarm_connect_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_prewarm_ready(
+    ngx_stream_proxy_prewarm_item_t *item);
+static void ngx_stream_proxy_prewarm_dummy_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_prewarm_close_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_prewarm_close(
+    ngx_stream_proxy_prewarm_item_t *item);
+static ngx_int_t ngx_stream_proxy_breaker_init_peer(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf);
+static ngx_int_t ngx_stream_proxy_get_breaker_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_stream_proxy_breaker_skip(
+    ngx_stream_proxy_breaker_peer_data_t *bp, ngx_peer_connection_t *pc);
+static void ngx_stream_proxy_free_breaker_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+#if (NGX_STREAM_SSL)
+static ngx_int_t ngx_stream_proxy_breaker_set_session(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_stream_proxy_breaker_save_session(ngx_peer_connection_t *pc,
+    void *data);
+#endif
+static ngx_int_t ngx_stream_proxy_breaker_allow(
+    ngx_stream_proxy_breaker_t *breaker, ngx_peer_connection_t *pc);
+static void ngx_stream_proxy_breaker_record(
+    ngx_stream_proxy_breaker_t *breaker, ngx_peer_connection_t *pc,
+    ngx_uint_t failed);
+static ngx_stream_proxy_breaker_node_t *ngx_stream_proxy_breaker_lookup(
+    ngx_stream_proxy_breaker_zone_t *zone, ngx_peer_connection_t *pc,
+    uint32_t hash);
+static void ngx_stream_proxy_breaker_expire(
+    ngx_stream_proxy_breaker_zone_t *zone, ngx_uint_t n);
+static ngx_int_t ngx_stream_proxy_health_init(ngx_cycle_t *cycle,
+    ngx_stream_proxy_health_t *hc);
+static void ngx_stream_proxy_health_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_health_check(ngx_stream_proxy_health_peer_t *hp);
+static void ngx_stream_proxy_health_write_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_health_read_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_health_dummy_handler(ngx_event_t *ev);
+static void ngx_stream_proxy_health_done(ngx_stream_proxy_health_peer_t *hp,
+    ngx_uint_t ok);
+static ngx_int_t ngx_stream_proxy_init_process(ngx_cycle_t *cycle);
 static u_char *ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf,
     size_t len);
 
+static ngx_int_t ngx_stream_proxy_budget_yields_variable(
+    ngx_stream_session_t *s, ngx_stream_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_stream_proxy_qos_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_stream_proxy_pass_cache_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_stream_proxy_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_stream_proxy_init(ngx_conf_t *cf);
+static void *ngx_stream_proxy_create_main_conf(ngx_conf_t *cf);
+static char *ngx_stream_proxy_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf);
 static char *ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent,
     void *child);
+static ngx_uint_t ngx_stream_proxy_listen_type(ngx_conf_t *cf,
+    ngx_stream_proxy_srv_conf_t *conf, int type);
 static char *ngx_stream_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_stream_proxy_connect_hedge(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_stream_proxy_udp_socket_cache_id(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_stream_proxy_udp_offload_check(ngx_conf_t *cf, void *post,
+    void *data);
+static char *ngx_stream_proxy_protocol_trusted(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_stream_proxy_qos_class(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_stream_proxy_rate_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_stream_proxy_rate_shared(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_stream_proxy_init_rate_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_stream_proxy_rate_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static char *ngx_stream_proxy_circuit_breaker(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_stream_proxy_health_check_conf(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_stream_proxy_init_breaker_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_stream_proxy_breaker_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
 static ngx_int_t ngx_stream_proxy_add_v2_tlv(ngx_proxy_protocol_t *prx,
     ngx_proxy_protocol_t *old_prx,ngx_str_t *str, char type, size_t next_v);
 static size_t ngx_stream_proxy_make_v2_tlv(unsigned char *dest, size_t dest_len, 
@@ -116,6 +848,35 @@ static void ngx_stream_proxy_ssl_handshake(ngx_connection_t *pc);
 static void ngx_stream_proxy_ssl_save_session(ngx_connection_t *c);
 static ngx_int_t ngx_stream_proxy_ssl_name(ngx_stream_session_t *s);
 static ngx_int_t ngx_stream_proxy_ssl_certificate(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_proxy_ssl_cached_certificate(ngx_connection_t *c,
+    ngx_stream_proxy_ssl_cert_cache_t *cache, ngx_str_t *cert,
+    ngx_str_t *key, ngx_array_t *passwords);
+static void ngx_stream_proxy_ssl_cert_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_stream_proxy_ssl_cert_cmp(
+    ngx_stream_proxy_ssl_cert_node_t *cn, ngx_str_t *cert, ngx_str_t *key,
+    ngx_array_t *passwords);
+static ngx_stream_proxy_ssl_cert_node_t *ngx_stream_proxy_ssl_cert_lookup(
+    ngx_stream_proxy_ssl_cert_cache_t *cache, uint32_t hash, ngx_str_t *cert,
+    ngx_str_t *key, ngx_array_t *passwords);
+static ngx_stream_proxy_ssl_cert_node_t *ngx_stream_proxy_ssl_cert_create(
+    ngx_connection_t *c, ngx_stream_proxy_ssl_cert_cache_t *cache,
+    uint32_t hash, ngx_str_t *cert, ngx_str_t *key, ngx_array_t *passwords);
+static ngx_int_t ngx_stream_proxy_ssl_cert_changed(ngx_connection_t *c,
+    ngx_stream_proxy_ssl_cert_node_t *cn);
+static ngx_int_t ngx_stream_proxy_ssl_cert_file(ngx_connection_t *c,
+    ngx_str_t *name, ngx_str_t *path, time_t *mtime);
+static ngx_int_t ngx_stream_proxy_ssl_cert_load(ngx_connection_t *c,
+    ngx_stream_proxy_ssl_cert_node_t *cn, ngx_str_t *cert, ngx_str_t *key);
+static int ngx_stream_proxy_ssl_cert_password(char *buf, int size, int rwflag,
+    void *userdata);
+static void ngx_stream_proxy_ssl_cert_expire(
+    ngx_stream_proxy_ssl_cert_cache_t *cache, time_t now);
+static void ngx_stream_proxy_ssl_cert_free(
+    ngx_stream_proxy_ssl_cert_cache_t *cache,
+    ngx_stream_proxy_ssl_cert_node_t *cn);
+static char *ngx_stream_proxy_ssl_certificate_cache(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 static ngx_int_t ngx_stream_proxy_merge_ssl(ngx_conf_t *cf,
     ngx_stream_proxy_srv_conf_t *conf, ngx_stream_proxy_srv_conf_t *prev);
 static ngx_int_t ngx_stream_proxy_set_ssl(ngx_conf_t *cf,
@@ -138,6 +899,14 @@ static ngx_conf_post_t  ngx_stream_proxy_ssl_conf_command_post =
 #endif
 
 
+static ngx_conf_num_bounds_t  ngx_stream_proxy_udp_batch_bounds = {
+    ngx_conf_check_num_bounds, 1, NGX_STREAM_PROXY_UDP_BATCH_MAX
+};
+
+static ngx_conf_post_t  ngx_stream_proxy_udp_offload_post =
+    { ngx_stream_proxy_udp_offload_check };
+
+
 static ngx_conf_deprecated_t  ngx_conf_deprecated_proxy_downstream_buffer = {
     ngx_conf_deprecated, "proxy_downstream_buffer", "proxy_buffer_size"
 };
@@ -156,8 +925,22 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       0,
       NULL },
 
+    { ngx_string("proxy_pass_cache"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, pass_cache_size),
+      NULL },
+
+    { ngx_string("proxy_resolve_cache"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, resolve_cache_size),
+      NULL },
+
     { ngx_string("proxy_bind"),
-      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE12,
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
       ngx_stream_proxy_bind,
       NGX_STREAM_SRV_CONF_OFFSET,
       0,
@@ -177,6 +960,20 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, connect_timeout),
       NULL },
 
+    { ngx_string("proxy_connect_stagger"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, connect_stagger),
+      NULL },
+
+    { ngx_string("proxy_connect_hedge"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_proxy_connect_hedge,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("proxy_timeout"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -191,16 +988,58 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, buffer_size),
       NULL },
 
-    { ngx_string("proxy_downstream_buffer"),
+    { ngx_string("proxy_read_budget"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
       NGX_STREAM_SRV_CONF_OFFSET,
-      offsetof(ngx_stream_proxy_srv_conf_t, buffer_size),
-      &ngx_conf_deprecated_proxy_downstream_buffer },
+      offsetof(ngx_stream_proxy_srv_conf_t, read_budget),
+      NULL },
 
-    { ngx_string("proxy_upstream_buffer"),
+    { ngx_string("proxy_read_budget_iterations"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_size_slot,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, read_budget_iterations),
+      NULL },
+
+    { ngx_string("proxy_coalesce"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, coalesce),
+      NULL },
+
+    { ngx_string("proxy_coalesce_timeout"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, coalesce_timeout),
+      NULL },
+
+    { ngx_string("proxy_qos_class"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_stream_proxy_qos_class,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("proxy_qos"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_set_complex_value_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, qos),
+      NULL },
+
+    { ngx_string("proxy_downstream_buffer"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, buffer_size),
+      &ngx_conf_deprecated_proxy_downstream_buffer },
+
+    { ngx_string("proxy_upstream_buffer"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
       NGX_STREAM_SRV_CONF_OFFSET,
       offsetof(ngx_stream_proxy_srv_conf_t, buffer_size),
       &ngx_conf_deprecated_proxy_upstream_buffer },
@@ -219,6 +1058,27 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, download_rate),
       NULL },
 
+    { ngx_string("proxy_rate_burst"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, rate_burst),
+      NULL },
+
+    { ngx_string("proxy_rate_zone"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_stream_proxy_rate_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("proxy_rate_shared"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_proxy_rate_shared,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("proxy_requests"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_num_slot,
@@ -282,6 +1142,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, proxy_protocol_tlv_auth),
       NULL },
 
+    { ngx_string("proxy_protocol_trusted"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_proxy_protocol_trusted,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("proxy_half_close"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -289,6 +1156,83 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, half_close),
       NULL },
 
+    { ngx_string("proxy_udp_batch"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, udp_batch),
+      &ngx_stream_proxy_udp_batch_bounds },
+
+    { ngx_string("proxy_udp_gso"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, udp_gso),
+      &ngx_stream_proxy_udp_offload_post },
+
+    { ngx_string("proxy_udp_gro"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, udp_gro),
+      &ngx_stream_proxy_udp_offload_post },
+
+    { ngx_string("proxy_udp_socket_cache"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, udp_socket_cache),
+      NULL },
+
+    { ngx_string("proxy_udp_socket_cache_timeout"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, udp_socket_cache_timeout),
+      NULL },
+
+    { ngx_string("proxy_udp_socket_cache_id"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_proxy_udp_socket_cache_id,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("proxy_prewarm"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, prewarm),
+      NULL },
+
+    { ngx_string("proxy_prewarm_timeout"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, prewarm_timeout),
+      NULL },
+
+    { ngx_string("proxy_prewarm_rate"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, prewarm_rate),
+      NULL },
+
+    { ngx_string("proxy_circuit_breaker"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
+      ngx_stream_proxy_circuit_breaker,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("proxy_health_check"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_ANY,
+      ngx_stream_proxy_health_check_conf,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
 #if (NGX_STREAM_SSL)
 
     { ngx_string("proxy_ssl"),
@@ -375,6 +1319,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, ssl_certificate_key),
       NULL },
 
+    { ngx_string("proxy_ssl_certificate_cache"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE123,
+      ngx_stream_proxy_ssl_certificate_cache,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("proxy_ssl_password_file"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_stream_proxy_ssl_password_file,
@@ -389,18 +1340,59 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, ssl_conf_commands),
       &ngx_stream_proxy_ssl_conf_command_post },
 
+    { ngx_string("proxy_ssl_ktls"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, ssl_ktls),
+      NULL },
+
 #endif
 
       ngx_null_command
 };
 
 
+static ngx_stream_variable_t  ngx_stream_proxy_vars[] = {
+
+    { ngx_string("proxy_budget_yields"), NULL,
+      ngx_stream_proxy_budget_yields_variable, 0,
+      NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("proxy_worker_budget_yields"), NULL,
+      ngx_stream_proxy_budget_yields_variable, 1,
+      NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("proxy_qos_class"), NULL,
+      ngx_stream_proxy_qos_variable, NGX_STREAM_PROXY_QOS_CLASS,
+      NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("proxy_qos_wait"), NULL,
+      ngx_stream_proxy_qos_variable, NGX_STREAM_PROXY_QOS_WAIT,
+      NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("proxy_qos_class_bytes"), NULL,
+      ngx_stream_proxy_qos_variable, NGX_STREAM_PROXY_QOS_CLASS_BYTES,
+      NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("proxy_qos_class_wait"), NULL,
+      ngx_stream_proxy_qos_variable, NGX_STREAM_PROXY_QOS_CLASS_WAIT,
+      NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("proxy_pass_cache"), NULL,
+      ngx_stream_proxy_pass_cache_variable, 0,
+      NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
+      ngx_stream_null_variable
+};
+
+
 static ngx_stream_module_t  ngx_stream_proxy_module_ctx = {
-    NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_stream_proxy_add_variables,        /* preconfiguration */
+    ngx_stream_proxy_init,                 /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_stream_proxy_create_main_conf,     /* create main configuration */
+    ngx_stream_proxy_init_main_conf,       /* init main configuration */
 
     ngx_stream_proxy_create_srv_conf,      /* create server configuration */
     ngx_stream_proxy_merge_srv_conf        /* merge server configuration */
@@ -414,7 +1406,7 @@ ngx_module_t  ngx_stream_proxy_module = {
     NGX_STREAM_MODULE,                     /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_stream_proxy_init_process,         /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -429,16 +1421,19 @@ ngx_module_t  ngx_stream_proxy_module = {
 static void
 ngx_stream_proxy_handler(ngx_stream_session_t *s)
 {
-    u_char                           *p;
-    ngx_str_t                        *host;
-    ngx_uint_t                        i;
-    ngx_connection_t                 *c;
-    ngx_resolver_ctx_t               *ctx, temp;
-    ngx_stream_upstream_t            *u;
-    ngx_stream_core_srv_conf_t       *cscf;
-    ngx_stream_proxy_srv_conf_t      *pscf;
-    ngx_stream_upstream_srv_conf_t   *uscf, **uscfp;
-    ngx_stream_upstream_main_conf_t  *umcf;
+    u_char                          *p;
+    size_t                           size;
+    ngx_int_t                        rc;
+    ngx_str_t                       *host;
+    ngx_uint_t                       key;
+    ngx_connection_t                *c;
+    ngx_resolver_ctx_t              *ctx, temp;
+    ngx_stream_upstream_t           *u;
+    ngx_stream_core_srv_conf_t      *cscf;
+    ngx_stream_proxy_srv_conf_t     *pscf;
+    ngx_stream_proxy_main_conf_t    *pmcf;
+    ngx_stream_upstream_srv_conf_t  *uscf;
+    u_char                           name[NGX_MAXHOSTNAMELEN + 6];
 
     c = s->connection;
 
@@ -459,6 +1454,11 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
 
     u->requests = 1;
 
+    if (pscf->qos && ngx_stream_proxy_qos_init(s, pscf) != NGX_OK) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
     u->peer.log = c->log;
     u->peer.log_error = NGX_ERROR_ERR;
 
@@ -484,14 +1484,22 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
         return;
     }
 
-    p = ngx_pnalloc(c->pool, pscf->buffer_size);
+    /* client datagrams are queued until a batch is sent to upstream */
+
+    size = pscf->buffer_size;
+
+    if (c->type == SOCK_DGRAM) {
+        size *= pscf->udp_batch;
+    }
+
+    p = ngx_pnalloc(c->pool, size);
     if (p == NULL) {
         ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
     }
 
     u->downstream_buf.start = p;
-    u->downstream_buf.end = p + pscf->buffer_size;
+    u->downstream_buf.end = p + size;
     u->downstream_buf.pos = p;
     u->downstream_buf.last = p;
 
@@ -518,19 +1526,19 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
 
         host = &u->resolved->host;
 
-        umcf = ngx_stream_get_module_main_conf(s, ngx_stream_upstream_module);
+        pmcf = ngx_stream_get_module_main_conf(s, ngx_stream_proxy_module);
 
-        uscfp = umcf->upstreams.elts;
+        if (pmcf->upstreams.size && host->len < NGX_MAXHOSTNAMELEN) {
 
-        for (i = 0; i < umcf->upstreams.nelts; i++) {
+            /* no_port means port 0, as for upstream blocks */
 
-            uscf = uscfp[i];
+            p = ngx_sprintf(name, "%V:%d", host, (int) u->resolved->port);
 
-            if (uscf->host.len == host->len
-                && ((uscf->port == 0 && u->resolved->no_port)
-                     || uscf->port == u->resolved->port)
-                && ngx_strncasecmp(uscf->host.data, host->data, host->len) == 0)
-            {
+            key = ngx_hash_strlow(name, name, p - name);
+
+            uscf = ngx_hash_find(&pmcf->upstreams, key, name, p - name);
+
+            if (uscf) {
                 goto found;
             }
         }
@@ -565,6 +1573,28 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
             return;
         }
 
+        if (pscf->resolve_cache) {
+            rc = ngx_stream_proxy_resolve_cache_lookup(s, pscf, u->resolved);
+
+            if (rc == NGX_ERROR) {
+                ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
+            if (rc == NGX_OK) {
+                u->peer.start_time = ngx_current_msec;
+
+                if (pscf->next_upstream_tries
+                    && u->peer.tries > pscf->next_upstream_tries)
+                {
+                    u->peer.tries = pscf->next_upstream_tries;
+                }
+
+                ngx_stream_proxy_connect(s);
+                return;
+            }
+        }
+
         temp.name = *host;
 
         cscf = ngx_stream_get_module_srv_conf(s, ngx_stream_core_module);
@@ -633,6 +1663,7 @@ static ngx_int_t
 ngx_stream_proxy_eval(ngx_stream_session_t *s,
     ngx_stream_proxy_srv_conf_t *pscf)
 {
+    ngx_int_t               rc;
     ngx_str_t               host;
     ngx_url_t               url;
     ngx_stream_upstream_t  *u;
@@ -641,6 +1672,14 @@ ngx_stream_proxy_eval(ngx_stream_session_t *s,
         return NGX_ERROR;
     }
 
+    if (pscf->pass_cache) {
+        rc = ngx_stream_proxy_pass_cache_lookup(s, pscf->pass_cache, &host);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     ngx_memzero(&url, sizeof(ngx_url_t));
 
     url.url = host;
@@ -674,132 +1713,446 @@ ngx_stream_proxy_eval(ngx_stream_session_t *s,
     u->resolved->port = url.port;
     u->resolved->no_port = url.no_port;
 
+    if (pscf->pass_cache) {
+        ngx_stream_proxy_pass_cache_add(s, pscf->pass_cache, &host);
+    }
+
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_stream_proxy_set_local(ngx_stream_session_t *s, ngx_stream_upstream_t *u,
-    ngx_stream_upstream_local_t *local)
+ngx_stream_proxy_pass_cache_lookup(ngx_stream_session_t *s,
+    ngx_stream_proxy_pass_cache_t *cache, ngx_str_t *key)
 {
-    ngx_int_t    rc;
-    ngx_str_t    val;
-    ngx_addr_t  *addr;
+    u_char                          *p;
+    uint32_t                         hash;
+    ngx_stream_upstream_t           *u;
+    ngx_stream_proxy_pass_node_t    *pn;
+    ngx_stream_upstream_resolved_t  *ur;
 
-    if (local == NULL) {
-        u->peer.local = NULL;
-        return NGX_OK;
-    }
+    u = s->upstream;
 
-#if (NGX_HAVE_TRANSPARENT_PROXY)
-    u->peer.transparent = local->transparent;
-#endif
+    hash = ngx_crc32_long(key->data, key->len);
 
-    if (local->value == NULL) {
-        u->peer.local = local->addr;
-        return NGX_OK;
-    }
+    pn = (ngx_stream_proxy_pass_node_t *)
+             ngx_str_rbtree_lookup(&cache->rbtree, key, hash);
 
-    if (ngx_stream_complex_value(s, local->value, &val) != NGX_OK) {
-        return NGX_ERROR;
-    }
+    if (pn == NULL) {
+        cache->misses++;
+        u->pass_cache = NGX_STREAM_PROXY_PASS_CACHE_MISS;
 
-    if (val.len == 0) {
-        return NGX_OK;
-    }
+        ngx_log_debug3(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "proxy pass cache miss \"%V\", %ui/%ui",
+                       key, cache->hits, cache->misses);
 
-    addr = ngx_palloc(s->connection->pool, sizeof(ngx_addr_t));
-    if (addr == NULL) {
-        return NGX_ERROR;
+        return NGX_DECLINED;
     }
 
-    rc = ngx_parse_addr_port(s->connection->pool, addr, val.data, val.len);
-    if (rc == NGX_ERROR) {
+    cache->hits++;
+    u->pass_cache = NGX_STREAM_PROXY_PASS_CACHE_HIT;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "proxy pass cache hit \"%V\", %ui/%ui",
+                   key, cache->hits, cache->misses);
+
+    ngx_queue_remove(&pn->queue);
+    ngx_queue_insert_head(&cache->queue, &pn->queue);
+
+    /*
+     * the node may be evicted while the session still runs,
+     * so the parsed values are copied with a single allocation
+     */
+
+    p = ngx_palloc(s->connection->pool,
+                   sizeof(ngx_stream_upstream_resolved_t)
+                   + pn->socklen + pn->host.len + pn->name.len);
+    if (p == NULL) {
         return NGX_ERROR;
     }
 
-    if (rc != NGX_OK) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                      "invalid local address \"%V\"", &val);
-        return NGX_OK;
+    ur = (ngx_stream_upstream_resolved_t *) p;
+    p += sizeof(ngx_stream_upstream_resolved_t);
+
+    ngx_memzero(ur, sizeof(ngx_stream_upstream_resolved_t));
+
+    if (pn->sockaddr) {
+        ur->sockaddr = (struct sockaddr *) p;
+        ur->socklen = pn->socklen;
+        p = ngx_cpymem(p, pn->sockaddr, pn->socklen);
+
+        ur->name.data = p;
+        ur->name.len = pn->name.len;
+        p = ngx_cpymem(p, pn->name.data, pn->name.len);
+
+        ur->naddrs = 1;
     }
 
-    addr->name = val;
-    u->peer.local = addr;
+    ur->host.data = p;
+    ur->host.len = pn->host.len;
+    ngx_memcpy(p, pn->host.data, pn->host.len);
+
+    ur->port = pn->port;
+    ur->no_port = pn->no_port;
+
+    u->resolved = ur;
 
     return NGX_OK;
 }
 
 
 static void
-ngx_stream_proxy_connect(ngx_stream_session_t *s)
+ngx_stream_proxy_pass_cache_add(ngx_stream_session_t *s,
+    ngx_stream_proxy_pass_cache_t *cache, ngx_str_t *key)
 {
-    ngx_int_t                     rc;
-    ngx_connection_t             *c, *pc;
-    ngx_stream_upstream_t        *u;
-    ngx_stream_proxy_srv_conf_t  *pscf;
+    u_char                          *p;
+    size_t                           size;
+    ngx_queue_t                     *q;
+    ngx_stream_proxy_pass_node_t    *pn;
+    ngx_stream_upstream_resolved_t  *ur;
 
-    c = s->connection;
+    ur = s->upstream->resolved;
 
-    c->log->action = "connecting to upstream";
+    if (cache->count == cache->max) {
+        q = ngx_queue_last(&cache->queue);
+        pn = ngx_queue_data(q, ngx_stream_proxy_pass_node_t, queue);
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->rbtree, &pn->sn.node);
 
-    u = s->upstream;
+        ngx_free(pn);
+        cache->count--;
+    }
 
-    u->connected = 0;
-    u->proxy_protocol = pscf->proxy_protocol;
-    u->proxy_protocol_version = pscf->proxy_protocol_version;
-    u->proxy_protocol_tlv_alpn = &pscf->proxy_protocol_tlv_alpn;
-    u->proxy_protocol_tlv_auth = &pscf->proxy_protocol_tlv_auth;
-    
+    size = offsetof(ngx_stream_proxy_pass_node_t, data)
+           + key->len + ur->host.len;
 
-    if (u->state) {
-        u->state->response_time = ngx_current_msec - u->start_time;
+    if (ur->sockaddr) {
+        size += ur->socklen + ur->name.len;
     }
 
-    u->state = ngx_array_push(s->upstream_states);
-    if (u->state == NULL) {
-        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    pn = ngx_alloc(size, s->connection->log);
+    if (pn == NULL) {
         return;
     }
 
-    ngx_memzero(u->state, sizeof(ngx_stream_upstream_state_t));
+    ngx_memzero(pn, offsetof(ngx_stream_proxy_pass_node_t, data));
 
-    u->start_time = ngx_current_msec;
+    p = pn->data;
 
-    u->state->connect_time = (ngx_msec_t) -1;
-    u->state->first_byte_time = (ngx_msec_t) -1;
-    u->state->response_time = (ngx_msec_t) -1;
+    pn->sn.str.data = p;
+    pn->sn.str.len = key->len;
+    pn->sn.node.key = ngx_crc32_long(key->data, key->len);
+    p = ngx_cpymem(p, key->data, key->len);
 
-    rc = ngx_event_connect_peer(&u->peer);
+    pn->host.data = p;
+    pn->host.len = ur->host.len;
+    p = ngx_cpymem(p, ur->host.data, ur->host.len);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0, "proxy connect: %i", rc);
+    if (ur->sockaddr) {
+        pn->sockaddr = (struct sockaddr *) p;
+        pn->socklen = ur->socklen;
+        p = ngx_cpymem(p, ur->sockaddr, ur->socklen);
 
-    if (rc == NGX_ERROR) {
-        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-        return;
+        pn->name.data = p;
+        pn->name.len = ur->name.len;
+        ngx_memcpy(p, ur->name.data, ur->name.len);
     }
 
-    u->state->peer = u->peer.name;
+    pn->port = ur->port;
+    pn->no_port = ur->no_port;
 
-    if (rc == NGX_BUSY) {
-        ngx_log_error(NGX_LOG_ERR, c->log, 0, "no live upstreams");
-        ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
-        return;
-    }
+    ngx_rbtree_insert(&cache->rbtree, &pn->sn.node);
+    ngx_queue_insert_head(&cache->queue, &pn->queue);
 
-    if (rc == NGX_DECLINED) {
-        ngx_stream_proxy_next_upstream(s);
-        return;
-    }
+    cache->count++;
+}
 
-    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
 
-    pc = u->peer.connection;
+static ngx_int_t
+ngx_stream_proxy_set_local(ngx_stream_session_t *s, ngx_stream_upstream_t *u,
+    ngx_stream_upstream_local_t *local)
+{
+    ngx_str_t    val;
+    ngx_uint_t   i;
+    ngx_addr_t  *addr, tmp;
 
-    pc->data = s;
-    pc->log = c->log;
+    if (local == NULL) {
+        u->peer.local = NULL;
+        return NGX_OK;
+    }
+
+#if (NGX_HAVE_TRANSPARENT_PROXY)
+    u->peer.transparent = local->transparent;
+#endif
+
+    if (local->value == NULL) {
+        u->peer.local = ngx_stream_proxy_next_local(local);
+        return NGX_OK;
+    }
+
+    if (ngx_stream_complex_value(s, local->value, &val) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (val.len == 0) {
+        return NGX_OK;
+    }
+
+    for (i = 0; i < local->ncache; i++) {
+        addr = &local->cache[i];
+
+        if (addr->name.len != val.len
+            || ngx_strncmp(addr->name.data, val.data, val.len) != 0)
+        {
+            continue;
+        }
+
+        /* the most recently used entry goes first */
+
+        if (i) {
+            tmp = *addr;
+            ngx_memmove(&local->cache[1], &local->cache[0],
+                        i * sizeof(ngx_addr_t));
+            local->cache[0] = tmp;
+        }
+
+        return ngx_stream_proxy_copy_local(s, u, &local->cache[0], &val);
+    }
+
+    return ngx_stream_proxy_cache_local(s, u, local, &val);
+}
+
+
+/*
+ * source addresses are rotated per worker, each of them has its own
+ * range of ephemeral ports; sessions, warm connections and health
+ * checks share the rotation
+ */
+
+static ngx_addr_t *
+ngx_stream_proxy_next_local(ngx_stream_upstream_local_t *local)
+{
+    ngx_addr_t  *addr;
+
+    addr = &local->addr[local->next];
+
+    if (++local->next == local->naddrs) {
+        local->next = 0;
+    }
+
+    return addr;
+}
+
+
+/*
+ * the values of a variable proxy_bind are parsed once per worker and
+ * kept in a small cache, the least recently used one is replaced when
+ * it is full; sessions bind to a copy, so an entry can be replaced
+ * while a session still needs the address for its next upstream attempt
+ */
+
+static ngx_int_t
+ngx_stream_proxy_cache_local(ngx_stream_session_t *s,
+    ngx_stream_upstream_t *u, ngx_stream_upstream_local_t *local,
+    ngx_str_t *val)
+{
+    u_char      *p;
+    ngx_int_t    rc;
+    ngx_addr_t  *addr, tmp;
+
+    if (local->cache == NULL) {
+        local->cache = ngx_alloc(NGX_STREAM_PROXY_BIND_CACHE
+                                 * sizeof(ngx_addr_t), s->connection->log);
+        if (local->cache == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    rc = ngx_parse_addr_port(s->connection->pool, &tmp, val->data,
+                             val->len);
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "invalid local address \"%V\"", val);
+        return NGX_OK;
+    }
+
+    p = ngx_alloc(tmp.socklen + val->len, s->connection->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (local->ncache == NGX_STREAM_PROXY_BIND_CACHE) {
+        addr = &local->cache[--local->ncache];
+
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "proxy bind cache replaces \"%V\"", &addr->name);
+
+        /* the name is allocated along with the sockaddr */
+
+        ngx_free(addr->sockaddr);
+    }
+
+    ngx_memmove(&local->cache[1], &local->cache[0],
+                local->ncache * sizeof(ngx_addr_t));
+    local->ncache++;
+
+    addr = &local->cache[0];
+
+    addr->sockaddr = (struct sockaddr *) p;
+    addr->socklen = tmp.socklen;
+    p = ngx_cpymem(p, tmp.sockaddr, tmp.socklen);
+
+    addr->name.len = val->len;
+    addr->name.data = p;
+    ngx_memcpy(p, val->data, val->len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "proxy bind cached \"%V\"", val);
+
+    return ngx_stream_proxy_copy_local(s, u, addr, val);
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_copy_local(ngx_stream_session_t *s,
+    ngx_stream_upstream_t *u, ngx_addr_t *cached, ngx_str_t *val)
+{
+    ngx_addr_t  *addr;
+
+    addr = ngx_palloc(s->connection->pool,
+                      sizeof(ngx_addr_t) + cached->socklen);
+    if (addr == NULL) {
+        return NGX_ERROR;
+    }
+
+    addr->sockaddr = (struct sockaddr *) ((u_char *) addr
+                                          + sizeof(ngx_addr_t));
+    addr->socklen = cached->socklen;
+    ngx_memcpy(addr->sockaddr, cached->sockaddr, cached->socklen);
+
+    addr->name = *val;
+
+    u->peer.local = addr;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_proxy_connect(ngx_stream_session_t *s)
+{
+    ngx_int_t                     rc;
+    ngx_connection_t             *c, *pc;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_ctx_t       *ctx;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    c = s->connection;
+
+    c->log->action = "connecting to upstream";
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    u = s->upstream;
+
+    u->connected = 0;
+    u->proxy_protocol = pscf->proxy_protocol;
+    u->proxy_protocol_version = pscf->proxy_protocol_version;
+    u->proxy_protocol_tlv_alpn = &pscf->proxy_protocol_tlv_alpn;
+    u->proxy_protocol_tlv_auth = &pscf->proxy_protocol_tlv_auth;
+    
+
+    if (u->state) {
+        u->state->response_time = ngx_current_msec - u->start_time;
+    }
+
+    u->state = ngx_array_push(s->upstream_states);
+    if (u->state == NULL) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_memzero(u->state, sizeof(ngx_stream_upstream_state_t));
+
+    u->start_time = ngx_current_msec;
+
+    u->state->connect_time = (ngx_msec_t) -1;
+    u->state->first_byte_time = (ngx_msec_t) -1;
+    u->state->response_time = (ngx_msec_t) -1;
+
+    /* open peers are skipped before any cached connection is looked up */
+
+    if (pscf->breaker
+        && ngx_stream_proxy_breaker_init_peer(s, pscf) != NGX_OK)
+    {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (pscf->udp_cache && u->peer.type == SOCK_DGRAM
+        && ngx_stream_proxy_udp_cache_init_peer(s, pscf) != NGX_OK)
+    {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (pscf->prewarm_pool && u->upstream == pscf->upstream
+        && u->peer.type == SOCK_STREAM
+        && ngx_stream_proxy_prewarm_init_peer(s, pscf) != NGX_OK)
+    {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    rc = ngx_event_connect_peer(&u->peer);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0, "proxy connect: %i", rc);
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx && ctx->attempt.connection
+        && (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED))
+    {
+        /* the earlier attempt is still in progress, keep waiting for it */
+
+        if (u->peer.sockaddr) {
+            u->peer.free(&u->peer, u->peer.data,
+                         rc == NGX_DECLINED ? NGX_PEER_FAILED : 0);
+        }
+
+        ngx_stream_proxy_attempt_resume(s);
+        return;
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    u->state->peer = u->peer.name;
+
+    if (rc == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0, "no live upstreams");
+        ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
+        return;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_stream_proxy_next_upstream(s);
+        return;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
+
+    pc = u->peer.connection;
+
+    pc->data = s;
+    pc->log = c->log;
     pc->pool = c->pool;
     pc->read->log = c->log;
     pc->write->log = c->log;
@@ -813,6 +2166,14 @@ ngx_stream_proxy_connect(ngx_stream_session_t *s)
     pc->write->handler = ngx_stream_proxy_connect_handler;
 
     ngx_add_timer(pc->write, pscf->connect_timeout);
+
+    if ((pscf->connect_stagger || pscf->connect_hedge)
+        && pscf->next_upstream
+        && pc->type == SOCK_STREAM
+        && u->peer.tries > 1)
+    {
+        ngx_stream_proxy_stagger(s, pscf);
+    }
 }
 
 
@@ -820,16 +2181,43 @@ static void
 ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 {
     u_char                       *p;
+    size_t                        size;
     ngx_chain_t                  *cl;
     ngx_connection_t             *c, *pc;
     ngx_log_handler_pt            handler;
+    ngx_proxy_protocol_t         *pp;
     ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_ctx_t       *ctx;
     ngx_stream_core_srv_conf_t   *cscf;
     ngx_stream_proxy_srv_conf_t  *pscf;
 
     u = s->upstream;
     pc = u->peer.connection;
 
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx) {
+        if (ctx->stagger.timer_set) {
+            ngx_del_timer(&ctx->stagger);
+        }
+
+        /* this attempt won, cancel the other one */
+
+        if (ctx->attempt.connection) {
+
+            if (pscf->hedge) {
+                ngx_stream_proxy_hedge_record(pscf, ctx->attempt.sockaddr,
+                                              ctx->attempt.socklen,
+                                              ngx_current_msec
+                                              - ctx->attempt.start_time);
+            }
+
+            ngx_stream_proxy_attempt_close(s, 0);
+        }
+    }
+
     cscf = ngx_stream_get_module_srv_conf(s, ngx_stream_core_module);
 
     if (pc->type == SOCK_STREAM
@@ -840,7 +2228,20 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
         return;
     }
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+    if (pscf->hedge && pc->type == SOCK_STREAM && pc->ssl == NULL
+        && !u->peer.cached)
+    {
+        ngx_stream_proxy_hedge_record(pscf, u->peer.sockaddr,
+                                      u->peer.socklen,
+                                      ngx_current_msec - u->start_time);
+    }
+
+    if (pscf->breaker && pc->ssl == NULL && !u->peer.cached) {
+        ngx_stream_proxy_breaker_record(pscf->breaker, &u->peer,
+                                        pscf->breaker->latency
+                                        && ngx_current_msec - u->start_time
+                                           > pscf->breaker->latency);
+    }
 
 #if (NGX_STREAM_SSL)
 
@@ -892,18 +2293,60 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
     }
 
     if (u->upstream_buf.start == NULL) {
-        p = ngx_pnalloc(c->pool, pscf->buffer_size);
+
+        /*
+         * batched UDP receive needs a buffer_size slot for each datagram;
+         * a GRO super-packet may take up to 64K, so only a few such slots
+         * are allocated to keep the session memory bounded
+         */
+
+        size = pscf->buffer_size;
+
+        if (pc->type == SOCK_DGRAM) {
+            if (pscf->udp_gro) {
+                size = NGX_STREAM_PROXY_UDP_GRO_SLOT
+                       * ngx_min(pscf->udp_batch,
+                                 NGX_STREAM_PROXY_UDP_GRO_SLOTS);
+
+            } else {
+                size *= pscf->udp_batch;
+            }
+        }
+
+        p = ngx_pnalloc(c->pool, size);
         if (p == NULL) {
             ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
         }
 
         u->upstream_buf.start = p;
-        u->upstream_buf.end = p + pscf->buffer_size;
+        u->upstream_buf.end = p + size;
         u->upstream_buf.pos = p;
         u->upstream_buf.last = p;
     }
 
+#if (NGX_LINUX)
+    if (pc->type == SOCK_DGRAM && pscf->udp_batch > 1) {
+        pc->send_chain = ngx_stream_proxy_udp_send_chain;
+    }
+#endif
+
+#if (defined UDP_GRO)
+    if (pc->type == SOCK_DGRAM && pscf->udp_gro && !u->peer.cached) {
+        int  gro = 1;
+
+        /* without GRO the segment size is simply never reported */
+
+        if (setsockopt(pc->fd, SOL_UDP, UDP_GRO, (const void *) &gro,
+                       sizeof(int))
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_WARN, c->log, ngx_socket_errno,
+                          "setsockopt(UDP_GRO) failed, ignored");
+        }
+    }
+#endif
+
     if (c->buffer && c->buffer->pos <= c->buffer->last) {
         ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
                        "stream proxy add preread buffer: %uz",
@@ -923,6 +2366,15 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 
         cl->next = u->upstream_out;
         u->upstream_out = cl;
+
+        if (c->type == SOCK_DGRAM && pscf->udp_id_len
+            && ngx_stream_proxy_udp_id(s, c->buffer->pos,
+                                       c->buffer->last - c->buffer->pos)
+               != NGX_OK)
+        {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
     }
 
     if (u->proxy_protocol) {
@@ -960,11 +2412,25 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 
                 size_t next_v = 0;
 
+                /* inbound TLVs are only copied from trusted addresses */
+
+                pp = c->proxy_protocol;
+
+                if (pp && pscf->proxy_protocol_trusted_tree
+                    && ngx_cidr_tree_match(pscf->proxy_protocol_trusted_tree,
+                                           c->sockaddr)
+                       == NGX_DECLINED)
+                {
+                    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                                   "stream proxy untrusted PROXY protocol TLVs");
+                    pp = NULL;
+                }
+
                 // NGX_PROXY_STREAM_PP2_TYPE_ALPN
                 if (prx->tlvs.len < NGX_PROXY_PROTOCOL_V2_MAX_HEADER) {
 
                     next_v = ngx_stream_proxy_add_v2_tlv (prx,
-                        c->proxy_protocol, u->proxy_protocol_tlv_alpn,
+                        pp, u->proxy_protocol_tlv_alpn,
                         NGX_PROXY_STREAM_PP2_TYPE_ALPN, next_v);
                 }
                 
@@ -972,7 +2438,7 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
                 if (prx->tlvs.len < NGX_PROXY_PROTOCOL_V2_MAX_HEADER) {
 
                     next_v = ngx_stream_proxy_add_v2_tlv (prx,
-                        c->proxy_protocol, u->proxy_protocol_tlv_auth,
+                        pp, u->proxy_protocol_tlv_auth,
                         NGX_PROXY_STREAM_PP2_TYPE_AUTH, next_v);
                 }
             }
@@ -1034,6 +2500,20 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
     u->upload_rate = ngx_stream_complex_value_size(s, pscf->upload_rate, 0);
     u->download_rate = ngx_stream_complex_value_size(s, pscf->download_rate, 0);
 
+    if ((u->upload_rate || u->download_rate)
+        && ngx_stream_proxy_rate_init(s, pscf) != NGX_OK)
+    {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (pscf->coalesce && pc->type == SOCK_STREAM
+        && ngx_stream_proxy_coalesce_init(s) != NGX_OK)
+    {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
     u->connected = 1;
 
     pc->read->handler = ngx_stream_proxy_upstream_handler;
@@ -1205,7 +2685,115 @@ ngx_stream_proxy_ssl_password_file(ngx_conf_t *cf, ngx_command_t *cmd,
 
 
 static char *
-ngx_stream_proxy_ssl_conf_command_check(ngx_conf_t *cf, void *post, void *data)
+ngx_stream_proxy_ssl_certificate_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_proxy_srv_conf_t *pscf = conf;
+
+    time_t                              inactive, valid;
+    ngx_str_t                          *value, s;
+    ngx_int_t                           max;
+    ngx_uint_t                          i;
+    ngx_stream_proxy_ssl_cert_cache_t  *cache;
+
+    if (pscf->ssl_certificate_cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    max = 0;
+    inactive = 10;
+    valid = 60;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+
+            max = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (max <= 0) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "inactive=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            inactive = ngx_parse_time(&s, 1);
+            if (inactive == (time_t) NGX_ERROR) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "valid=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            valid = ngx_parse_time(&s, 1);
+            if (valid == (time_t) NGX_ERROR) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "off") == 0) {
+
+            pscf->ssl_certificate_cache = NULL;
+
+            continue;
+        }
+
+    failed:
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (pscf->ssl_certificate_cache == NULL) {
+        if (cf->args->nelts != 2) {
+            return "is invalid";
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    if (max == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"proxy_ssl_certificate_cache\" must have "
+                           "the \"max\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_stream_proxy_ssl_cert_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_stream_proxy_ssl_cert_insert_value);
+    ngx_queue_init(&cache->queue);
+
+    cache->max = max;
+    cache->inactive = inactive;
+    cache->valid = valid;
+
+    pscf->ssl_certificate_cache = cache;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_proxy_ssl_conf_command_check(ngx_conf_t *cf, void *post, void *data)
 {
 #ifndef SSL_CONF_FLAG_FILE
     return "is not supported on this platform";
@@ -1319,6 +2907,19 @@ ngx_stream_proxy_ssl_handshake(ngx_connection_t *pc)
             ngx_del_timer(pc->write);
         }
 
+#ifdef BIO_get_ktls_send
+
+        /*
+         * with kTLS the record layer is handled by the kernel, and
+         * SSL_read()/SSL_write() in the data pump become plain recv()/send()
+         */
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "upstream SSL kTLS send:%d recv:%d",
+                       BIO_get_ktls_send(SSL_get_wbio(pc->ssl->connection)),
+                       BIO_get_ktls_recv(SSL_get_rbio(pc->ssl->connection)));
+#endif
+
         ngx_stream_proxy_init_upstream(s);
 
         return;
@@ -1445,6 +3046,7 @@ done:
 static ngx_int_t
 ngx_stream_proxy_ssl_certificate(ngx_stream_session_t *s)
 {
+    ngx_int_t                     rc;
     ngx_str_t                     cert, key;
     ngx_connection_t             *c;
     ngx_stream_proxy_srv_conf_t  *pscf;
@@ -1475,6 +3077,15 @@ ngx_stream_proxy_ssl_certificate(ngx_stream_session_t *s)
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
                    "stream upstream ssl key: \"%s\"", key.data);
 
+    if (pscf->ssl_certificate_cache) {
+        rc = ngx_stream_proxy_ssl_cached_certificate(c,
+                                     pscf->ssl_certificate_cache, &cert, &key,
+                                     pscf->ssl_passwords);
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     if (ngx_ssl_connection_certificate(c, c->pool, &cert, &key,
                                        pscf->ssl_passwords)
         != NGX_OK)
@@ -1485,1201 +3096,7965 @@ ngx_stream_proxy_ssl_certificate(ngx_stream_session_t *s)
     return NGX_OK;
 }
 
-#endif
 
+/*
+ * certificates and keys loaded from variable paths are kept per worker;
+ * the files are checked for modification at most once in "valid" time
+ */
 
-static void
-ngx_stream_proxy_downstream_handler(ngx_event_t *ev)
+static ngx_int_t
+ngx_stream_proxy_ssl_cached_certificate(ngx_connection_t *c,
+    ngx_stream_proxy_ssl_cert_cache_t *cache, ngx_str_t *cert,
+    ngx_str_t *key, ngx_array_t *passwords)
 {
-    ngx_stream_proxy_process_connection(ev, ev->write);
-}
+    time_t                             now;
+    uint32_t                           hash;
+    ngx_int_t                          rc;
+    ngx_stream_proxy_ssl_cert_node_t  *cn;
 
+    /* keys of OpenSSL engines are not files */
 
-static void
-ngx_stream_proxy_resolve_handler(ngx_resolver_ctx_t *ctx)
-{
-    ngx_stream_session_t            *s;
-    ngx_stream_upstream_t           *u;
-    ngx_stream_proxy_srv_conf_t     *pscf;
-    ngx_stream_upstream_resolved_t  *ur;
+    if (ngx_strncmp(key->data, "engine:", sizeof("engine:") - 1) == 0) {
+        return NGX_DECLINED;
+    }
 
-    s = ctx->data;
+    now = ngx_time();
 
-    u = s->upstream;
-    ur = u->resolved;
+    /* the same files with other passwords are cached separately */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
-                   "stream upstream resolve");
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, cert->data, cert->len + 1);
+    ngx_crc32_update(&hash, key->data, key->len + 1);
+    ngx_crc32_update(&hash, (u_char *) &passwords, sizeof(ngx_array_t *));
+    ngx_crc32_final(hash);
 
-    if (ctx->state) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                      "%V could not be resolved (%i: %s)",
-                      &ctx->name, ctx->state,
-                      ngx_resolver_strerror(ctx->state));
+    cn = ngx_stream_proxy_ssl_cert_lookup(cache, hash, cert, key, passwords);
 
-        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-        return;
+    if (cn && now >= cn->valid) {
+        rc = ngx_stream_proxy_ssl_cert_changed(c, cn);
+
+        if (rc == NGX_OK) {
+            cn->valid = now + cache->valid;
+
+        } else {
+            ngx_stream_proxy_ssl_cert_free(cache, cn);
+            cn = NULL;
+        }
     }
 
-    ur->naddrs = ctx->naddrs;
-    ur->addrs = ctx->addrs;
+    if (cn == NULL) {
+        ngx_stream_proxy_ssl_cert_expire(cache, now);
 
-#if (NGX_DEBUG)
-    {
-    u_char      text[NGX_SOCKADDR_STRLEN];
-    ngx_str_t   addr;
-    ngx_uint_t  i;
+        cn = ngx_stream_proxy_ssl_cert_create(c, cache, hash, cert, key,
+                                              passwords);
+        if (cn == NULL) {
+            return NGX_ERROR;
+        }
 
-    addr.data = text;
+        cn->valid = now + cache->valid;
 
-    for (i = 0; i < ctx->naddrs; i++) {
-        addr.len = ngx_sock_ntop(ur->addrs[i].sockaddr, ur->addrs[i].socklen,
-                                 text, NGX_SOCKADDR_STRLEN, 0);
+    } else {
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "stream upstream ssl cert cached: \"%s\"",
+                       cert->data);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
-                       "name was resolved to %V", &addr);
-    }
+        ngx_queue_remove(&cn->queue);
     }
-#endif
 
-    if (ngx_stream_upstream_create_round_robin_peer(s, ur) != NGX_OK) {
-        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-        return;
+    cn->accessed = now;
+    ngx_queue_insert_head(&cache->queue, &cn->queue);
+
+    if (SSL_use_certificate(c->ssl->connection, cn->x509) == 0) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "SSL_use_certificate(\"%s\") failed", cert->data);
+        return NGX_ERROR;
     }
 
-    ngx_resolve_name_done(ctx);
-    ur->ctx = NULL;
+#ifdef SSL_set1_chain
 
-    u->peer.start_time = ngx_current_msec;
+    /* OpenSSL 1.0.2+ */
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+    if (SSL_set1_chain(c->ssl->connection, cn->chain) == 0) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "SSL_set1_chain(\"%s\") failed", cert->data);
+        return NGX_ERROR;
+    }
 
-    if (pscf->next_upstream_tries
-        && u->peer.tries > pscf->next_upstream_tries)
-    {
-        u->peer.tries = pscf->next_upstream_tries;
+#endif
+
+    if (SSL_use_PrivateKey(c->ssl->connection, cn->pkey) == 0) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "SSL_use_PrivateKey(\"%s\") failed", key->data);
+        return NGX_ERROR;
     }
 
-    ngx_stream_proxy_connect(s);
+    return NGX_OK;
 }
 
 
 static void
-ngx_stream_proxy_upstream_handler(ngx_event_t *ev)
+ngx_stream_proxy_ssl_cert_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
 {
-    ngx_stream_proxy_process_connection(ev, !ev->write);
-}
+    ngx_rbtree_node_t                 **p;
+    ngx_stream_proxy_ssl_cert_node_t   *cn, *cnt;
 
+    for ( ;; ) {
 
-static void
-ngx_stream_proxy_process_connection(ngx_event_t *ev, ngx_uint_t from_upstream)
-{
-    ngx_connection_t             *c, *pc;
-    ngx_log_handler_pt            handler;
-    ngx_stream_session_t         *s;
-    ngx_stream_upstream_t        *u;
-    ngx_stream_proxy_srv_conf_t  *pscf;
+        if (node->key < temp->key) {
 
-    c = ev->data;
-    s = c->data;
-    u = s->upstream;
+            p = &temp->left;
 
-    if (c->close) {
-        ngx_log_error(NGX_LOG_INFO, c->log, 0, "shutdown timeout");
-        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
-        return;
-    }
+        } else if (node->key > temp->key) {
 
-    c = s->connection;
-    pc = u->peer.connection;
+            p = &temp->right;
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+        } else { /* node->key == temp->key */
 
-    if (ev->timedout) {
-        ev->timedout = 0;
+            cn = (ngx_stream_proxy_ssl_cert_node_t *) node;
+            cnt = (ngx_stream_proxy_ssl_cert_node_t *) temp;
 
-        if (ev->delayed) {
-            ev->delayed = 0;
+            p = (ngx_stream_proxy_ssl_cert_cmp(cnt, &cn->cert, &cn->key,
+                                               cn->passwords)
+                 > 0)
+                ? &temp->left : &temp->right;
+        }
 
-            if (!ev->ready) {
-                if (ngx_handle_read_event(ev, 0) != NGX_OK) {
-                    ngx_stream_proxy_finalize(s,
-                                              NGX_STREAM_INTERNAL_SERVER_ERROR);
-                    return;
-                }
+        if (*p == sentinel) {
+            break;
+        }
 
-                if (u->connected && !c->read->delayed && !pc->read->delayed) {
-                    ngx_add_timer(c->write, pscf->timeout);
-                }
+        temp = *p;
+    }
 
-                return;
-            }
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
 
-        } else {
-            if (s->connection->type == SOCK_DGRAM) {
 
-                if (pscf->responses == NGX_MAX_INT32_VALUE
-                    || (u->responses >= pscf->responses * u->requests))
-                {
+/* compares a node with the key, as ngx_memn2cmp() does */
 
-                    /*
-                     * successfully terminate timed out UDP session
-                     * if expected number of responses was received
-                     */
+static ngx_int_t
+ngx_stream_proxy_ssl_cert_cmp(ngx_stream_proxy_ssl_cert_node_t *cn,
+    ngx_str_t *cert, ngx_str_t *key, ngx_array_t *passwords)
+{
+    ngx_int_t  rc;
 
-                    handler = c->log->handler;
-                    c->log->handler = NULL;
+    rc = ngx_memn2cmp(cn->cert.data, cert->data, cn->cert.len, cert->len);
 
-                    ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                                  "udp timed out"
-                                  ", packets from/to client:%ui/%ui"
-                                  ", bytes from/to client:%O/%O"
-                                  ", bytes from/to upstream:%O/%O",
-                                  u->requests, u->responses,
-                                  s->received, c->sent, u->received,
-                                  pc ? pc->sent : 0);
+    if (rc != 0) {
+        return rc;
+    }
 
-                    c->log->handler = handler;
+    rc = ngx_memn2cmp(cn->key.data, key->data, cn->key.len, key->len);
 
-                    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
-                    return;
-                }
+    if (rc != 0) {
+        return rc;
+    }
 
-                ngx_connection_error(pc, NGX_ETIMEDOUT, "upstream timed out");
+    if (cn->passwords == passwords) {
+        return 0;
+    }
 
-                pc->read->error = 1;
+    return ((uintptr_t) cn->passwords < (uintptr_t) passwords) ? -1 : 1;
+}
 
-                ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
 
-                return;
-            }
+static ngx_stream_proxy_ssl_cert_node_t *
+ngx_stream_proxy_ssl_cert_lookup(ngx_stream_proxy_ssl_cert_cache_t *cache,
+    uint32_t hash, ngx_str_t *cert, ngx_str_t *key, ngx_array_t *passwords)
+{
+    ngx_int_t                          rc;
+    ngx_rbtree_node_t                 *node, *sentinel;
+    ngx_stream_proxy_ssl_cert_node_t  *cn;
 
-            ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
+    node = cache->rbtree.root;
+    sentinel = cache->rbtree.sentinel;
 
-            ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+    while (node != sentinel) {
 
-            return;
+        if (hash < node->key) {
+            node = node->left;
+            continue;
         }
 
-    } else if (ev->delayed) {
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
 
-        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
-                       "stream connection delayed");
+        /* hash == node->key */
 
-        if (ngx_handle_read_event(ev, 0) != NGX_OK) {
-            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-        }
+        cn = (ngx_stream_proxy_ssl_cert_node_t *) node;
 
-        return;
-    }
+        rc = ngx_stream_proxy_ssl_cert_cmp(cn, cert, key, passwords);
 
-    if (from_upstream && !u->connected) {
-        return;
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc > 0) ? node->left : node->right;
     }
 
-    ngx_stream_proxy_process(s, from_upstream, ev->write);
+    return NULL;
 }
 
 
-static void
-ngx_stream_proxy_connect_handler(ngx_event_t *ev)
+static ngx_stream_proxy_ssl_cert_node_t *
+ngx_stream_proxy_ssl_cert_create(ngx_connection_t *c,
+    ngx_stream_proxy_ssl_cert_cache_t *cache, uint32_t hash, ngx_str_t *cert,
+    ngx_str_t *key, ngx_array_t *passwords)
 {
-    ngx_connection_t      *c;
-    ngx_stream_session_t  *s;
-
-    c = ev->data;
-    s = c->data;
+    u_char                            *p;
+    ngx_str_t                          cert_path, key_path;
+    ngx_stream_proxy_ssl_cert_node_t  *cn;
 
-    if (ev->timedout) {
-        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, "upstream timed out");
-        ngx_stream_proxy_next_upstream(s);
-        return;
+    cn = ngx_alloc(sizeof(ngx_stream_proxy_ssl_cert_node_t)
+                   + cert->len + 1 + key->len + 1, c->log);
+    if (cn == NULL) {
+        return NULL;
     }
 
-    ngx_del_timer(c->write);
+    p = (u_char *) cn + sizeof(ngx_stream_proxy_ssl_cert_node_t);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
-                   "stream proxy connect upstream");
+    cn->cert.len = cert->len;
+    cn->cert.data = p;
+    p = ngx_cpymem(p, cert->data, cert->len + 1);
 
-    if (ngx_stream_proxy_test_connect(c) != NGX_OK) {
-        ngx_stream_proxy_next_upstream(s);
-        return;
-    }
+    cn->key.len = key->len;
+    cn->key.data = p;
+    ngx_memcpy(p, key->data, key->len + 1);
 
-    ngx_stream_proxy_init_upstream(s);
-}
+    cn->passwords = passwords;
 
+    cn->x509 = NULL;
+    cn->chain = NULL;
+    cn->pkey = NULL;
 
-static ngx_int_t
-ngx_stream_proxy_test_connect(ngx_connection_t *c)
-{
-    int        err;
-    socklen_t  len;
-
-#if (NGX_HAVE_KQUEUE)
+    /* modification times are taken before the files are read */
 
-    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
-        err = c->write->kq_errno ? c->write->kq_errno : c->read->kq_errno;
+    if (ngx_stream_proxy_ssl_cert_file(c, &cn->cert, &cert_path,
+                                       &cn->cert_mtime)
+        != NGX_OK
+        || ngx_stream_proxy_ssl_cert_file(c, &cn->key, &key_path,
+                                          &cn->key_mtime)
+           != NGX_OK
+        || ngx_stream_proxy_ssl_cert_load(c, cn, &cert_path, &key_path)
+           != NGX_OK)
+    {
+        if (cn->x509) {
+            X509_free(cn->x509);
+        }
 
-        if (err) {
-            (void) ngx_connection_error(c, err,
-                                    "kevent() reported that connect() failed");
-            return NGX_ERROR;
+        if (cn->chain) {
+            sk_X509_pop_free(cn->chain, X509_free);
         }
 
-    } else
-#endif
-    {
-        err = 0;
-        len = sizeof(int);
+        ngx_free(cn);
+        return NULL;
+    }
 
-        /*
-         * BSDs and Linux return 0 and set a pending error in err
-         * Solaris returns -1 and sets errno
-         */
+    cn->node.key = hash;
 
-        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
-            == -1)
-        {
-            err = ngx_socket_errno;
-        }
+    ngx_rbtree_insert(&cache->rbtree, &cn->node);
+    cache->count++;
 
-        if (err) {
-            (void) ngx_connection_error(c, err, "connect() failed");
-            return NGX_ERROR;
-        }
-    }
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "stream upstream ssl cert loaded: \"%s\"", cert->data);
 
-    return NGX_OK;
+    return cn;
 }
 
 
-static void
-ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
-    ngx_uint_t do_write)
+static ngx_int_t
+ngx_stream_proxy_ssl_cert_changed(ngx_connection_t *c,
+    ngx_stream_proxy_ssl_cert_node_t *cn)
 {
-    char                         *recv_action, *send_action;
-    off_t                        *received, limit;
-    size_t                        size, limit_rate;
-    ssize_t                       n;
-    ngx_buf_t                    *b;
-    ngx_int_t                     rc;
-    ngx_uint_t                    flags, *packets;
-    ngx_msec_t                    delay;
-    ngx_chain_t                  *cl, **ll, **out, **busy;
-    ngx_connection_t             *c, *pc, *src, *dst;
-    ngx_log_handler_pt            handler;
-    ngx_stream_upstream_t        *u;
-    ngx_stream_proxy_srv_conf_t  *pscf;
-
-    u = s->upstream;
+    time_t     mtime;
+    ngx_str_t  path;
 
-    c = s->connection;
-    pc = u->connected ? u->peer.connection : NULL;
+    if (ngx_stream_proxy_ssl_cert_file(c, &cn->cert, &path, &mtime) != NGX_OK
+        || mtime != cn->cert_mtime)
+    {
+        return NGX_DECLINED;
+    }
 
-    if (c->type == SOCK_DGRAM && (ngx_terminate || ngx_exiting)) {
+    if (ngx_stream_proxy_ssl_cert_file(c, &cn->key, &path, &mtime) != NGX_OK
+        || mtime != cn->key_mtime)
+    {
+        return NGX_DECLINED;
+    }
 
-        /* socket is already closed on worker shutdown */
+    return NGX_OK;
+}
 
-        handler = c->log->handler;
-        c->log->handler = NULL;
 
-        ngx_log_error(NGX_LOG_INFO, c->log, 0, "disconnected on shutdown");
+static ngx_int_t
+ngx_stream_proxy_ssl_cert_file(ngx_connection_t *c, ngx_str_t *name,
+    ngx_str_t *path, time_t *mtime)
+{
+    ngx_file_info_t  fi;
 
-        c->log->handler = handler;
+    *path = *name;
 
-        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
-        return;
+    if (ngx_strncmp(name->data, "data:", sizeof("data:") - 1) == 0) {
+        *mtime = 0;
+        return NGX_OK;
     }
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
-
-    if (from_upstream) {
-        src = pc;
-        dst = c;
-        b = &u->upstream_buf;
-        limit_rate = u->download_rate;
-        received = &u->received;
-        packets = &u->responses;
-        out = &u->downstream_out;
-        busy = &u->downstream_busy;
-        recv_action = "proxying and reading from upstream";
-        send_action = "proxying and sending to client";
+    if (ngx_get_full_name(c->pool, (ngx_str_t *) &ngx_cycle->conf_prefix,
+                          path)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-    } else {
-        src = c;
-        dst = pc;
-        b = &u->downstream_buf;
-        limit_rate = u->upload_rate;
-        received = &s->received;
-        packets = &u->requests;
-        out = &u->upstream_out;
-        busy = &u->upstream_busy;
-        recv_action = "proxying and reading from client";
-        send_action = "proxying and sending to upstream";
+    if (ngx_file_info(path->data, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, c->log, ngx_errno,
+                      ngx_file_info_n " \"%s\" failed", path->data);
+        return NGX_ERROR;
     }
 
-    for ( ;; ) {
+    *mtime = ngx_file_mtime(&fi);
 
-        if (do_write && dst) {
+    return NGX_OK;
+}
 
-            if (*out || *busy || dst->buffered) {
-                c->log->action = send_action;
 
-                rc = ngx_stream_top_filter(s, *out, from_upstream);
+static ngx_int_t
+ngx_stream_proxy_ssl_cert_load(ngx_connection_t *c,
+    ngx_stream_proxy_ssl_cert_node_t *cn, ngx_str_t *cert, ngx_str_t *key)
+{
+    BIO         *bio;
+    X509        *x509;
+    u_long       n;
+    ngx_str_t   *pwd;
+    ngx_uint_t   tries;
+
+    if (ngx_strncmp(cert->data, "data:", sizeof("data:") - 1) == 0) {
+        bio = BIO_new_mem_buf(cert->data + sizeof("data:") - 1,
+                              cert->len - (sizeof("data:") - 1));
+    } else {
+        bio = BIO_new_file((char *) cert->data, "r");
+    }
 
-                if (rc == NGX_ERROR) {
-                    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
-                    return;
-                }
+    if (bio == NULL) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "cannot load certificate \"%s\"", cn->cert.data);
+        return NGX_ERROR;
+    }
 
-                ngx_chain_update_chains(c->pool, &u->free, busy, out,
-                                      (ngx_buf_tag_t) &ngx_stream_proxy_module);
+    /* certificate itself */
 
-                if (*busy == NULL) {
-                    b->pos = b->start;
-                    b->last = b->start;
-                }
-            }
-        }
+    cn->x509 = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
+    if (cn->x509 == NULL) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "PEM_read_bio_X509_AUX(\"%s\") failed", cn->cert.data);
+        BIO_free(bio);
+        return NGX_ERROR;
+    }
 
-        size = b->end - b->last;
+    /* rest of the chain */
 
-        if (size && src->read->ready && !src->read->delayed
-            && !src->read->error)
-        {
-            if (limit_rate) {
-                limit = (off_t) limit_rate * (ngx_time() - u->start_sec + 1)
-                        - *received;
+    cn->chain = sk_X509_new_null();
+    if (cn->chain == NULL) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0, "sk_X509_new_null() failed");
+        BIO_free(bio);
+        return NGX_ERROR;
+    }
 
-                if (limit <= 0) {
-                    src->read->delayed = 1;
-                    delay = (ngx_msec_t) (- limit * 1000 / limit_rate + 1);
-                    ngx_add_timer(src->read, delay);
-                    break;
-                }
+    for ( ;; ) {
 
-                if (c->type == SOCK_STREAM && (off_t) size > limit) {
-                    size = (size_t) limit;
-                }
+        x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+        if (x509 == NULL) {
+            n = ERR_peek_last_error();
+
+            if (ERR_GET_LIB(n) == ERR_LIB_PEM
+                && ERR_GET_REASON(n) == PEM_R_NO_START_LINE)
+            {
+                /* end of file */
+                ERR_clear_error();
+                break;
             }
 
-            c->log->action = recv_action;
+            /* some real error */
 
-            n = src->recv(src, b->last, size);
+            ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                          "PEM_read_bio_X509(\"%s\") failed", cn->cert.data);
+            BIO_free(bio);
+            return NGX_ERROR;
+        }
 
-            if (n == NGX_AGAIN) {
-                break;
-            }
+        if (sk_X509_push(cn->chain, x509) == 0) {
+            ngx_ssl_error(NGX_LOG_ERR, c->log, 0, "sk_X509_push() failed");
+            X509_free(x509);
+            BIO_free(bio);
+            return NGX_ERROR;
+        }
+    }
 
-            if (n == NGX_ERROR) {
-                src->read->eof = 1;
-                n = 0;
-            }
+    BIO_free(bio);
 
-            if (n >= 0) {
-                if (limit_rate) {
-                    delay = (ngx_msec_t) (n * 1000 / limit_rate);
+#ifndef SSL_set1_chain
 
-                    if (delay > 0) {
-                        src->read->delayed = 1;
-                        ngx_add_timer(src->read, delay);
-                    }
-                }
+    if (sk_X509_num(cn->chain) > 0) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "certificate chain in \"%s\" is not supported "
+                      "by this OpenSSL version", cn->cert.data);
+        return NGX_ERROR;
+    }
 
-                if (from_upstream) {
-                    if (u->state->first_byte_time == (ngx_msec_t) -1) {
-                        u->state->first_byte_time = ngx_current_msec
-                                                    - u->start_time;
-                    }
-                }
+#endif
 
-                for (ll = out; *ll; ll = &(*ll)->next) { /* void */ }
+    if (ngx_strncmp(key->data, "data:", sizeof("data:") - 1) == 0) {
+        bio = BIO_new_mem_buf(key->data + sizeof("data:") - 1,
+                              key->len - (sizeof("data:") - 1));
+    } else {
+        bio = BIO_new_file((char *) key->data, "r");
+    }
 
-                cl = ngx_chain_get_free_buf(c->pool, &u->free);
-                if (cl == NULL) {
-                    ngx_stream_proxy_finalize(s,
-                                              NGX_STREAM_INTERNAL_SERVER_ERROR);
-                    return;
-                }
+    if (bio == NULL) {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "cannot load certificate key \"%s\"", cn->key.data);
+        return NGX_ERROR;
+    }
 
-                *ll = cl;
+    if (cn->passwords) {
+        tries = cn->passwords->nelts;
+        pwd = cn->passwords->elts;
 
-                cl->buf->pos = b->last;
-                cl->buf->last = b->last + n;
-                cl->buf->tag = (ngx_buf_tag_t) &ngx_stream_proxy_module;
+    } else {
+        tries = 1;
+        pwd = NULL;
+    }
 
-                cl->buf->temporary = (n ? 1 : 0);
-                cl->buf->last_buf = src->read->eof;
-                cl->buf->flush = !src->read->eof;
+    for ( ;; ) {
 
-                (*packets)++;
-                *received += n;
-                b->last += n;
-                do_write = 1;
+        cn->pkey = PEM_read_bio_PrivateKey(bio, NULL,
+                                           ngx_stream_proxy_ssl_cert_password,
+                                           pwd);
+        if (cn->pkey) {
+            break;
+        }
 
-                continue;
-            }
+        if (tries-- > 1) {
+            ERR_clear_error();
+            (void) BIO_reset(bio);
+            pwd++;
+            continue;
         }
 
-        break;
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "PEM_read_bio_PrivateKey(\"%s\") failed", cn->key.data);
+        BIO_free(bio);
+        return NGX_ERROR;
     }
 
-    c->log->action = "proxying connection";
+    BIO_free(bio);
 
-    if (ngx_stream_proxy_test_finalize(s, from_upstream) == NGX_OK) {
-        return;
-    }
+    return NGX_OK;
+}
 
-    flags = src->read->eof ? NGX_CLOSE_EVENT : 0;
 
-    if (ngx_handle_read_event(src->read, flags) != NGX_OK) {
-        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-        return;
+static int
+ngx_stream_proxy_ssl_cert_password(char *buf, int size, int rwflag,
+    void *userdata)
+{
+    ngx_str_t  *pwd = userdata;
+
+    if (rwflag || pwd == NULL || pwd->len > (size_t) size) {
+        return 0;
     }
 
-    if (dst) {
+    ngx_memcpy(buf, pwd->data, pwd->len);
 
-        if (dst->type == SOCK_STREAM && pscf->half_close
-            && src->read->eof && !u->half_closed && !dst->buffered)
-        {
-            if (ngx_shutdown_socket(dst->fd, NGX_WRITE_SHUTDOWN) == -1) {
-                ngx_connection_error(c, ngx_socket_errno,
-                                     ngx_shutdown_socket_n " failed");
+    return pwd->len;
+}
 
-                ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-                return;
-            }
 
-            u->half_closed = 1;
-            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
-                           "stream proxy %s socket shutdown",
-                           from_upstream ? "client" : "upstream");
-        }
+static void
+ngx_stream_proxy_ssl_cert_expire(ngx_stream_proxy_ssl_cert_cache_t *cache,
+    time_t now)
+{
+    ngx_uint_t                         n;
+    ngx_queue_t                       *q;
+    ngx_stream_proxy_ssl_cert_node_t  *cn;
 
-        if (ngx_handle_write_event(dst->write, 0) != NGX_OK) {
-            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    /*
+     * the least recently used entries are removed while the cache is full
+     * or they were not used for "inactive" time, at most three at once
+     */
+
+    for (n = 0; n < 3; n++) {
+
+        if (ngx_queue_empty(&cache->queue)) {
             return;
         }
 
-        if (!c->read->delayed && !pc->read->delayed) {
-            ngx_add_timer(c->write, pscf->timeout);
+        q = ngx_queue_last(&cache->queue);
+        cn = ngx_queue_data(q, ngx_stream_proxy_ssl_cert_node_t, queue);
 
-        } else if (c->write->timer_set) {
-            ngx_del_timer(c->write);
+        if (cache->count < cache->max && now - cn->accessed < cache->inactive)
+        {
+            return;
         }
+
+        ngx_stream_proxy_ssl_cert_free(cache, cn);
     }
 }
 
 
-static ngx_int_t
-ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
-    ngx_uint_t from_upstream)
+static void
+ngx_stream_proxy_ssl_cert_free(ngx_stream_proxy_ssl_cert_cache_t *cache,
+    ngx_stream_proxy_ssl_cert_node_t *cn)
 {
-    ngx_connection_t             *c, *pc;
-    ngx_log_handler_pt            handler;
-    ngx_stream_upstream_t        *u;
+    /* connections which use the objects hold their own references */
+
+    X509_free(cn->x509);
+    sk_X509_pop_free(cn->chain, X509_free);
+    EVP_PKEY_free(cn->pkey);
+
+    ngx_rbtree_delete(&cache->rbtree, &cn->node);
+    ngx_queue_remove(&cn->queue);
+    cache->count--;
+
+    ngx_free(cn);
+}
+
+#endif
+
+
+static void
+ngx_stream_proxy_downstream_handler(ngx_event_t *ev)
+{
+    ngx_stream_proxy_process_connection(ev, ev->write);
+}
+
+
+static void
+ngx_stream_proxy_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    ngx_int_t                        rc;
+    ngx_stream_session_t            *s;
+    ngx_stream_upstream_t           *u;
+    ngx_stream_proxy_srv_conf_t     *pscf;
+    ngx_stream_upstream_resolved_t  *ur;
+
+    s = ctx->data;
+
+    u = s->upstream;
+    ur = u->resolved;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "stream upstream resolve");
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "%V could not be resolved (%i: %s)",
+                      &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ur->naddrs = ctx->naddrs;
+    ur->addrs = ctx->addrs;
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+#if (NGX_HAVE_INET6)
+    if (pscf->connect_stagger && ur->naddrs > 1
+        && ngx_stream_proxy_interleave_addrs(s->connection->pool, ur)
+           != NGX_OK)
+    {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+#endif
+
+#if (NGX_DEBUG)
+    {
+    u_char      text[NGX_SOCKADDR_STRLEN];
+    ngx_str_t   addr;
+    ngx_uint_t  i;
+
+    addr.data = text;
+
+    for (i = 0; i < ctx->naddrs; i++) {
+        addr.len = ngx_sock_ntop(ur->addrs[i].sockaddr, ur->addrs[i].socklen,
+                                 text, NGX_SOCKADDR_STRLEN, 0);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "name was resolved to %V", &addr);
+    }
+    }
+#endif
+
+    rc = NGX_DECLINED;
+
+    if (pscf->resolve_cache) {
+        rc = ngx_stream_proxy_resolve_cache_add(s, pscf, ur, ctx->valid);
+    }
+
+    if (rc == NGX_DECLINED) {
+        rc = ngx_stream_upstream_create_round_robin_peer(s, ur);
+    }
+
+    if (rc != NGX_OK) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_resolve_name_done(ctx);
+    ur->ctx = NULL;
+
+    u->peer.start_time = ngx_current_msec;
+
+    if (pscf->next_upstream_tries
+        && u->peer.tries > pscf->next_upstream_tries)
+    {
+        u->peer.tries = pscf->next_upstream_tries;
+    }
+
+    ngx_stream_proxy_connect(s);
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_resolve_cache_lookup(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf, ngx_stream_upstream_resolved_t *ur)
+{
+    u_char                            *p;
+    time_t                             now;
+    uint32_t                           hash;
+    ngx_str_t                          key;
+    ngx_stream_proxy_resolve_node_t   *node;
+    ngx_stream_proxy_resolve_cache_t  *cache;
+
+    cache = pscf->resolve_cache;
+
+    key.data = ngx_pnalloc(s->connection->pool,
+                           ur->host.len + sizeof(":65535") - 1);
+    if (key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_sprintf(key.data, "%V:%d", &ur->host, (int) ur->port);
+    key.len = p - key.data;
+
+    ngx_strlow(key.data, key.data, key.len);
+
+    hash = ngx_crc32_long(key.data, key.len);
+
+    node = (ngx_stream_proxy_resolve_node_t *)
+               ngx_str_rbtree_lookup(&cache->rbtree, &key, hash);
+
+    if (node == NULL) {
+        return NGX_DECLINED;
+    }
+
+    now = ngx_time();
+
+    if (now >= node->valid + node->grace && node->ctx == NULL) {
+        ngx_stream_proxy_resolve_cache_delete(node);
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "proxy resolve cache hit \"%V\", valid %T",
+                   &key, node->valid - now);
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&cache->queue, &node->queue);
+
+    /*
+     * the resolver keeps the name in its own cache until node->valid,
+     * so the set is refreshed only after it expired; until the refresh
+     * completes, the stale set is still used for up to node->grace seconds
+     */
+
+    if (node->ctx == NULL && now >= node->valid) {
+        ngx_stream_proxy_resolve_cache_refresh(node);
+    }
+
+    return ngx_stream_proxy_peer_set_use(s, node->set);
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_resolve_cache_add(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf, ngx_stream_upstream_resolved_t *ur,
+    time_t valid)
+{
+    u_char                            *p;
+    size_t                             len;
+    time_t                             now;
+    ngx_queue_t                       *q;
+    ngx_stream_core_srv_conf_t        *cscf;
+    ngx_stream_proxy_peer_set_t       *set;
+    ngx_stream_proxy_resolve_node_t   *node;
+    ngx_stream_proxy_resolve_cache_t  *cache;
+
+    now = ngx_time();
+
+    if (valid <= now || ur->naddrs == 0) {
+        return NGX_DECLINED;
+    }
+
+    cache = pscf->resolve_cache;
+
+    set = ngx_stream_proxy_peer_set_create(ur, 0, s->connection->log);
+    if (set == NULL) {
+        return NGX_ERROR;
+    }
+
+    len = ur->host.len + sizeof(":65535") - 1;
+
+    node = ngx_alloc(offsetof(ngx_stream_proxy_resolve_node_t, data)
+                     + len + ur->host.len, s->connection->log);
+    if (node == NULL) {
+        ngx_destroy_pool(set->pool);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(node, offsetof(ngx_stream_proxy_resolve_node_t, data));
+
+    p = node->data;
+
+    node->sn.str.data = p;
+    p = ngx_sprintf(p, "%V:%d", &ur->host, (int) ur->port);
+    node->sn.str.len = p - node->sn.str.data;
+
+    ngx_strlow(node->sn.str.data, node->sn.str.data, node->sn.str.len);
+
+    node->sn.node.key = ngx_crc32_long(node->sn.str.data, node->sn.str.len);
+
+    if (ngx_str_rbtree_lookup(&cache->rbtree, &node->sn.str,
+                              node->sn.node.key)
+        != NULL)
+    {
+        /* resolved concurrently by another session */
+        ngx_free(node);
+        goto use;
+    }
+
+    node->host.data = p;
+    node->host.len = ur->host.len;
+    ngx_memcpy(p, ur->host.data, ur->host.len);
+
+    node->port = ur->port;
+    node->cache = cache;
+    node->set = set;
+    node->valid = valid;
+    node->grace = ngx_max((valid - now) / 10, 1);
+    node->interleave = pscf->connect_stagger ? 1 : 0;
+
+    cscf = ngx_stream_get_module_srv_conf(s, ngx_stream_core_module);
+
+    node->resolver = cscf->resolver;
+    node->timeout = cscf->resolver_timeout;
+
+    if (cache->count == cache->max) {
+        q = ngx_queue_last(&cache->queue);
+        ngx_stream_proxy_resolve_cache_delete(
+            ngx_queue_data(q, ngx_stream_proxy_resolve_node_t, queue));
+    }
+
+    ngx_rbtree_insert(&cache->rbtree, &node->sn.node);
+    ngx_queue_insert_head(&cache->queue, &node->queue);
+
+    cache->count++;
+
+    return ngx_stream_proxy_peer_set_use(s, set);
+
+use:
+
+    /* the set is only used by this session */
+
+    set->stale = 1;
+
+    return ngx_stream_proxy_peer_set_use(s, set);
+}
+
+
+static void
+ngx_stream_proxy_resolve_cache_refresh(ngx_stream_proxy_resolve_node_t *node)
+{
+    ngx_resolver_ctx_t  *ctx, temp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                   "proxy resolve cache refresh \"%V\"", &node->host);
+
+    temp.name = node->host;
+
+    ctx = ngx_resolve_start(node->resolver, &temp);
+    if (ctx == NULL || ctx == NGX_NO_RESOLVER) {
+        return;
+    }
+
+    ctx->name = node->host;
+    ctx->handler = ngx_stream_proxy_resolve_cache_handler;
+    ctx->data = node;
+    ctx->timeout = node->timeout;
+
+    node->ctx = ctx;
+
+    if (ngx_resolve_name(ctx) != NGX_OK) {
+        node->ctx = NULL;
+    }
+}
+
+
+static void
+ngx_stream_proxy_resolve_cache_handler(ngx_resolver_ctx_t *ctx)
+{
+    time_t                            now;
+    ngx_uint_t                        i;
+    ngx_stream_proxy_peer_set_t      *set;
+    ngx_stream_upstream_rr_peer_t    *peer;
+    ngx_stream_upstream_rr_peers_t   *peers;
+    ngx_stream_upstream_resolved_t    ur;
+    ngx_stream_proxy_resolve_node_t  *node;
+
+    node = ctx->data;
+    node->ctx = NULL;
+
+    now = ngx_time();
+
+    if (ctx->state || ctx->naddrs == 0 || ctx->valid <= now) {
+
+        /* the stale set is kept until the grace period ends */
+
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "%V could not be refreshed (%i: %s)",
+                      &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+        goto done;
+    }
+
+    /*
+     * if the addresses did not change, the set is kept
+     * along with the failure accounting of its peers
+     */
+
+    peers = node->set->upstream.peer.data;
+
+    if (ctx->naddrs == peers->number) {
+
+        for (i = 0; i < ctx->naddrs; i++) {
+
+            for (peer = peers->peer; peer; peer = peer->next) {
+                if (ngx_cmp_sockaddr(ctx->addrs[i].sockaddr,
+                                     ctx->addrs[i].socklen,
+                                     peer->sockaddr, peer->socklen, 0)
+                    == NGX_OK)
+                {
+                    break;
+                }
+            }
+
+            if (peer == NULL) {
+                break;
+            }
+        }
+
+        if (i == ctx->naddrs) {
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                           "proxy resolve cache \"%V\" unchanged",
+                           &node->host);
+            goto valid;
+        }
+    }
+
+    ngx_memzero(&ur, sizeof(ngx_stream_upstream_resolved_t));
+
+    ur.host = node->host;
+    ur.port = node->port;
+    ur.naddrs = ctx->naddrs;
+    ur.addrs = ctx->addrs;
+
+    set = ngx_stream_proxy_peer_set_create(&ur, node->interleave,
+                                           ngx_cycle->log);
+    if (set == NULL) {
+        goto done;
+    }
+
+    ngx_stream_proxy_peer_set_drop(node->set);
+
+    node->set = set;
+
+valid:
+
+    node->valid = ctx->valid;
+    node->grace = ngx_max((ctx->valid - now) / 10, 1);
+
+done:
+
+    ngx_resolve_name_done(ctx);
+}
+
+
+static void
+ngx_stream_proxy_resolve_cache_delete(ngx_stream_proxy_resolve_node_t *node)
+{
+    ngx_stream_proxy_resolve_cache_t  *cache;
+
+    cache = node->cache;
+
+    if (node->ctx) {
+        ngx_resolve_name_done(node->ctx);
+        node->ctx = NULL;
+    }
+
+    ngx_stream_proxy_peer_set_drop(node->set);
+
+    ngx_queue_remove(&node->queue);
+    ngx_rbtree_delete(&cache->rbtree, &node->sn.node);
+
+    ngx_free(node);
+
+    cache->count--;
+}
+
+
+static ngx_stream_proxy_peer_set_t *
+ngx_stream_proxy_peer_set_create(ngx_stream_upstream_resolved_t *ur,
+    ngx_uint_t interleave, ngx_log_t *log)
+{
+    u_char                          *p;
+    size_t                           len;
+    socklen_t                        socklen;
+    ngx_uint_t                       i;
+    ngx_pool_t                      *pool;
+    struct sockaddr                 *sockaddr;
+    ngx_stream_proxy_peer_set_t     *set;
+    ngx_stream_upstream_rr_peer_t   *peer, **peerp;
+    ngx_stream_upstream_rr_peers_t  *peers;
+
+    pool = ngx_create_pool(1024, log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+#if (NGX_HAVE_INET6)
+    if (interleave && ur->naddrs > 1
+        && ngx_stream_proxy_interleave_addrs(pool, ur) != NGX_OK)
+    {
+        goto failed;
+    }
+#endif
+
+    set = ngx_pcalloc(pool, sizeof(ngx_stream_proxy_peer_set_t));
+    if (set == NULL) {
+        goto failed;
+    }
+
+    set->pool = pool;
+
+    set->host.data = ngx_pstrdup(pool, &ur->host);
+    if (set->host.data == NULL) {
+        goto failed;
+    }
+
+    set->host.len = ur->host.len;
+
+    peers = ngx_pcalloc(pool, sizeof(ngx_stream_upstream_rr_peers_t));
+    if (peers == NULL) {
+        goto failed;
+    }
+
+    peer = ngx_pcalloc(pool, sizeof(ngx_stream_upstream_rr_peer_t)
+                             * ur->naddrs);
+    if (peer == NULL) {
+        goto failed;
+    }
+
+    peers->single = (ur->naddrs == 1);
+    peers->number = ur->naddrs;
+    peers->tries = ur->naddrs;
+    peers->name = &set->host;
+
+    peerp = &peers->peer;
+
+    /* the same peers as ngx_stream_upstream_create_round_robin_peer() */
+
+    for (i = 0; i < ur->naddrs; i++) {
+
+        socklen = ur->addrs[i].socklen;
+
+        sockaddr = ngx_palloc(pool, socklen);
+        if (sockaddr == NULL) {
+            goto failed;
+        }
+
+        ngx_memcpy(sockaddr, ur->addrs[i].sockaddr, socklen);
+        ngx_inet_set_port(sockaddr, ur->port);
+
+        p = ngx_pnalloc(pool, NGX_SOCKADDR_STRLEN);
+        if (p == NULL) {
+            goto failed;
+        }
+
+        len = ngx_sock_ntop(sockaddr, socklen, p, NGX_SOCKADDR_STRLEN, 1);
+
+        peer[i].sockaddr = sockaddr;
+        peer[i].socklen = socklen;
+        peer[i].name.len = len;
+        peer[i].name.data = p;
+        peer[i].weight = 1;
+        peer[i].effective_weight = 1;
+        peer[i].current_weight = 0;
+        peer[i].max_conns = 0;
+        peer[i].max_fails = 1;
+        peer[i].fail_timeout = 10;
+        *peerp = &peer[i];
+        peerp = &peer[i].next;
+    }
+
+    set->upstream.peer.data = peers;
+
+    return set;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_peer_set_use(ngx_stream_session_t *s,
+    ngx_stream_proxy_peer_set_t *set)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+    if (cln == NULL) {
+        if (set->refs == 0 && set->stale) {
+            ngx_destroy_pool(set->pool);
+        }
+
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_stream_proxy_peer_set_release;
+    cln->data = set;
+
+    set->refs++;
+
+    /* failure accounting of the peers is shared by all sessions */
+
+    return ngx_stream_upstream_init_round_robin_peer(s, &set->upstream);
+}
+
+
+static void
+ngx_stream_proxy_peer_set_release(void *data)
+{
+    ngx_stream_proxy_peer_set_t  *set = data;
+
+    if (--set->refs == 0 && set->stale) {
+        ngx_destroy_pool(set->pool);
+    }
+}
+
+
+static void
+ngx_stream_proxy_peer_set_drop(ngx_stream_proxy_peer_set_t *set)
+{
+    set->stale = 1;
+
+    if (set->refs == 0) {
+        ngx_destroy_pool(set->pool);
+    }
+}
+
+
+static void
+ngx_stream_proxy_upstream_handler(ngx_event_t *ev)
+{
+    ngx_stream_proxy_process_connection(ev, !ev->write);
+}
+
+
+static void
+ngx_stream_proxy_process_connection(ngx_event_t *ev, ngx_uint_t from_upstream)
+{
+    ngx_connection_t             *c, *pc;
+    ngx_log_handler_pt            handler;
+    ngx_stream_session_t         *s;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    c = ev->data;
+    s = c->data;
+    u = s->upstream;
+
+    if (c->close) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0, "shutdown timeout");
+        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+        return;
+    }
+
+    c = s->connection;
+    pc = u->peer.connection;
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    if (ev->timedout) {
+        ev->timedout = 0;
+
+        if (ev->delayed) {
+            ev->delayed = 0;
+
+            if (!ev->ready) {
+                if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+                    ngx_stream_proxy_finalize(s,
+                                              NGX_STREAM_INTERNAL_SERVER_ERROR);
+                    return;
+                }
+
+                if (u->connected && !c->read->delayed && !pc->read->delayed) {
+                    ngx_stream_proxy_idle_timer(s, pscf->timeout);
+                }
+
+                return;
+            }
+
+        } else {
+
+            if (u->connected
+                && ngx_current_msec - u->activity < pscf->timeout)
+            {
+                /* the session was active since the timer was set */
+
+                ngx_add_timer(c->write,
+                              pscf->timeout
+                              - (ngx_current_msec - u->activity));
+                return;
+            }
+
+            if (s->connection->type == SOCK_DGRAM) {
+
+                if (pscf->responses == NGX_MAX_INT32_VALUE
+                    || (u->responses >= pscf->responses * u->requests))
+                {
+
+                    /*
+                     * successfully terminate timed out UDP session
+                     * if expected number of responses was received
+                     */
+
+                    handler = c->log->handler;
+                    c->log->handler = NULL;
+
+                    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                                  "udp timed out"
+                                  ", packets from/to client:%ui/%ui"
+                                  ", bytes from/to client:%O/%O"
+                                  ", bytes from/to upstream:%O/%O",
+                                  u->requests, u->responses,
+                                  s->received, c->sent, u->received,
+                                  pc ? pc->sent : 0);
+
+                    c->log->handler = handler;
+
+                    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                    return;
+                }
+
+                ngx_connection_error(pc, NGX_ETIMEDOUT, "upstream timed out");
+
+                pc->read->error = 1;
+
+                ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
+
+                return;
+            }
+
+            ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
+
+            ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+
+            return;
+        }
+
+    } else if (ev->delayed) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "stream connection delayed");
+
+        if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        }
+
+        return;
+    }
+
+    if (from_upstream && !u->connected) {
+        return;
+    }
+
+    ngx_stream_proxy_process(s, from_upstream, ev->write);
+}
+
+
+static void
+ngx_stream_proxy_connect_handler(ngx_event_t *ev)
+{
+    ngx_connection_t        *c;
+    ngx_stream_session_t    *s;
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    c = ev->data;
+    s = c->data;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx && ctx->attempt.connection) {
+        ngx_stream_proxy_race_handler(s, ev);
+        return;
+    }
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, "upstream timed out");
+        ngx_stream_proxy_next_upstream(s);
+        return;
+    }
+
+    ngx_del_timer(c->write);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "stream proxy connect upstream");
+
+    if (ngx_stream_proxy_test_connect(c) != NGX_OK) {
+        ngx_stream_proxy_next_upstream(s);
+        return;
+    }
+
+    ngx_stream_proxy_init_upstream(s);
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        err = c->write->kq_errno ? c->write->kq_errno : c->read->kq_errno;
+
+        if (err) {
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        /*
+         * BSDs and Linux return 0 and set a pending error in err
+         * Solaris returns -1 and sets errno
+         */
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_stream_upstream_rr_peer_data_t *
+ngx_stream_proxy_race_data(ngx_stream_upstream_t *u)
+{
+    void                                  *data;
+    ngx_event_get_peer_pt                  get_peer;
+    ngx_event_free_peer_pt                 free_peer;
+    ngx_stream_proxy_breaker_peer_data_t  *bp;
+    ngx_stream_proxy_prewarm_peer_data_t  *wp;
+
+    data = u->peer.data;
+    get_peer = u->peer.get;
+    free_peer = u->peer.free;
+
+    if (get_peer == ngx_stream_proxy_get_prewarm_peer) {
+        wp = data;
+        data = wp->data;
+        get_peer = wp->original_get_peer;
+        free_peer = wp->original_free_peer;
+    }
+
+    if (get_peer == ngx_stream_proxy_get_breaker_peer) {
+        bp = data;
+        data = bp->data;
+        free_peer = bp->original_free_peer;
+    }
+
+    /*
+     * two attempts share the balancer data, so racing is only possible
+     * with balancers which keep the selected peer in rrp->current
+     */
+
+    if (free_peer != ngx_stream_upstream_free_round_robin_peer) {
+        return NULL;
+    }
+
+    return data;
+}
+
+
+static void
+ngx_stream_proxy_stagger(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf)
+{
+    ngx_msec_t               delay, hedge;
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    if (ngx_stream_proxy_race_data(s->upstream) == NULL) {
+        return;
+    }
+
+    delay = pscf->connect_stagger;
+
+    if (pscf->connect_hedge) {
+        hedge = ngx_stream_proxy_hedge_threshold(pscf, &s->upstream->peer);
+
+        if (hedge && (delay == 0 || hedge < delay)) {
+            delay = hedge;
+        }
+    }
+
+    if (delay == 0) {
+        return;
+    }
+
+    ctx = ngx_stream_proxy_get_ctx(s);
+    if (ctx == NULL || ctx->attempt.connection) {
+        return;
+    }
+
+    ctx->stagger.handler = ngx_stream_proxy_stagger_handler;
+    ctx->stagger.data = s;
+    ctx->stagger.log = s->connection->log;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "stream proxy stagger: %M", delay);
+
+    ngx_add_timer(&ctx->stagger, delay);
+}
+
+
+static ngx_msec_t
+ngx_stream_proxy_hedge_threshold(ngx_stream_proxy_srv_conf_t *pscf,
+    ngx_peer_connection_t *pc)
+{
+    uint32_t                        hash;
+    ngx_uint_t                      n, need, sum;
+    ngx_stream_proxy_hedge_slot_t  *slot;
+
+    hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen);
+    slot = &pscf->hedge[hash % NGX_STREAM_PROXY_HEDGE_SLOTS];
+
+    if (slot->hash != hash || slot->total < NGX_STREAM_PROXY_HEDGE_SAMPLES) {
+        return 0;
+    }
+
+    need = (slot->total * pscf->connect_hedge + 99) / 100;
+    sum = 0;
+
+    for (n = 0; n < NGX_STREAM_PROXY_HEDGE_BUCKETS; n++) {
+        sum += slot->count[n];
+
+        if (sum >= need) {
+            break;
+        }
+    }
+
+    return (ngx_msec_t) 1 << n;
+}
+
+
+static void
+ngx_stream_proxy_hedge_record(ngx_stream_proxy_srv_conf_t *pscf,
+    struct sockaddr *sockaddr, socklen_t socklen, ngx_msec_t time)
+{
+    uint32_t                        hash;
+    ngx_uint_t                      n;
+    ngx_stream_proxy_hedge_slot_t  *slot;
+
+    hash = ngx_crc32_short((u_char *) sockaddr, socklen);
+    slot = &pscf->hedge[hash % NGX_STREAM_PROXY_HEDGE_SLOTS];
+
+    if (slot->hash != hash) {
+        ngx_memzero(slot, sizeof(ngx_stream_proxy_hedge_slot_t));
+        slot->hash = hash;
+    }
+
+    for (n = 0; time && n < NGX_STREAM_PROXY_HEDGE_BUCKETS - 1; n++) {
+        time >>= 1;
+    }
+
+    slot->count[n]++;
+
+    if (++slot->total < NGX_STREAM_PROXY_HEDGE_WINDOW) {
+        return;
+    }
+
+    slot->total = 0;
+
+    for (n = 0; n < NGX_STREAM_PROXY_HEDGE_BUCKETS; n++) {
+        slot->count[n] /= 2;
+        slot->total += slot->count[n];
+    }
+}
+
+
+static void
+ngx_stream_proxy_stagger_handler(ngx_event_t *ev)
+{
+    ngx_stream_session_t                *s;
+    ngx_stream_upstream_t               *u;
+    ngx_stream_proxy_ctx_t              *ctx;
+    ngx_stream_proxy_attempt_t          *a;
+    ngx_stream_upstream_rr_peer_data_t  *rrp;
+
+    s = ev->data;
+    u = s->upstream;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (u->peer.connection == NULL || ctx->attempt.connection) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "stream proxy connect to %V is slow, starting another",
+                   u->peer.name);
+
+    rrp = ngx_stream_proxy_race_data(u);
+
+    /* keep the current attempt aside, its handlers stay in place */
+
+    a = &ctx->attempt;
+
+    a->connection = u->peer.connection;
+    a->sockaddr = u->peer.sockaddr;
+    a->socklen = u->peer.socklen;
+    a->name = u->peer.name;
+    a->peer = rrp->current;
+    a->state = u->state
+               - (ngx_stream_upstream_state_t *) s->upstream_states->elts;
+    a->start_time = u->start_time;
+
+    u->peer.connection = NULL;
+    u->peer.sockaddr = NULL;
+    u->state = NULL;
+
+    ngx_stream_proxy_connect(s);
+}
+
+
+static void
+ngx_stream_proxy_race_handler(ngx_stream_session_t *s, ngx_event_t *ev)
+{
+    ngx_int_t                            rc;
+    ngx_connection_t                    *c, *pc;
+    ngx_stream_upstream_t               *u;
+    ngx_stream_proxy_ctx_t              *ctx;
+    ngx_stream_proxy_srv_conf_t         *pscf;
+    ngx_stream_upstream_rr_peer_data_t  *rrp;
+
+    c = ev->data;
+    u = s->upstream;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, "upstream timed out");
+        rc = NGX_ERROR;
+
+    } else {
+        ngx_del_timer(c->write);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "stream proxy connect upstream, racing");
+
+        rc = ngx_stream_proxy_test_connect(c);
+    }
+
+    if (c == ctx->attempt.connection) {
+
+        if (rc != NGX_OK) {
+            ngx_stream_proxy_attempt_close(s, NGX_PEER_FAILED);
+            return;
+        }
+
+        /* the earlier attempt won, drop the current one */
+
+        pc = u->peer.connection;
+
+        pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+        if (pscf->hedge) {
+            ngx_stream_proxy_hedge_record(pscf, u->peer.sockaddr,
+                                          u->peer.socklen,
+                                          ngx_current_msec - u->start_time);
+        }
+
+        rrp = ngx_stream_proxy_race_data(u);
+        ngx_stream_proxy_race_release(rrp, rrp->current);
+
+        u->state->response_time = ngx_current_msec - u->start_time;
+
+        ngx_close_connection(pc);
+
+        ngx_stream_proxy_attempt_resume(s);
+
+        ngx_stream_proxy_init_upstream(s);
+        return;
+    }
+
+    if (rc != NGX_OK) {
+
+        /* the current attempt failed, continue with the earlier one */
+
+        u->peer.free(&u->peer, u->peer.data, NGX_PEER_FAILED);
+
+        u->state->response_time = ngx_current_msec - u->start_time;
+
+        ngx_close_connection(c);
+
+        ngx_stream_proxy_attempt_resume(s);
+        return;
+    }
+
+    ngx_stream_proxy_init_upstream(s);
+}
+
+
+static void
+ngx_stream_proxy_attempt_resume(ngx_stream_session_t *s)
+{
+    ngx_stream_upstream_t               *u;
+    ngx_stream_proxy_ctx_t              *ctx;
+    ngx_stream_proxy_attempt_t          *a;
+    ngx_stream_upstream_rr_peer_data_t  *rrp;
+
+    u = s->upstream;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+    a = &ctx->attempt;
+
+    rrp = ngx_stream_proxy_race_data(u);
+    rrp->current = a->peer;
+
+    u->peer.connection = a->connection;
+    u->peer.sockaddr = a->sockaddr;
+    u->peer.socklen = a->socklen;
+    u->peer.name = a->name;
+
+    u->state = (ngx_stream_upstream_state_t *) s->upstream_states->elts
+               + a->state;
+    u->start_time = a->start_time;
+
+    a->connection = NULL;
+}
+
+
+static void
+ngx_stream_proxy_attempt_close(ngx_stream_session_t *s, ngx_uint_t state)
+{
+    ngx_stream_upstream_t               *u;
+    ngx_stream_proxy_ctx_t              *ctx;
+    ngx_stream_proxy_attempt_t          *a;
+    ngx_str_t                           *name;
+    socklen_t                            socklen;
+    struct sockaddr                     *sockaddr;
+    ngx_stream_upstream_state_t         *us;
+    ngx_stream_upstream_rr_peer_t       *current;
+    ngx_stream_upstream_rr_peer_data_t  *rrp;
+
+    u = s->upstream;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+    a = &ctx->attempt;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "close stream proxy racing connection: %d",
+                   a->connection->fd);
+
+    rrp = ngx_stream_proxy_race_data(u);
+
+    if (!(state & NGX_PEER_FAILED)) {
+        ngx_stream_proxy_race_release(rrp, a->peer);
+        goto close;
+    }
+
+    current = rrp->current;
+    sockaddr = u->peer.sockaddr;
+    socklen = u->peer.socklen;
+    name = u->peer.name;
+
+    /* the free handlers see the address of the attempt being closed */
+
+    rrp->current = a->peer;
+    u->peer.sockaddr = a->sockaddr;
+    u->peer.socklen = a->socklen;
+    u->peer.name = a->name;
+
+    u->peer.free(&u->peer, u->peer.data, state);
+
+    rrp->current = current;
+    u->peer.sockaddr = sockaddr;
+    u->peer.socklen = socklen;
+    u->peer.name = name;
+
+close:
+
+    us = (ngx_stream_upstream_state_t *) s->upstream_states->elts + a->state;
+    us->response_time = ngx_current_msec - a->start_time;
+
+    ngx_close_connection(a->connection);
+    a->connection = NULL;
+}
+
+
+/*
+ * the loser of a race neither failed nor served the session, so only
+ * its connection is given back to the peer: releasing it as successful
+ * through peer.free() would count a success in the balancer
+ */
+
+static void
+ngx_stream_proxy_race_release(ngx_stream_upstream_rr_peer_data_t *rrp,
+    ngx_stream_upstream_rr_peer_t *peer)
+{
+    ngx_stream_upstream_rr_peers_rlock(rrp->peers);
+    ngx_stream_upstream_rr_peer_lock(rrp->peers, peer);
+
+    peer->conns--;
+
+    ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(rrp->peers);
+}
+
+
+#if (NGX_HAVE_INET6)
+
+static ngx_int_t
+ngx_stream_proxy_interleave_addrs(ngx_pool_t *pool,
+    ngx_stream_upstream_resolved_t *ur)
+{
+    ngx_uint_t             i, j, n;
+    ngx_resolver_addr_t   *addrs;
+
+    /* RFC 8305, section 4: alternate address families, IPv6 first */
+
+    addrs = ngx_palloc(pool, ur->naddrs * sizeof(ngx_resolver_addr_t));
+    if (addrs == NULL) {
+        return NGX_ERROR;
+    }
+
+    i = 0;
+    j = 0;
+
+    for (n = 0; n < ur->naddrs; n++) {
+
+        while (i < ur->naddrs && ur->addrs[i].sockaddr->sa_family != AF_INET6)
+        {
+            i++;
+        }
+
+        while (j < ur->naddrs && ur->addrs[j].sockaddr->sa_family == AF_INET6)
+        {
+            j++;
+        }
+
+        if ((n % 2 == 0 && i < ur->naddrs) || j == ur->naddrs) {
+            addrs[n] = ur->addrs[i++];
+
+        } else {
+            addrs[n] = ur->addrs[j++];
+        }
+    }
+
+    ur->addrs = addrs;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static void
+ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
+    ngx_uint_t do_write)
+{
+    char                         *recv_action, *send_action;
+    off_t                        *received, start, limit;
+    size_t                        size, limit_rate;
+    ssize_t                       n;
+    ngx_buf_t                    *b;
+    ngx_int_t                     rc;
+    ngx_uint_t                    flags, defer, reads, *packets;
+    ngx_msec_t                    delay;
+    ngx_chain_t                  *cl, **ll, **out, **busy;
+    ngx_connection_t             *c, *pc, *src, *dst;
+    ngx_log_handler_pt            handler;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_ctx_t       *ctx;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    u = s->upstream;
+
+    c = s->connection;
+    pc = u->connected ? u->peer.connection : NULL;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (c->type == SOCK_DGRAM && (ngx_terminate || ngx_exiting)) {
+
+        /* socket is already closed on worker shutdown */
+
+        handler = c->log->handler;
+        c->log->handler = NULL;
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0, "disconnected on shutdown");
+
+        c->log->handler = handler;
+
+        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+        return;
+    }
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    if (from_upstream) {
+        src = pc;
+        dst = c;
+        b = &u->upstream_buf;
+        limit_rate = u->download_rate;
+        received = &u->received;
+        packets = &u->responses;
+        out = &u->downstream_out;
+        busy = &u->downstream_busy;
+        recv_action = "proxying and reading from upstream";
+        send_action = "proxying and sending to client";
+
+    } else {
+        src = c;
+        dst = pc;
+        b = &u->downstream_buf;
+        limit_rate = u->upload_rate;
+        received = &s->received;
+        packets = &u->requests;
+        out = &u->upstream_out;
+        busy = &u->upstream_busy;
+        recv_action = "proxying and reading from client";
+        send_action = "proxying and sending to upstream";
+    }
+
+    /*
+     * with batching, datagrams read from the client in this event loop
+     * iteration are sent to upstream together from a posted write event
+     */
+
+    defer = (c->type == SOCK_DGRAM && pscf->udp_batch > 1
+             && !from_upstream && !do_write && dst);
+
+    start = *received;
+    reads = 0;
+
+    for ( ;; ) {
+
+        if (do_write && dst) {
+
+            if (*out || *busy || dst->buffered) {
+                c->log->action = send_action;
+
+                rc = ngx_stream_top_filter(s, *out, from_upstream);
+
+                if (rc == NGX_ERROR) {
+                    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                    return;
+                }
+
+                ngx_chain_update_chains(c->pool, &u->free, busy, out,
+                                      (ngx_buf_tag_t) &ngx_stream_proxy_module);
+
+                ngx_stream_proxy_coalesce_flushed(s, from_upstream);
+
+                if (*busy == NULL) {
+                    b->pos = b->start;
+                    b->last = b->start;
+                }
+            }
+        }
+
+        size = b->end - b->last;
+
+        /*
+         * a direction waiting in a qos queue is only read once resumed
+         * by the scheduler, even if the other side becomes writable
+         */
+
+        if (ctx && ctx->qos_queued
+            && (from_upstream ? ctx->qos_upstream : ctx->qos_downstream))
+        {
+            size = 0;
+        }
+
+        if (size && src->read->ready && !src->read->delayed
+            && !src->read->error)
+        {
+            if ((pscf->read_budget
+                 && *received - start >= (off_t) pscf->read_budget)
+                || (pscf->read_budget_iterations
+                    && reads >= pscf->read_budget_iterations))
+            {
+                /*
+                 * the budget of this event is exhausted, reading is
+                 * resumed after other sessions had their turn
+                 */
+
+                ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                               "proxy read budget exhausted: %O in %ui",
+                               *received - start, reads);
+
+                ngx_stream_proxy_yield(s, src->read,
+                                       pscf->read_budget ? pscf->read_budget
+                                                         : pscf->buffer_size);
+                break;
+            }
+
+            reads++;
+
+            if (limit_rate) {
+                delay = ngx_stream_proxy_rate(s, from_upstream, limit_rate, 0);
+
+                if (delay > 0) {
+                    src->read->delayed = 1;
+                    ngx_add_timer(src->read, delay);
+                    break;
+                }
+
+                if (src->type == SOCK_STREAM) {
+                    limit = ngx_stream_proxy_rate_limit(s, from_upstream,
+                                                        limit_rate);
+
+                    if ((off_t) size > limit) {
+                        size = (size_t) limit;
+                    }
+                }
+            }
+
+            c->log->action = recv_action;
+
+#if (NGX_LINUX)
+            if (from_upstream && src->type == SOCK_DGRAM && !src->shared
+                && (pscf->udp_batch > 1 || pscf->udp_gro))
+            {
+                rc = ngx_stream_proxy_udp_recv_batch(s, pscf);
+
+                if (rc == NGX_AGAIN || rc == NGX_BUSY) {
+                    break;
+                }
+
+                if (rc == NGX_ERROR) {
+                    ngx_stream_proxy_finalize(s,
+                                              NGX_STREAM_INTERNAL_SERVER_ERROR);
+                    return;
+                }
+
+                if (rc == NGX_OK) {
+                    do_write = 1;
+                    continue;
+                }
+
+                /* rc == NGX_DECLINED || rc == NGX_ABORT */
+
+                n = (rc == NGX_DECLINED) ? src->recv(src, b->last, size)
+                                         : NGX_ERROR;
+
+            } else
+#endif
+            {
+                n = src->recv(src, b->last, size);
+            }
+
+            if (n == NGX_AGAIN) {
+                break;
+            }
+
+            if (n == NGX_ERROR) {
+                src->read->eof = 1;
+                n = 0;
+            }
+
+            if (n >= 0) {
+                if (limit_rate) {
+                    delay = ngx_stream_proxy_rate(s, from_upstream,
+                                                  limit_rate, n);
+
+                    if (delay > 0) {
+                        src->read->delayed = 1;
+                        ngx_add_timer(src->read, delay);
+                    }
+                }
+
+                if (n && !from_upstream && src->type == SOCK_DGRAM
+                    && pscf->udp_id_len)
+                {
+                    rc = ngx_stream_proxy_udp_id(s, b->last, n);
+
+                    if (rc == NGX_ERROR) {
+                        ngx_stream_proxy_finalize(s,
+                                              NGX_STREAM_INTERNAL_SERVER_ERROR);
+                        return;
+                    }
+
+                    if (rc == NGX_DECLINED) {
+                        continue;
+                    }
+                }
+
+                if (from_upstream) {
+                    if (u->state->first_byte_time == (ngx_msec_t) -1) {
+                        u->state->first_byte_time = ngx_current_msec
+                                                    - u->start_time;
+                    }
+                }
+
+                for (ll = out; *ll; ll = &(*ll)->next) { /* void */ }
+
+                cl = ngx_chain_get_free_buf(c->pool, &u->free);
+                if (cl == NULL) {
+                    ngx_stream_proxy_finalize(s,
+                                              NGX_STREAM_INTERNAL_SERVER_ERROR);
+                    return;
+                }
+
+                *ll = cl;
+
+                cl->buf->pos = b->last;
+                cl->buf->last = b->last + n;
+                cl->buf->tag = (ngx_buf_tag_t) &ngx_stream_proxy_module;
+
+                cl->buf->temporary = (n ? 1 : 0);
+                cl->buf->last_buf = src->read->eof;
+                cl->buf->flush = !src->read->eof;
+
+                (*packets)++;
+                *received += n;
+                b->last += n;
+                /*
+                 * a deferred batch is flushed at once if the next datagram
+                 * might not fit, as it cannot be read again later
+                 */
+
+                do_write = (!defer
+                            || (size_t) (b->end - b->last) < pscf->buffer_size)
+                           && !ngx_stream_proxy_coalesce(s, from_upstream,
+                                                         b, n);
+
+                continue;
+            }
+        }
+
+        break;
+    }
+
+    c->log->action = "proxying connection";
+
+    ngx_stream_proxy_qos_account(s, from_upstream, *received - start);
+
+    if (defer && *out) {
+        ngx_post_event(dst->write, &ngx_posted_events);
+    }
+
+    if (ngx_stream_proxy_test_finalize(s, from_upstream) == NGX_OK) {
+        return;
+    }
+
+    flags = src->read->eof ? NGX_CLOSE_EVENT : 0;
+
+    if (ngx_handle_read_event(src->read, flags) != NGX_OK) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (dst) {
+
+        if (dst->type == SOCK_STREAM && pscf->half_close
+            && src->read->eof && !u->half_closed && !dst->buffered)
+        {
+            if (ngx_shutdown_socket(dst->fd, NGX_WRITE_SHUTDOWN) == -1) {
+                ngx_connection_error(c, ngx_socket_errno,
+                                     ngx_shutdown_socket_n " failed");
+
+                ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
+            u->half_closed = 1;
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                           "stream proxy %s socket shutdown",
+                           from_upstream ? "client" : "upstream");
+        }
+
+        if (ngx_handle_write_event(dst->write, 0) != NGX_OK) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        if (!c->read->delayed && !pc->read->delayed) {
+            ngx_stream_proxy_idle_timer(s, pscf->timeout);
+
+        } else if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
+    }
+}
+
+
+static void
+ngx_stream_proxy_idle_timer(ngx_stream_session_t *s, ngx_msec_t timeout)
+{
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    /*
+     * activity is only stamped; a timer which is already set is
+     * re-armed for the rest of the timeout when it expires, so that
+     * the timer tree is not updated on every read and write
+     */
+
+    s->upstream->activity = ngx_current_msec;
+
+    if (!c->write->timer_set) {
+        ngx_add_timer(c->write, timeout);
+    }
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream)
+{
+    ngx_connection_t             *c, *pc;
+    ngx_log_handler_pt            handler;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    c = s->connection;
+    u = s->upstream;
+    pc = u->connected ? u->peer.connection : NULL;
+
+    if (c->type == SOCK_DGRAM) {
+
+        if (pscf->requests && u->requests < pscf->requests) {
+            return NGX_DECLINED;
+        }
+
+        if (pscf->requests) {
+            ngx_delete_udp_connection(c);
+        }
+
+        if (pscf->responses == NGX_MAX_INT32_VALUE
+            || u->responses < pscf->responses * u->requests)
+        {
+            return NGX_DECLINED;
+        }
+
+        if (pc == NULL || c->buffered || pc->buffered) {
+            return NGX_DECLINED;
+        }
+
+        handler = c->log->handler;
+        c->log->handler = NULL;
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "udp done"
+                      ", packets from/to client:%ui/%ui"
+                      ", bytes from/to client:%O/%O"
+                      ", bytes from/to upstream:%O/%O",
+                      u->requests, u->responses,
+                      s->received, c->sent, u->received, pc ? pc->sent : 0);
+
+        c->log->handler = handler;
+
+        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+
+        return NGX_OK;
+    }
+
+    /* c->type == SOCK_STREAM */
+
+    if (pc && (c->read->eof || pc->read->eof)
+        && ngx_stream_proxy_coalesce_pending(s))
+    {
+        return NGX_DECLINED;
+    }
+
+    if (pc == NULL
+        || (!c->read->eof && !pc->read->eof)
+        || (!c->read->eof && c->buffered)
+        || (!pc->read->eof && pc->buffered))
+    {
+        return NGX_DECLINED;
+    }
+
+    if (pscf->half_close) {
+        /* avoid closing live connections until both read ends get EOF */
+        if (!(c->read->eof && pc->read->eof && !c->buffered && !pc->buffered)) {
+             return NGX_DECLINED;
+        }
+    }
+
+    handler = c->log->handler;
+    c->log->handler = NULL;
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "%s disconnected"
+                  ", bytes from/to client:%O/%O"
+                  ", bytes from/to upstream:%O/%O",
+                  from_upstream ? "upstream" : "client",
+                  s->received, c->sent, u->received, pc ? pc->sent : 0);
+
+    c->log->handler = handler;
+
+    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_LINUX)
+
+static ngx_int_t
+ngx_stream_proxy_udp_recv_batch(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf)
+{
+    u_char                 *p, *q, *last;
+    size_t                  slot, seg, total;
+    ssize_t                 n;
+    ngx_err_t               err;
+    ngx_uint_t              i;
+    ngx_msec_t              delay;
+    ngx_buf_t              *b;
+    ngx_chain_t            *cl, **ll;
+    ngx_connection_t       *pc;
+    ngx_stream_upstream_t  *u;
+#if (defined UDP_GRO)
+    int                     gso_size;
+    struct cmsghdr         *cmsg;
+    u_char                  msg_control[NGX_STREAM_PROXY_UDP_BATCH_MAX]
+                                       [CMSG_SPACE(sizeof(int))];
+#endif
+    struct iovec            iovs[NGX_STREAM_PROXY_UDP_BATCH_MAX];
+    struct mmsghdr          msgs[NGX_STREAM_PROXY_UDP_BATCH_MAX];
+
+    u = s->upstream;
+    pc = u->peer.connection;
+    b = &u->upstream_buf;
+
+    slot = pscf->udp_gro ? NGX_STREAM_PROXY_UDP_GRO_SLOT : pscf->buffer_size;
+
+    n = (b->end - b->last) / slot;
+
+    if (pscf->udp_gro) {
+
+        /*
+         * with GRO every read has to go through recvmsg() to see
+         * the segment size, so wait until a whole slot is free
+         */
+
+        if (n == 0) {
+            return NGX_BUSY;
+        }
+
+    } else if (n < 2) {
+        return NGX_DECLINED;
+    }
+
+    if ((ngx_uint_t) n > pscf->udp_batch) {
+        n = pscf->udp_batch;
+    }
+
+    ngx_memzero(msgs, n * sizeof(struct mmsghdr));
+
+    for (i = 0, p = b->last; i < (ngx_uint_t) n; i++, p += slot) {
+        iovs[i].iov_base = (void *) p;
+        iovs[i].iov_len = slot;
+
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+
+#if (defined UDP_GRO)
+        if (pscf->udp_gro) {
+            msgs[i].msg_hdr.msg_control = msg_control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(msg_control[i]);
+        }
+#endif
+    }
+
+    for ( ;; ) {
+        n = recvmmsg(pc->fd, msgs, n, 0, NULL);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "recvmmsg: fd:%d %z", pc->fd, n);
+
+        if (n > 0) {
+            break;
+        }
+
+        err = ngx_socket_errno;
+
+        if (n == 0 || err == NGX_EAGAIN) {
+            pc->read->ready = 0;
+            return NGX_AGAIN;
+        }
+
+        if (err != NGX_EINTR) {
+            ngx_connection_error(pc, err, "recvmmsg() failed");
+
+            pc->read->ready = 0;
+            pc->read->error = 1;
+
+            return NGX_ABORT;
+        }
+    }
+
+    if (u->state->first_byte_time == (ngx_msec_t) -1) {
+        u->state->first_byte_time = ngx_current_msec - u->start_time;
+    }
+
+    for (ll = &u->downstream_out; *ll; ll = &(*ll)->next) { /* void */ }
+
+    total = 0;
+
+    for (i = 0, p = b->last; i < (ngx_uint_t) n; i++, p += slot) {
+
+        last = p + msgs[i].msg_len;
+        seg = msgs[i].msg_len;
+
+#if (defined UDP_GRO)
+
+        /* a GRO super-packet is split back into the original datagrams */
+
+        for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+             cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                ngx_memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(int));
+
+                if (gso_size > 0) {
+                    seg = gso_size;
+                }
+
+                break;
+            }
+        }
+
+#endif
+
+        q = p;
+
+        do {
+            cl = ngx_chain_get_free_buf(s->connection->pool, &u->free);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            *ll = cl;
+            ll = &cl->next;
+
+            cl->buf->pos = q;
+
+            q = ((size_t) (last - q) > seg) ? q + seg : last;
+
+            cl->buf->last = q;
+            cl->buf->tag = (ngx_buf_tag_t) &ngx_stream_proxy_module;
+
+            cl->buf->temporary = (cl->buf->pos == q) ? 0 : 1;
+            cl->buf->last_buf = 0;
+            cl->buf->flush = 1;
+
+            u->responses++;
+
+        } while (q < last);
+
+        u->received += msgs[i].msg_len;
+        total += msgs[i].msg_len;
+        b->last = last;
+    }
+
+    if (u->download_rate) {
+        delay = ngx_stream_proxy_rate(s, 1, u->download_rate, total);
+
+        if (delay > 0) {
+            pc->read->delayed = 1;
+            ngx_add_timer(pc->read, delay);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_chain_t *
+ngx_stream_proxy_udp_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    u_char                        *prev;
+    off_t                          send;
+    size_t                         size, total;
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_uint_t                     i, k, niovs, ndgrams, nmsgs, flush, gso;
+    ngx_chain_t                   *cl;
+    struct iovec                  *iov;
+    struct mmsghdr                *msg;
+    ngx_stream_session_t          *s;
+    ngx_stream_proxy_ctx_t        *ctx;
+    ngx_stream_proxy_srv_conf_t   *pscf;
+    ngx_stream_proxy_udp_dgram_t  *dg;
+#if (defined UDP_SEGMENT)
+    uint16_t                       segment;
+    struct cmsghdr                *cmsg;
+    u_char                         msg_control[NGX_STREAM_PROXY_UDP_BATCH_MAX]
+                                              [CMSG_SPACE(sizeof(uint16_t))];
+#endif
+    struct iovec                   iovs[NGX_IOVS_PREALLOCATE];
+    struct mmsghdr                 msgs[NGX_STREAM_PROXY_UDP_BATCH_MAX];
+    ngx_stream_proxy_udp_dgram_t   dgrams[NGX_STREAM_PROXY_UDP_BATCH_MAX];
+
+    if (!c->write->ready) {
+        return in;
+    }
+
+    s = c->data;
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    ctx = ngx_stream_proxy_get_ctx(s);
+    if (ctx == NULL) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (limit == 0 || limit > (off_t) (NGX_MAX_SIZE_T_VALUE - ngx_pagesize)) {
+        limit = NGX_MAX_SIZE_T_VALUE - ngx_pagesize;
+    }
+
+    send = 0;
+
+    for ( ;; ) {
+
+        /*
+         * split the chain into datagrams, each terminated by a flush
+         * or last_buf buffer, as ngx_udp_send_chain() does
+         */
+
+        niovs = 0;
+        ndgrams = 0;
+        cl = in;
+
+        while (cl && ndgrams < pscf->udp_batch) {
+
+            i = niovs;
+            iov = NULL;
+            prev = NULL;
+            total = 0;
+            flush = 0;
+
+            for ( /* void */ ; cl; cl = cl->next) {
+
+                if (!ngx_buf_special(cl->buf)) {
+
+                    if (!ngx_buf_in_memory(cl->buf)) {
+                        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                                      "bad buf in output chain "
+                                      "t:%d r:%d f:%d %p %p-%p %p %O-%O",
+                                      cl->buf->temporary,
+                                      cl->buf->recycled,
+                                      cl->buf->in_file,
+                                      cl->buf->start,
+                                      cl->buf->pos,
+                                      cl->buf->last,
+                                      cl->buf->file,
+                                      cl->buf->file_pos,
+                                      cl->buf->file_last);
+
+                        ngx_debug_point();
+
+                        return NGX_CHAIN_ERROR;
+                    }
+
+                    size = cl->buf->last - cl->buf->pos;
+
+                    if (prev == cl->buf->pos) {
+                        iov->iov_len += size;
+
+                    } else {
+                        if (i == NGX_IOVS_PREALLOCATE) {
+                            break;
+                        }
+
+                        iov = &iovs[i++];
+
+                        iov->iov_base = (void *) cl->buf->pos;
+                        iov->iov_len = size;
+                    }
+
+                    prev = cl->buf->pos + size;
+                    total += size;
+                }
+
+                if (cl->buf->flush || cl->buf->last_buf) {
+                    flush = 1;
+                    cl = cl->next;
+                    break;
+                }
+            }
+
+            if (!flush) {
+
+                if (cl && ndgrams == 0) {
+                    ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                                  "too many parts in a datagram");
+                    return NGX_CHAIN_ERROR;
+                }
+
+                /* incomplete datagram, or no iovecs left in this batch */
+
+                break;
+            }
+
+            /* zero-sized datagram; pretend to have at least 1 iov */
+
+            if (i == niovs) {
+                if (i == NGX_IOVS_PREALLOCATE) {
+                    break;
+                }
+
+                iov = &iovs[i++];
+                iov->iov_base = NULL;
+                iov->iov_len = 0;
+            }
+
+            dg = &dgrams[ndgrams++];
+
+            dg->iov = niovs;
+            dg->last = i;
+            dg->size = total;
+
+            niovs = i;
+        }
+
+        if (ndgrams == 0) {
+            return in;
+        }
+
+        /*
+         * with GSO, a run of equally sized datagrams is passed as one
+         * message, only the last segment of which may be shorter
+         */
+
+        nmsgs = 0;
+        gso = 0;
+
+        for (i = 0; i < ndgrams; i = k) {
+
+            k = i + 1;
+
+#if (defined UDP_SEGMENT)
+
+            if (pscf->udp_gso && !ctx->udp_gso_off && dgrams[i].size) {
+
+                total = dgrams[i].size;
+
+                while (k < ndgrams
+                       && dgrams[k].size
+                       && dgrams[k].size <= dgrams[i].size
+                       && total + dgrams[k].size
+                          <= NGX_STREAM_PROXY_UDP_GSO_MAX)
+                {
+                    total += dgrams[k].size;
+
+                    if (dgrams[k++].size < dgrams[i].size) {
+                        break;
+                    }
+                }
+            }
+
+#endif
+
+            msg = &msgs[nmsgs];
+
+            ngx_memzero(msg, sizeof(struct mmsghdr));
+
+            msg->msg_hdr.msg_iov = &iovs[dgrams[i].iov];
+            msg->msg_hdr.msg_iovlen = dgrams[k - 1].last - dgrams[i].iov;
+
+#if (defined UDP_SEGMENT)
+
+            if (k - i > 1) {
+                msg->msg_hdr.msg_control = msg_control[nmsgs];
+                msg->msg_hdr.msg_controllen = sizeof(msg_control[nmsgs]);
+
+                cmsg = CMSG_FIRSTHDR(&msg->msg_hdr);
+
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+                segment = (uint16_t) dgrams[i].size;
+                ngx_memcpy(CMSG_DATA(cmsg), &segment, sizeof(uint16_t));
+
+                gso = 1;
+
+                ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                               "udp gso: %ui datagrams of %uz fd:%d",
+                               k - i, dgrams[i].size, c->fd);
+            }
+
+#endif
+
+            nmsgs++;
+        }
+
+    eintr:
+
+        n = sendmmsg(c->fd, msgs, nmsgs, 0);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "sendmmsg: %z of %ui fd:%d", n, nmsgs, c->fd);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            switch (err) {
+            case NGX_EAGAIN:
+                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                               "sendmmsg() not ready");
+                c->write->ready = 0;
+                return in;
+
+            case NGX_EINTR:
+                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                               "sendmmsg() was interrupted");
+                goto eintr;
+
+            case EIO:
+            case EINVAL:
+
+                /*
+                 * devices and kernels without UDP segmentation offload
+                 * reject such messages, the batch is sent again without it
+                 */
+
+                if (gso) {
+                    ngx_log_error(NGX_LOG_INFO, c->log, err,
+                                  "sendmmsg() with UDP_SEGMENT failed, "
+                                  "sending without segmentation");
+
+                    ctx->udp_gso_off = 1;
+                    continue;
+                }
+
+                /* fall through */
+
+            default:
+                c->write->error = 1;
+                ngx_connection_error(c, err, "sendmmsg() failed");
+                return NGX_CHAIN_ERROR;
+            }
+        }
+
+        /* the kernel sets msg_len to the number of bytes sent */
+
+        for (total = 0, i = 0; i < (ngx_uint_t) n; i++) {
+            total += msgs[i].msg_len;
+        }
+
+        c->sent += total;
+        send += total;
+
+        in = ngx_chain_update_sent(in, total);
+
+        if ((ngx_uint_t) n < nmsgs) {
+            c->write->ready = 0;
+            return in;
+        }
+
+        if (send >= limit || in == NULL) {
+            return in;
+        }
+    }
+}
+
+#endif
+
+
+static ngx_stream_proxy_ctx_t *
+ngx_stream_proxy_get_ctx(ngx_stream_session_t *s)
+{
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_stream_proxy_ctx_t));
+        if (ctx == NULL) {
+            return NULL;
+        }
+
+        ctx->session = s;
+
+        ngx_stream_set_ctx(s, ctx, ngx_stream_proxy_module);
+    }
+
+    return ctx;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_qos_init(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf)
+{
+    ngx_str_t                      name;
+    ngx_uint_t                     i;
+    ngx_stream_proxy_ctx_t        *ctx;
+    ngx_stream_proxy_qos_class_t  *cls;
+    ngx_stream_proxy_main_conf_t  *pmcf;
+
+    if (ngx_stream_complex_value(s, pscf->qos, &name) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    pmcf = ngx_stream_get_module_main_conf(s, ngx_stream_proxy_module);
+
+    cls = pmcf->qos_classes.elts;
+
+    for (i = 0; i < pmcf->qos_classes.nelts; i++) {
+
+        if (cls[i].name.len == name.len
+            && ngx_strncmp(cls[i].name.data, name.data, name.len) == 0)
+        {
+            ctx = ngx_stream_proxy_get_ctx(s);
+            if (ctx == NULL) {
+                return NGX_ERROR;
+            }
+
+            ctx->qos_class = &cls[i];
+
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                           "proxy qos class: \"%V\"", &name);
+
+            return NGX_OK;
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "proxy qos class \"%V\" not found", &name);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_proxy_yield(ngx_stream_session_t *s, ngx_event_t *ev, off_t cost)
+{
+    ngx_stream_proxy_ctx_t        *ctx;
+    ngx_stream_proxy_qos_class_t  *cls;
+    ngx_stream_proxy_main_conf_t  *pmcf;
+
+    pmcf = ngx_stream_get_module_main_conf(s, ngx_stream_proxy_module);
+
+    s->upstream->budget_yields++;
+    pmcf->budget_yields++;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL || ctx->qos_class == NULL) {
+        ngx_post_event(ev, &ngx_posted_next_events);
+        return;
+    }
+
+    /*
+     * sessions of a class wait in its queue, and the worker's qos
+     * event resumes them by deficit round robin across classes
+     */
+
+    if (ev == s->connection->read) {
+        ctx->qos_downstream = 1;
+
+    } else {
+        ctx->qos_upstream = 1;
+    }
+
+    cls = ctx->qos_class;
+
+    if (!ctx->qos_queued) {
+        ngx_queue_insert_tail(&cls->queue, &ctx->qos_queue);
+
+        ctx->qos_queued = 1;
+        ctx->qos_start = ngx_current_msec;
+        ctx->qos_cost = cost;
+    }
+
+    if (!pmcf->qos_event.posted) {
+        ngx_post_event(&pmcf->qos_event, &ngx_posted_next_events);
+    }
+}
+
+
+static void
+ngx_stream_proxy_qos_account(ngx_stream_session_t *s, ngx_uint_t from_upstream,
+    off_t bytes)
+{
+    ngx_stream_proxy_ctx_t        *ctx;
+    ngx_stream_proxy_qos_class_t  *cls;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL || ctx->qos_class == NULL) {
+        return;
+    }
+
+    cls = ctx->qos_class;
+
+    cls->bytes += bytes;
+
+    if (ctx->qos_credit[from_upstream]) {
+
+        /*
+         * the turn of the direction which yielded was paid for
+         * in advance, settle the actual amount
+         */
+
+        cls->deficit += ctx->qos_credit[from_upstream] - bytes;
+        ctx->qos_credit[from_upstream] = 0;
+    }
+}
+
+
+static void
+ngx_stream_proxy_qos_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                     i, pending;
+    ngx_queue_t                   *q;
+    ngx_connection_t              *pc;
+    ngx_stream_session_t          *s;
+    ngx_stream_proxy_ctx_t        *ctx;
+    ngx_stream_proxy_qos_class_t  *cls;
+    ngx_stream_proxy_main_conf_t  *pmcf;
+
+    pmcf = ev->data;
+
+    pending = 0;
+    cls = pmcf->qos_classes.elts;
+
+    for (i = 0; i < pmcf->qos_classes.nelts; i++) {
+
+        if (ngx_queue_empty(&cls[i].queue)) {
+            cls[i].deficit = 0;
+            continue;
+        }
+
+        /*
+         * deficit round robin: each round a class is given a quantum
+         * of its weight times the budget of a session, and resumes
+         * sessions while the quantum lasts
+         */
+
+        q = ngx_queue_head(&cls[i].queue);
+        ctx = ngx_queue_data(q, ngx_stream_proxy_ctx_t, qos_queue);
+
+        cls[i].deficit += (off_t) cls[i].weight * ctx->qos_cost;
+
+        while (!ngx_queue_empty(&cls[i].queue)) {
+
+            q = ngx_queue_head(&cls[i].queue);
+            ctx = ngx_queue_data(q, ngx_stream_proxy_ctx_t, qos_queue);
+
+            if (ctx->qos_cost > cls[i].deficit) {
+                break;
+            }
+
+            ngx_queue_remove(q);
+            ctx->qos_queued = 0;
+
+            cls[i].deficit -= ctx->qos_cost;
+
+            if (ctx->qos_downstream && ctx->qos_upstream) {
+                ctx->qos_credit[0] += ctx->qos_cost / 2;
+                ctx->qos_credit[1] += ctx->qos_cost - ctx->qos_cost / 2;
+
+            } else {
+                ctx->qos_credit[ctx->qos_upstream] += ctx->qos_cost;
+            }
+
+            ctx->qos_wait += ngx_current_msec - ctx->qos_start;
+            cls[i].wait += ngx_current_msec - ctx->qos_start;
+
+            s = ctx->session;
+
+            if (ctx->qos_downstream) {
+                ctx->qos_downstream = 0;
+                ngx_post_event(s->connection->read, &ngx_posted_events);
+            }
+
+            pc = s->upstream->peer.connection;
+
+            if (ctx->qos_upstream) {
+                ctx->qos_upstream = 0;
+
+                if (pc) {
+                    ngx_post_event(pc->read, &ngx_posted_events);
+                }
+            }
+        }
+
+        if (!ngx_queue_empty(&cls[i].queue)) {
+            pending = 1;
+        }
+    }
+
+    if (pending) {
+        ngx_post_event(ev, &ngx_posted_next_events);
+    }
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_coalesce_init(ngx_stream_session_t *s)
+{
+    ngx_uint_t               i;
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    ctx = ngx_stream_proxy_get_ctx(s);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->coalesce) {
+        return NGX_OK;
+    }
+
+    for (i = 0; i < 2; i++) {
+        ctx->flush[i].handler = ngx_stream_proxy_flush_handler;
+        ctx->flush[i].data = ctx;
+        ctx->flush[i].log = s->connection->log;
+    }
+
+    ctx->coalesce = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_stream_proxy_coalesce(ngx_stream_session_t *s, ngx_uint_t from_upstream,
+    ngx_buf_t *b, ssize_t n)
+{
+    ngx_event_t                  *ev;
+    ngx_stream_proxy_ctx_t       *ctx;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL || !ctx->coalesce) {
+        return 0;
+    }
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    /*
+     * small reads are held back until proxy_coalesce bytes are
+     * gathered or proxy_coalesce_timeout expires; a stream whose
+     * average read is large enough is passed through as is
+     */
+
+    ctx->read_avg[from_upstream] += (n - ctx->read_avg[from_upstream]) / 8;
+    ctx->held[from_upstream] += n;
+
+    if (n == 0
+        || b->last == b->end
+        || ctx->held[from_upstream] >= (off_t) pscf->coalesce
+        || ctx->read_avg[from_upstream] * 2 >= (off_t) pscf->coalesce)
+    {
+        return 0;
+    }
+
+    ev = &ctx->flush[from_upstream];
+
+    if (!ev->timer_set) {
+        ngx_add_timer(ev, pscf->coalesce_timeout);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "proxy coalesce: %O held, average read %O",
+                   ctx->held[from_upstream], ctx->read_avg[from_upstream]);
+
+    return 1;
+}
+
+
+/*
+ * data held back is not yet in c->buffered or pc->buffered; once a side
+ * is closed it is flushed at once, and the session waits for that
+ */
+
+static ngx_uint_t
+ngx_stream_proxy_coalesce_pending(ngx_stream_session_t *s)
+{
+    ngx_uint_t               i, pending;
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL || !ctx->coalesce) {
+        return 0;
+    }
+
+    pending = 0;
+
+    for (i = 0; i < 2; i++) {
+
+        if (ctx->held[i] == 0) {
+            continue;
+        }
+
+        pending = 1;
+
+        if (ctx->flush[i].timer_set) {
+            ngx_del_timer(&ctx->flush[i]);
+        }
+
+        if (!ctx->flush[i].posted) {
+            ngx_post_event(&ctx->flush[i], &ngx_posted_events);
+        }
+    }
+
+    return pending;
+}
+
+
+static void
+ngx_stream_proxy_coalesce_flushed(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream)
+{
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL || !ctx->coalesce) {
+        return;
+    }
+
+    ctx->held[from_upstream] = 0;
+
+    if (ctx->flush[from_upstream].timer_set) {
+        ngx_del_timer(&ctx->flush[from_upstream]);
+    }
+}
+
+
+static void
+ngx_stream_proxy_flush_handler(ngx_event_t *ev)
+{
+    ngx_stream_proxy_ctx_t  *ctx;
+
+    ctx = ev->data;
+
+    ev->timedout = 0;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "proxy coalesce flush");
+
+    ngx_stream_proxy_process(ctx->session, ev == &ctx->flush[1], 1);
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_rate_init(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf)
+{
+    size_t                         n;
+    uint32_t                       hash;
+    ngx_str_t                      key;
+    ngx_rbtree_node_t             *node;
+    ngx_pool_cleanup_t            *cln;
+    ngx_stream_proxy_ctx_t        *ctx;
+    ngx_stream_proxy_rate_node_t  *rn;
+    ngx_stream_proxy_rate_zone_t  *zone;
+
+    ctx = ngx_stream_proxy_get_ctx(s);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->rate_init) {
+        return NGX_OK;
+    }
+
+    ctx->rate_init = 1;
+
+    if (pscf->rate_zone == NULL) {
+        return NGX_OK;
+    }
+
+    zone = pscf->rate_zone->data;
+
+    if (ngx_stream_complex_value(s, &zone->key, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (key.len == 0) {
+        return NGX_OK;
+    }
+
+    if (key.len > 65535) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "the value of the \"%V\" key "
+                      "is more than 65535 bytes: \"%V\"",
+                      &zone->key.value, &key);
+        return NGX_OK;
+    }
+
+    cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    rn = ngx_stream_proxy_rate_lookup(zone, &key, hash);
+
+    if (rn == NULL) {
+
+        ngx_stream_proxy_rate_expire(zone, 1);
+
+        n = offsetof(ngx_rbtree_node_t, color)
+            + offsetof(ngx_stream_proxy_rate_node_t, data)
+            + key.len;
+
+        node = ngx_slab_alloc_locked(zone->shpool, n);
+
+        if (node == NULL) {
+            ngx_stream_proxy_rate_expire(zone, 0);
+
+            node = ngx_slab_alloc_locked(zone->shpool, n);
+            if (node == NULL) {
+                ngx_shmtx_unlock(&zone->shpool->mutex);
+
+                ngx_log_error(NGX_LOG_ALERT, s->connection->log, 0,
+                              "could not allocate node%s",
+                              zone->shpool->log_ctx);
+
+                /* the session is limited on its own */
+
+                return NGX_OK;
+            }
+        }
+
+        node->key = hash;
+
+        rn = (ngx_stream_proxy_rate_node_t *) &node->color;
+
+        rn->len = (u_short) key.len;
+        rn->count = 0;
+        ngx_memzero(rn->bucket, sizeof(rn->bucket));
+        ngx_memcpy(rn->data, key.data, key.len);
+
+        ngx_rbtree_insert(&zone->sh->rbtree, node);
+
+    } else {
+        ngx_queue_remove(&rn->queue);
+    }
+
+    ngx_queue_insert_head(&zone->sh->queue, &rn->queue);
+
+    rn->count++;
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    ctx->rate_zone = zone;
+    ctx->rate_node = rn;
+
+    cln->handler = ngx_stream_proxy_rate_cleanup;
+    cln->data = ctx;
+
+    return NGX_OK;
+}
+
+
+static ngx_msec_t
+ngx_stream_proxy_rate(ngx_stream_session_t *s, ngx_uint_t from_upstream,
+    size_t rate, off_t n)
+{
+    ngx_msec_t                     delay;
+    ngx_stream_proxy_ctx_t        *ctx;
+    ngx_stream_proxy_rate_node_t  *rn;
+    ngx_stream_proxy_srv_conf_t   *pscf;
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    rn = ctx->rate_node;
+
+    if (rn == NULL) {
+        return ngx_stream_proxy_rate_account(&ctx->bucket[from_upstream],
+                                             rate, pscf->rate_burst, n);
+    }
+
+    ngx_shmtx_lock(&ctx->rate_zone->shpool->mutex);
+
+    delay = ngx_stream_proxy_rate_account(&rn->bucket[from_upstream],
+                                          rate, pscf->rate_burst, n);
+
+    ngx_queue_remove(&rn->queue);
+    ngx_queue_insert_head(&ctx->rate_zone->sh->queue, &rn->queue);
+
+    ngx_shmtx_unlock(&ctx->rate_zone->shpool->mutex);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "proxy shared rate: %O of %uz, delay %M",
+                   rn->bucket[from_upstream].excess, pscf->rate_burst, delay);
+
+    return delay;
+}
+
+
+/*
+ * a read may take what is left of the burst, but at least 10ms worth
+ * of the rate, so that a zero burst does not degrade to tiny reads
+ */
+
+static off_t
+ngx_stream_proxy_rate_limit(ngx_stream_session_t *s, ngx_uint_t from_upstream,
+    size_t rate)
+{
+    off_t                          limit;
+    ngx_stream_proxy_ctx_t        *ctx;
+    ngx_stream_proxy_rate_node_t  *rn;
+    ngx_stream_proxy_srv_conf_t   *pscf;
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    rn = ctx->rate_node;
+
+    if (rn == NULL) {
+        limit = (off_t) pscf->rate_burst - ctx->bucket[from_upstream].excess;
+
+    } else {
+        ngx_shmtx_lock(&ctx->rate_zone->shpool->mutex);
+        limit = (off_t) pscf->rate_burst - rn->bucket[from_upstream].excess;
+        ngx_shmtx_unlock(&ctx->rate_zone->shpool->mutex);
+    }
+
+    return ngx_max(limit, (off_t) (rate / 100 + 1));
+}
+
+
+static ngx_msec_t
+ngx_stream_proxy_rate_account(ngx_stream_proxy_bucket_t *bk, size_t rate,
+    size_t burst, off_t n)
+{
+    off_t           drain;
+    ngx_msec_int_t  ms;
+
+    /*
+     * the bucket tracks the excess over the rate, which drains
+     * with millisecond resolution; reading is delayed while
+     * the excess is above the burst
+     */
+
+    ms = (ngx_msec_int_t) (ngx_current_msec - bk->last);
+
+    if (ms < 0) {
+        /* ngx_current_msec of another worker may lag behind */
+        ms = 0;
+    }
+
+    if (bk->excess == 0 || ms >= bk->excess * 1000 / (off_t) rate) {
+        bk->excess = 0;
+        bk->last = ngx_current_msec;
+
+    } else {
+        drain = (off_t) rate * ms / 1000;
+
+        /* the remainder of a partially drained byte is kept in bk->last */
+
+        bk->excess -= drain;
+        bk->last += (ngx_msec_t) (drain * 1000 / rate);
+    }
+
+    bk->excess += n;
+    bk->rate = rate;
+
+    if (bk->excess <= (off_t) burst) {
+        return 0;
+    }
+
+    return (ngx_msec_t) ((bk->excess - burst) * 1000 / rate + 1);
+}
+
+
+static ngx_uint_t
+ngx_stream_proxy_rate_drained(ngx_stream_proxy_bucket_t *bk)
+{
+    ngx_uint_t      i;
+    ngx_msec_int_t  ms;
+
+    for (i = 0; i < 2; i++) {
+
+        if (bk[i].excess == 0 || bk[i].rate == 0) {
+            continue;
+        }
+
+        ms = (ngx_msec_int_t) (ngx_current_msec - bk[i].last);
+
+        if (ms < bk[i].excess * 1000 / (off_t) bk[i].rate) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static ngx_stream_proxy_rate_node_t *
+ngx_stream_proxy_rate_lookup(ngx_stream_proxy_rate_zone_t *zone,
+    ngx_str_t *key, uint32_t hash)
+{
+    ngx_int_t                      rc;
+    ngx_rbtree_node_t             *node, *sentinel;
+    ngx_stream_proxy_rate_node_t  *rn;
+
+    node = zone->sh->rbtree.root;
+    sentinel = zone->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        rn = (ngx_stream_proxy_rate_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, rn->data, key->len, (size_t) rn->len);
+
+        if (rc == 0) {
+            return rn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_stream_proxy_rate_expire(ngx_stream_proxy_rate_zone_t *zone, ngx_uint_t n)
+{
+    ngx_queue_t                   *q;
+    ngx_rbtree_node_t             *node;
+    ngx_stream_proxy_rate_node_t  *rn;
+
+    /*
+     * n == 1 deletes one or two unused drained entries
+     * n == 0 deletes oldest unused entry by force
+     *        and one or two unused drained entries
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&zone->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&zone->sh->queue);
+
+        rn = ngx_queue_data(q, ngx_stream_proxy_rate_node_t, queue);
+
+        if (rn->count) {
+            return;
+        }
+
+        if (n++ != 0 && !ngx_stream_proxy_rate_drained(rn->bucket)) {
+            return;
+        }
+
+        ngx_queue_remove(q);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) rn - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_rbtree_delete(&zone->sh->rbtree, node);
+
+        ngx_slab_free_locked(zone->shpool, node);
+    }
+}
+
+
+static void
+ngx_stream_proxy_rate_cleanup(void *data)
+{
+    ngx_stream_proxy_ctx_t  *ctx = data;
+
+    ngx_shmtx_lock(&ctx->rate_zone->shpool->mutex);
+
+    ctx->rate_node->count--;
+
+    ngx_shmtx_unlock(&ctx->rate_zone->shpool->mutex);
+}
+
+
+static void
+ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
+{
+    ngx_msec_t                    timeout;
+    ngx_connection_t             *pc;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "stream proxy next upstream");
+
+    u = s->upstream;
+    pc = u->peer.connection;
+
+    if (pc && pc->buffered) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "buffered data on next upstream");
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (s->connection->type == SOCK_DGRAM) {
+        u->upstream_out = NULL;
+    }
+
+    if (u->peer.sockaddr) {
+        u->peer.free(&u->peer, u->peer.data, NGX_PEER_FAILED);
+        u->peer.sockaddr = NULL;
+    }
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    timeout = pscf->next_upstream_timeout;
+
+    if (u->peer.tries == 0
+        || !pscf->next_upstream
+        || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
+    {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
+        return;
+    }
+
+    if (pc) {
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "close proxy upstream connection: %d", pc->fd);
+
+#if (NGX_STREAM_SSL)
+        if (pc->ssl) {
+            pc->ssl->no_wait_shutdown = 1;
+            pc->ssl->no_send_shutdown = 1;
+
+            (void) ngx_ssl_shutdown(pc);
+        }
+#endif
+
+        u->state->bytes_received = u->received;
+        u->state->bytes_sent = pc->sent;
+
+        ngx_close_connection(pc);
+        u->peer.connection = NULL;
+    }
+
+    ngx_stream_proxy_connect(s);
+}
+
+
+static void
+ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
+{
+    ngx_uint_t                    state;
+    ngx_connection_t             *pc;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_ctx_t       *ctx;
     ngx_stream_proxy_srv_conf_t  *pscf;
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "finalize stream proxy: %i", rc);
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx) {
+        if (ctx->qos_queued) {
+            ngx_queue_remove(&ctx->qos_queue);
+            ctx->qos_queued = 0;
+        }
+
+        if (ctx->flush[0].timer_set) {
+            ngx_del_timer(&ctx->flush[0]);
+        }
+
+        if (ctx->flush[1].timer_set) {
+            ngx_del_timer(&ctx->flush[1]);
+        }
+
+        if (ctx->flush[0].posted) {
+            ngx_delete_posted_event(&ctx->flush[0]);
+        }
+
+        if (ctx->flush[1].posted) {
+            ngx_delete_posted_event(&ctx->flush[1]);
+        }
+
+        if (ctx->stagger.timer_set) {
+            ngx_del_timer(&ctx->stagger);
+        }
+    }
+
+    u = s->upstream;
+
+    if (u == NULL) {
+        goto noupstream;
+    }
+
+    if (u->resolved && u->resolved->ctx) {
+        ngx_resolve_name_done(u->resolved->ctx);
+        u->resolved->ctx = NULL;
+    }
+
+    if (ctx && ctx->attempt.connection) {
+        ngx_stream_proxy_attempt_close(s, 0);
+    }
+
+    pc = u->peer.connection;
+
+    if (u->state) {
+        if (u->state->response_time == (ngx_msec_t) -1) {
+            u->state->response_time = ngx_current_msec - u->start_time;
+        }
+
+        if (pc) {
+            u->state->bytes_received = u->received;
+            u->state->bytes_sent = pc->sent;
+        }
+    }
+
+    if (u->peer.free && u->peer.sockaddr) {
+        state = 0;
+
+        if (pc && pc->type == SOCK_DGRAM
+            && (pc->read->error || pc->write->error))
+        {
+            state = NGX_PEER_FAILED;
+
+        } else if (rc == NGX_STREAM_OK && pc && pc->type == SOCK_DGRAM
+                   && u->connected)
+        {
+            pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+            /*
+             * the socket may be reused only if no more responses
+             * are expected on it
+             */
+
+            if (pscf->responses != NGX_MAX_INT32_VALUE
+                && u->responses >= pscf->responses * u->requests)
+            {
+                state = NGX_PEER_KEEPALIVE;
+            }
+        }
+
+        u->peer.free(&u->peer, u->peer.data, state);
+        u->peer.sockaddr = NULL;
+
+        /* the connection is NULL if it was cached */
+
+        pc = u->peer.connection;
+    }
+
+    if (pc) {
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "close stream proxy upstream connection: %d", pc->fd);
+
+#if (NGX_STREAM_SSL)
+        if (pc->ssl) {
+            pc->ssl->no_wait_shutdown = 1;
+            (void) ngx_ssl_shutdown(pc);
+        }
+#endif
+
+        ngx_close_connection(pc);
+        u->peer.connection = NULL;
+    }
+
+noupstream:
+
+    ngx_stream_finalize_session(s, rc);
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_udp_cache_init_peer(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf)
+{
+    ngx_stream_upstream_t                   *u;
+    ngx_stream_proxy_udp_cache_peer_data_t  *cp;
+
+    u = s->upstream;
+
+    if (u->peer.get == ngx_stream_proxy_get_udp_cached_peer
+        || u->peer.notify)
+    {
+        return NGX_OK;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "init udp cached peer");
+
+    cp = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_stream_proxy_udp_cache_peer_data_t));
+    if (cp == NULL) {
+        return NGX_ERROR;
+    }
+
+    cp->cache = pscf->udp_cache;
+    cp->session = s;
+    cp->data = u->peer.data;
+    cp->original_get_peer = u->peer.get;
+    cp->original_free_peer = u->peer.free;
+
+    u->peer.data = cp;
+    u->peer.get = ngx_stream_proxy_get_udp_cached_peer;
+    u->peer.free = ngx_stream_proxy_free_udp_cached_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_get_udp_cached_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_proxy_udp_cache_peer_data_t  *cp = data;
+
+    int                                 n;
+    char                                buf[1];
+    ngx_int_t                           rc;
+    ngx_queue_t                        *q, *cache;
+    ngx_connection_t                   *c;
+    ngx_stream_proxy_udp_cache_item_t  *item;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get udp cached peer");
+
+    pc->cached = 0;
+
+    /* ask balancer */
+
+    rc = cp->original_get_peer(pc, cp->data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    /* a socket bound to a local address is never cached */
+
+    if (pc->local) {
+        return NGX_OK;
+    }
+
+    if (cp->cache->id_len) {
+        return ngx_stream_proxy_udp_shared_join(pc, cp);
+    }
+
+    /* search cache for a connected socket to the same peer */
+
+    cache = &cp->cache->cache;
+
+    q = ngx_queue_head(cache);
+
+    while (q != ngx_queue_sentinel(cache)) {
+
+        item = ngx_queue_data(q, ngx_stream_proxy_udp_cache_item_t, queue);
+        c = item->connection;
+
+        q = ngx_queue_next(q);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
+                         item->socklen, pc->socklen)
+            != 0)
+        {
+            continue;
+        }
+
+        ngx_queue_remove(&item->queue);
+        ngx_queue_insert_head(&cp->cache->free, &item->queue);
+
+        /*
+         * a datagram which arrived after the previous session ended
+         * but is not yet reported by the event loop belongs to that
+         * session, such a socket is closed instead of being reused
+         */
+
+        n = recv(c->fd, buf, 1, MSG_PEEK);
+
+        if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+            goto found;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get udp cached peer: stale socket %d", c->fd);
+
+        ngx_close_connection(c);
+    }
+
+    return NGX_OK;
+
+found:
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get udp cached peer: using socket %d", c->fd);
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    c->idle = 0;
+    c->sent = 0;
+    c->data = NULL;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_stream_proxy_free_udp_cached_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_proxy_udp_cache_peer_data_t  *cp = data;
+
+    ngx_uint_t                          n;
+    ngx_queue_t                        *q, *last;
+    ngx_connection_t                   *c;
+    ngx_stream_proxy_udp_cache_t       *cache;
+    ngx_stream_proxy_udp_cache_item_t  *item;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free udp cached peer");
+
+    c = pc->connection;
+
+    /* a shared socket stays with its other sessions */
+
+    if (cp->cache->id_len) {
+        if (c && c->shared) {
+            ngx_stream_proxy_udp_shared_leave(cp->session);
+        }
+
+        goto invalid;
+    }
+
+    if (!(state & NGX_PEER_KEEPALIVE)
+        || (state & NGX_PEER_FAILED)
+        || c == NULL
+        || pc->local
+        || c->buffered
+        || c->read->eof
+        || c->read->error
+        || c->read->timedout
+        || c->write->error
+        || c->write->timedout)
+    {
+        goto invalid;
+    }
+
+    if (ngx_terminate || ngx_exiting) {
+        goto invalid;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        goto invalid;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free udp cached peer: saving socket %d", c->fd);
+
+    cache = cp->cache;
+
+    /* the oldest socket to the same peer goes if the peer has enough */
+
+    n = 0;
+    last = NULL;
+
+    for (q = ngx_queue_head(&cache->cache);
+         q != ngx_queue_sentinel(&cache->cache);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_stream_proxy_udp_cache_item_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
+                         item->socklen, pc->socklen)
+            == 0)
+        {
+            n++;
+            last = q;
+        }
+    }
+
+    if (n < cache->max_cached) {
+        last = NULL;
+    }
+
+    if (last == NULL && ngx_queue_empty(&cache->free)) {
+        last = ngx_queue_last(&cache->cache);
+    }
+
+    if (last) {
+        q = last;
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_stream_proxy_udp_cache_item_t, queue);
+
+        ngx_close_connection(item->connection);
+
+    } else {
+        q = ngx_queue_head(&cache->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_stream_proxy_udp_cache_item_t, queue);
+    }
+
+    ngx_queue_insert_head(&cache->cache, q);
+
+    item->connection = c;
+
+    pc->connection = NULL;
+
+    c->read->delayed = 0;
+    c->write->delayed = 0;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (c->read->posted) {
+        ngx_delete_posted_event(c->read);
+    }
+
+    if (c->write->posted) {
+        ngx_delete_posted_event(c->write);
+    }
+
+    ngx_add_timer(c->read, cache->timeout);
+
+    c->write->handler = ngx_stream_proxy_udp_cache_dummy_handler;
+    c->read->handler = ngx_stream_proxy_udp_cache_close_handler;
+
+    c->data = item;
+    c->idle = 1;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    c->pool = NULL;
+
+    item->socklen = pc->socklen;
+    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+
+    if (c->read->ready) {
+        ngx_stream_proxy_udp_cache_close_handler(c->read);
+    }
+
+invalid:
+
+    cp->original_free_peer(pc, cp->data, state);
+}
+
+
+static void
+ngx_stream_proxy_udp_cache_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "udp cache dummy handler");
+}
+
+
+static void
+ngx_stream_proxy_udp_cache_close_handler(ngx_event_t *ev)
+{
+    ngx_stream_proxy_udp_cache_t       *cache;
+    ngx_stream_proxy_udp_cache_item_t  *item;
+
+    int                n;
+    char               buf[1];
+    ngx_connection_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "udp cache close handler");
+
+    c = ev->data;
+
+    if (c->close || c->read->timedout) {
+        goto close;
+    }
+
+    /*
+     * a datagram or an error on an idle socket means a late response
+     * or an unreachable peer, so the socket cannot be reused
+     */
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    item = c->data;
+    cache = item->cache;
+
+    ngx_close_connection(c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&cache->free, &item->queue);
+}
+
+
+/*
+ * sessions to the same peer share connected sockets if requests carry
+ * an id, e.g. "0:2" for the DNS query id; each session gets a connection
+ * on the shared descriptor, and responses are dispatched to the session
+ * which sent the request with the same id
+ */
+
+static ngx_int_t
+ngx_stream_proxy_udp_shared_join(ngx_peer_connection_t *pc,
+    ngx_stream_proxy_udp_cache_peer_data_t *cp)
+{
+    u_char                              id[NGX_STREAM_PROXY_UDP_ID_MAX];
+    uint32_t                            hash;
+    ngx_buf_t                          *b;
+    ngx_uint_t                          n;
+    ngx_queue_t                        *q;
+    ngx_connection_t                   *c, *fc;
+    ngx_stream_session_t               *s;
+    ngx_stream_proxy_ctx_t             *ctx;
+    ngx_stream_proxy_udp_cache_t       *cache;
+    ngx_stream_proxy_udp_shared_t      *sh;
+    ngx_stream_proxy_udp_cache_item_t  *item, *found;
+
+    s = cp->session;
+    cache = cp->cache;
+
+    /*
+     * session connections never touch the event module, which is only
+     * possible with edge-triggered notifications
+     */
+
+    if (ngx_terminate || ngx_exiting
+        || !(ngx_event_flags & NGX_USE_CLEAR_EVENT))
+    {
+        return NGX_OK;
+    }
+
+    /* the first datagram decides which socket the session may share */
+
+    b = s->connection->buffer;
+
+    if (b == NULL
+        || (size_t) (b->last - b->pos) < cache->id_offset + cache->id_len)
+    {
+        return NGX_OK;
+    }
+
+    ctx = ngx_stream_proxy_get_ctx(s);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    sh = ngx_pcalloc(s->connection->pool,
+                     sizeof(ngx_stream_proxy_udp_shared_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_stream_proxy_udp_id_key(cache, b->pos, id);
+
+    n = 0;
+    found = NULL;
+
+    for (q = ngx_queue_head(&cache->cache);
+         q != ngx_queue_sentinel(&cache->cache);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_stream_proxy_udp_cache_item_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
+                         item->socklen, pc->socklen)
+            != 0)
+        {
+            continue;
+        }
+
+        n++;
+
+        if (item->failed
+            || ngx_stream_proxy_udp_id_lookup(&item->ids, id, hash))
+        {
+            continue;
+        }
+
+        if (found == NULL || item->nsessions < found->nsessions) {
+            found = item;
+        }
+    }
+
+    if (found == NULL) {
+
+        /* the id is in use on every socket to the peer */
+
+        if (n >= cache->max_cached || ngx_queue_empty(&cache->free)) {
+            ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                           "udp shared peer: no socket");
+            return NGX_OK;
+        }
+
+        found = ngx_stream_proxy_udp_shared_open(pc, cache);
+        if (found == NULL) {
+            return NGX_OK;
+        }
+    }
+
+    c = found->connection;
+
+    fc = ngx_get_connection(c->fd, pc->log);
+    if (fc == NULL) {
+        if (found->nsessions == 0) {
+            ngx_stream_proxy_udp_shared_close(found);
+        }
+
+        return NGX_ERROR;
+    }
+
+    fc->shared = 1;
+    fc->type = SOCK_DGRAM;
+
+    fc->recv = ngx_stream_proxy_udp_shared_recv;
+    fc->send = ngx_send;
+    fc->send_chain = ngx_udp_send_chain;
+
+    fc->sockaddr = &found->sockaddr.sockaddr;
+    fc->socklen = found->socklen;
+
+    fc->log = pc->log;
+    fc->log_error = pc->log_error;
+    fc->read->log = pc->log;
+    fc->write->log = pc->log;
+
+    fc->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    fc->start_time = ngx_current_msec;
+
+    /* the shared connection is in the event module instead */
+
+    fc->read->active = 1;
+    fc->write->active = 1;
+    fc->write->ready = 1;
+
+    sh->connection = fc;
+    sh->item = found;
+
+    ngx_queue_insert_tail(&found->sessions, &sh->queue);
+    found->nsessions++;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    c->idle = 0;
+
+    ngx_queue_remove(&found->queue);
+    ngx_queue_insert_head(&cache->cache, &found->queue);
+
+    ctx->udp_shared = sh;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "udp shared peer: socket %d, sessions %ui, connection %uA",
+                   c->fd, found->nsessions, fc->number);
+
+    pc->connection = fc;
+    pc->cached = 1;
+
+    return NGX_DONE;
+}
+
+
+static ngx_stream_proxy_udp_cache_item_t *
+ngx_stream_proxy_udp_shared_open(ngx_peer_connection_t *pc,
+    ngx_stream_proxy_udp_cache_t *cache)
+{
+    ngx_int_t                           rc;
+    ngx_queue_t                        *q;
+    ngx_connection_t                   *c;
+    ngx_peer_connection_t               peer;
+    ngx_stream_proxy_udp_cache_item_t  *item;
+
+    ngx_memzero(&peer, sizeof(ngx_peer_connection_t));
+
+    peer.sockaddr = pc->sockaddr;
+    peer.socklen = pc->socklen;
+    peer.name = pc->name;
+    peer.get = ngx_event_get_peer;
+    peer.log = ngx_cycle->log;
+    peer.log_error = NGX_ERROR_ERR;
+    peer.type = SOCK_DGRAM;
+
+    rc = ngx_event_connect_peer(&peer);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "udp shared peer: connect to %V: %i", pc->name, rc);
+
+    if (rc != NGX_OK) {
+        if (peer.connection) {
+            ngx_close_connection(peer.connection);
+        }
+
+        return NULL;
+    }
+
+    c = peer.connection;
+
+    q = ngx_queue_head(&cache->free);
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&cache->cache, q);
+
+    item = ngx_queue_data(q, ngx_stream_proxy_udp_cache_item_t, queue);
+
+    item->connection = c;
+    item->socklen = pc->socklen;
+    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+
+    ngx_rbtree_init(&item->ids, &item->sentinel,
+                    ngx_stream_proxy_udp_id_insert_value);
+    ngx_queue_init(&item->sessions);
+    item->nsessions = 0;
+    item->failed = 0;
+
+    c->data = item;
+    c->pool = NULL;
+
+    c->read->handler = ngx_stream_proxy_udp_shared_read_handler;
+    c->write->handler = ngx_stream_proxy_udp_shared_write_handler;
+
+    return item;
+}
+
+
+static void
+ngx_stream_proxy_udp_shared_leave(ngx_stream_session_t *s)
+{
+    ngx_uint_t                          i;
+    ngx_connection_t                   *c;
+    ngx_stream_proxy_ctx_t             *ctx;
+    ngx_stream_proxy_udp_shared_t      *sh;
+    ngx_stream_proxy_udp_cache_item_t  *item;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL || ctx->udp_shared == NULL) {
+        return;
+    }
+
+    sh = ctx->udp_shared;
+    ctx->udp_shared = NULL;
+
+    item = sh->item;
+    c = item->connection;
+
+    for (i = 0; i < NGX_STREAM_PROXY_UDP_IDS; i++) {
+        if (sh->ids[i].connection) {
+            ngx_rbtree_delete(&item->ids, &sh->ids[i].node);
+            sh->ids[i].connection = NULL;
+        }
+    }
+
+    ngx_queue_remove(&sh->queue);
+    item->nsessions--;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "udp shared peer: left socket %d, sessions %ui",
+                   c->fd, item->nsessions);
+
+    if (item->nsessions) {
+        return;
+    }
+
+    /*
+     * the socket is not closed here as the session may be called
+     * from its read handler
+     */
+
+    if (item->failed || ngx_terminate || ngx_exiting) {
+        c->close = 1;
+        ngx_post_event(c->read, &ngx_posted_events);
+        return;
+    }
+
+    c->idle = 1;
+    ngx_add_timer(c->read, item->cache->timeout);
+}
+
+
+static void
+ngx_stream_proxy_udp_shared_close(ngx_stream_proxy_udp_cache_item_t *item)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                   "udp shared peer: close socket %d", item->connection->fd);
+
+    ngx_close_connection(item->connection);
+    item->connection = NULL;
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&item->cache->free, &item->queue);
+}
+
+
+static void
+ngx_stream_proxy_udp_shared_read_handler(ngx_event_t *ev)
+{
+    static u_char                       buffer[65535];
+
+    u_char                              id[NGX_STREAM_PROXY_UDP_ID_MAX];
+    ssize_t                             n;
+    uint32_t                            hash;
+    ngx_buf_t                           buf;
+    ngx_err_t                           err;
+    ngx_queue_t                        *q;
+    ngx_connection_t                   *c, *fc;
+    ngx_stream_proxy_udp_id_t          *uid;
+    ngx_stream_proxy_udp_cache_t       *cache;
+    ngx_stream_proxy_udp_shared_t      *sh;
+    ngx_stream_proxy_udp_cache_item_t  *item;
+
+    c = ev->data;
+    item = c->data;
+    cache = item->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "udp shared read handler, sessions %ui", item->nsessions);
+
+    if (c->close || ev->timedout) {
+        if (item->nsessions == 0) {
+            ngx_stream_proxy_udp_shared_close(item);
+            return;
+        }
+
+        c->close = 0;
+        ev->timedout = 0;
+    }
+
+    for ( ;; ) {
+
+        n = recv(c->fd, buffer, sizeof(buffer), 0);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                ev->ready = 0;
+                return;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_connection_error(c, err, "recv() failed");
+
+            break;
+        }
+
+        if ((size_t) n < cache->id_offset + cache->id_len) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "datagram without id from upstream dropped");
+            continue;
+        }
+
+        hash = ngx_stream_proxy_udp_id_key(cache, buffer, id);
+
+        uid = ngx_stream_proxy_udp_id_lookup(&item->ids, id, hash);
+
+        if (uid == NULL) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "stray datagram from upstream dropped");
+            continue;
+        }
+
+        fc = uid->connection;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "udp shared read: %z bytes to connection %uA",
+                       n, fc->number);
+
+        ngx_memzero(&buf, sizeof(ngx_buf_t));
+
+        buf.pos = buffer;
+        buf.last = buffer + n;
+
+        ngx_stream_proxy_udp_datagram = &buf;
+        ngx_stream_proxy_udp_target = fc;
+
+        fc->read->ready = 1;
+        fc->read->handler(fc->read);
+
+        ngx_stream_proxy_udp_datagram = NULL;
+        ngx_stream_proxy_udp_target = NULL;
+    }
+
+    /* an error, e.g. an unreachable peer, is reported to every session */
+
+    item->failed = 1;
+
+    if (item->nsessions == 0) {
+        ngx_stream_proxy_udp_shared_close(item);
+        return;
+    }
+
+    for (q = ngx_queue_head(&item->sessions);
+         q != ngx_queue_sentinel(&item->sessions);
+         q = ngx_queue_next(q))
+    {
+        sh = ngx_queue_data(q, ngx_stream_proxy_udp_shared_t, queue);
+        fc = sh->connection;
+
+        fc->read->error = 1;
+        fc->read->ready = 1;
+
+        ngx_post_event(fc->read, &ngx_posted_events);
+    }
+}
+
+
+static void
+ngx_stream_proxy_udp_shared_write_handler(ngx_event_t *ev)
+{
+    ngx_queue_t                        *q;
+    ngx_connection_t                   *c, *fc;
+    ngx_stream_proxy_udp_shared_t      *sh;
+    ngx_stream_proxy_udp_cache_item_t  *item;
+
+    c = ev->data;
+    item = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "udp shared write handler");
+
+    /* wake up sessions which could not send */
+
+    for (q = ngx_queue_head(&item->sessions);
+         q != ngx_queue_sentinel(&item->sessions);
+         q = ngx_queue_next(q))
+    {
+        sh = ngx_queue_data(q, ngx_stream_proxy_udp_shared_t, queue);
+        fc = sh->connection;
+
+        if (!fc->write->ready) {
+            fc->write->ready = 1;
+            ngx_post_event(fc->write, &ngx_posted_events);
+        }
+    }
+}
+
+
+static ssize_t
+ngx_stream_proxy_udp_shared_recv(ngx_connection_t *c, u_char *buf,
+    size_t size)
+{
+    ssize_t     n;
+    ngx_buf_t  *b;
+
+    if (c->read->error) {
+        return NGX_ERROR;
+    }
+
+    b = ngx_stream_proxy_udp_datagram;
+
+    if (b == NULL || ngx_stream_proxy_udp_target != c) {
+        c->read->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    n = ngx_min(b->last - b->pos, (ssize_t) size);
+
+    ngx_memcpy(buf, b->pos, n);
+
+    ngx_stream_proxy_udp_datagram = NULL;
+
+    c->read->ready = 0;
+
+    return n;
+}
+
+
+static uint32_t
+ngx_stream_proxy_udp_id_key(ngx_stream_proxy_udp_cache_t *cache, u_char *p,
+    u_char *id)
+{
+    ngx_memzero(id, NGX_STREAM_PROXY_UDP_ID_MAX);
+    ngx_memcpy(id, p + cache->id_offset, cache->id_len);
+
+    return ngx_crc32_short(id, NGX_STREAM_PROXY_UDP_ID_MAX);
+}
+
+
+static ngx_stream_proxy_udp_id_t *
+ngx_stream_proxy_udp_id_lookup(ngx_rbtree_t *rbtree, u_char *id,
+    uint32_t hash)
+{
+    ngx_int_t                   rc;
+    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_stream_proxy_udp_id_t  *uid;
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        uid = (ngx_stream_proxy_udp_id_t *) node;
+
+        rc = ngx_memcmp(id, uid->id, NGX_STREAM_PROXY_UDP_ID_MAX);
+
+        if (rc == 0) {
+            return uid;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_stream_proxy_udp_id_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t          **p;
+    ngx_stream_proxy_udp_id_t   *uid, *uidt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            uid = (ngx_stream_proxy_udp_id_t *) node;
+            uidt = (ngx_stream_proxy_udp_id_t *) temp;
+
+            p = (ngx_memcmp(uid->id, uidt->id, NGX_STREAM_PROXY_UDP_ID_MAX)
+                 < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+/*
+ * registers the id of a request sent over a shared socket, a request
+ * with an id which is in flight from another session is dropped
+ */
+
+static ngx_int_t
+ngx_stream_proxy_udp_id(ngx_stream_session_t *s, u_char *p, size_t n)
+{
+    u_char                              id[NGX_STREAM_PROXY_UDP_ID_MAX];
+    uint32_t                            hash;
+    ngx_stream_proxy_ctx_t             *ctx;
+    ngx_stream_proxy_udp_id_t          *uid;
+    ngx_stream_proxy_udp_cache_t       *cache;
+    ngx_stream_proxy_udp_shared_t      *sh;
+    ngx_stream_proxy_udp_cache_item_t  *item;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL || ctx->udp_shared == NULL) {
+        return NGX_OK;
+    }
+
+    sh = ctx->udp_shared;
+    item = sh->item;
+    cache = item->cache;
+
+    if (n < cache->id_offset + cache->id_len) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "datagram without id dropped");
+        return NGX_DECLINED;
+    }
+
+    hash = ngx_stream_proxy_udp_id_key(cache, p, id);
+
+    uid = ngx_stream_proxy_udp_id_lookup(&item->ids, id, hash);
+
+    if (uid) {
+        if (uid->connection == sh->connection) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "datagram with id in use by another session dropped");
+        return NGX_DECLINED;
+    }
+
+    uid = &sh->ids[sh->nids++ % NGX_STREAM_PROXY_UDP_IDS];
+
+    if (uid->connection) {
+        ngx_rbtree_delete(&item->ids, &uid->node);
+    }
+
+    ngx_memcpy(uid->id, id, NGX_STREAM_PROXY_UDP_ID_MAX);
+    uid->node.key = hash;
+    uid->connection = sh->connection;
+
+    ngx_rbtree_insert(&item->ids, &uid->node);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_breaker_init_peer(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf)
+{
+    ngx_stream_upstream_t                 *u;
+    ngx_stream_proxy_breaker_peer_data_t  *bp;
+
+    u = s->upstream;
+
+    if (u->peer.get == ngx_stream_proxy_get_breaker_peer
+        || u->peer.get == ngx_stream_proxy_get_udp_cached_peer
+        || u->peer.get == ngx_stream_proxy_get_prewarm_peer)
+    {
+        return NGX_OK;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "init circuit breaker peer");
+
+    bp = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_stream_proxy_breaker_peer_data_t));
+    if (bp == NULL) {
+        return NGX_ERROR;
+    }
+
+    bp->breaker = pscf->breaker;
+    bp->data = u->peer.data;
+    bp->original_get_peer = u->peer.get;
+    bp->original_free_peer = u->peer.free;
+
+    u->peer.data = bp;
+    u->peer.get = ngx_stream_proxy_get_breaker_peer;
+    u->peer.free = ngx_stream_proxy_free_breaker_peer;
+
+#if (NGX_STREAM_SSL)
+    bp->original_set_session = u->peer.set_session;
+    bp->original_save_session = u->peer.save_session;
+
+    u->peer.set_session = ngx_stream_proxy_breaker_set_session;
+    u->peer.save_session = ngx_stream_proxy_breaker_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_get_breaker_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_proxy_breaker_peer_data_t  *bp = data;
+
+    ngx_int_t  rc;
+
+    for ( ;; ) {
+
+        rc = bp->original_get_peer(pc, bp->data);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        if (ngx_stream_proxy_breaker_allow(bp->breaker, pc) == NGX_OK) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, pc->log, 0,
+                      "upstream %V skipped, circuit breaker is open",
+                      pc->name);
+
+        /* the balancer has marked the peer as tried, ask for another one */
+
+        ngx_stream_proxy_breaker_skip(bp, pc);
+
+        pc->sockaddr = NULL;
+        pc->name = NULL;
+
+        if (pc->tries == 0) {
+            return NGX_BUSY;
+        }
+    }
+}
+
+
+/*
+ * a skipped peer was not tried, so it is released without a failure
+ * which would count against it in the balancer; yet releasing it as
+ * successful resets peer->fails in the round robin balancer, which is
+ * restored afterwards; the balancers keep the round robin data first
+ */
+
+static void
+ngx_stream_proxy_breaker_skip(ngx_stream_proxy_breaker_peer_data_t *bp,
+    ngx_peer_connection_t *pc)
+{
+    ngx_uint_t                           fails;
+    ngx_stream_upstream_rr_peer_t       *peer;
+    ngx_stream_upstream_rr_peer_data_t  *rrp;
+
+    rrp = bp->data;
+    peer = rrp->current;
+
+    ngx_stream_upstream_rr_peers_rlock(rrp->peers);
+    ngx_stream_upstream_rr_peer_lock(rrp->peers, peer);
+
+    fails = peer->fails;
+
+    ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(rrp->peers);
+
+    bp->original_free_peer(pc, bp->data, 0);
+
+    ngx_stream_upstream_rr_peers_rlock(rrp->peers);
+    ngx_stream_upstream_rr_peer_lock(rrp->peers, peer);
+
+    if (peer->fails < fails) {
+        peer->fails = fails;
+    }
+
+    ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(rrp->peers);
+}
+
+
+static void
+ngx_stream_proxy_free_breaker_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_proxy_breaker_peer_data_t  *bp = data;
+
+    /* successful connects are recorded in ngx_stream_proxy_init_upstream() */
+
+    if ((state & NGX_PEER_FAILED) && pc->sockaddr) {
+        ngx_stream_proxy_breaker_record(bp->breaker, pc, 1);
+    }
+
+    bp->original_free_peer(pc, bp->data, state);
+}
+
+
+#if (NGX_STREAM_SSL)
+
+static ngx_int_t
+ngx_stream_proxy_breaker_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_proxy_breaker_peer_data_t  *bp = data;
+
+    return bp->original_set_session(pc, bp->data);
+}
+
+
+static void
+ngx_stream_proxy_breaker_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_proxy_breaker_peer_data_t  *bp = data;
+
+    bp->original_save_session(pc, bp->data);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_stream_proxy_breaker_allow(ngx_stream_proxy_breaker_t *breaker,
+    ngx_peer_connection_t *pc)
+{
+    uint32_t                          hash;
+    ngx_int_t                         rc;
+    ngx_msec_int_t                    ms;
+    ngx_stream_proxy_breaker_node_t  *bn;
+    ngx_stream_proxy_breaker_zone_t  *zone;
+
+    zone = breaker->shm_zone->data;
+
+    hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen);
+
+    rc = NGX_OK;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    bn = ngx_stream_proxy_breaker_lookup(zone, pc, hash);
+
+    if (bn == NULL) {
+        goto done;
+    }
+
+    ms = (ngx_msec_int_t) (ngx_current_msec - bn->start);
+
+    switch (bn->state) {
+
+    case NGX_STREAM_PROXY_BREAKER_OPEN:
+
+        if (ms < (ngx_msec_int_t) breaker->open) {
+            rc = NGX_DECLINED;
+            break;
+        }
+
+        bn->state = NGX_STREAM_PROXY_BREAKER_HALF_OPEN;
+        bn->start = ngx_current_msec;
+        bn->probes = 0;
+
+        ms = 0;
+
+        /* fall through */
+
+    case NGX_STREAM_PROXY_BREAKER_HALF_OPEN:
+
+        if (bn->probes >= breaker->probes) {
+
+            if (ms < (ngx_msec_int_t) breaker->open) {
+                rc = NGX_DECLINED;
+                break;
+            }
+
+            /* the probes ended without an outcome, let more through */
+
+            bn->start = ngx_current_msec;
+            bn->probes = 0;
+        }
+
+        bn->probes++;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "circuit breaker probe %ui to %V",
+                       bn->probes, pc->name);
+
+        break;
+
+    default: /* NGX_STREAM_PROXY_BREAKER_CLOSED */
+        break;
+    }
+
+    ngx_queue_remove(&bn->queue);
+    ngx_queue_insert_head(&zone->sh->queue, &bn->queue);
+
+done:
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    return rc;
+}
+
+
+static void
+ngx_stream_proxy_breaker_record(ngx_stream_proxy_breaker_t *breaker,
+    ngx_peer_connection_t *pc, ngx_uint_t failed)
+{
+    size_t                            n;
+    uint32_t                          hash;
+    ngx_uint_t                        state;
+    ngx_rbtree_node_t                *node;
+    ngx_stream_proxy_breaker_node_t  *bn;
+    ngx_stream_proxy_breaker_zone_t  *zone;
+
+    zone = breaker->shm_zone->data;
+
+    hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen);
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    bn = ngx_stream_proxy_breaker_lookup(zone, pc, hash);
+
+    if (bn == NULL) {
+
+        ngx_stream_proxy_breaker_expire(zone, 1);
+
+        n = offsetof(ngx_rbtree_node_t, color)
+            + offsetof(ngx_stream_proxy_breaker_node_t, data)
+            + pc->socklen;
+
+        node = ngx_slab_alloc_locked(zone->shpool, n);
+
+        if (node == NULL) {
+            ngx_stream_proxy_breaker_expire(zone, 0);
+
+            node = ngx_slab_alloc_locked(zone->shpool, n);
+            if (node == NULL) {
+                ngx_shmtx_unlock(&zone->shpool->mutex);
+
+                ngx_log_error(NGX_LOG_ALERT, pc->log, 0,
+                              "could not allocate node%s",
+                              zone->shpool->log_ctx);
+                return;
+            }
+        }
+
+        node->key = hash;
+
+        bn = (ngx_stream_proxy_breaker_node_t *) &node->color;
+
+        bn->len = (u_short) pc->socklen;
+        bn->state = NGX_STREAM_PROXY_BREAKER_CLOSED;
+        bn->start = ngx_current_msec;
+        bn->requests = 0;
+        bn->failures = 0;
+        bn->probes = 0;
+        ngx_memcpy(bn->data, pc->sockaddr, pc->socklen);
+
+        ngx_rbtree_insert(&zone->sh->rbtree, node);
+
+    } else {
+        ngx_queue_remove(&bn->queue);
+    }
+
+    ngx_queue_insert_head(&zone->sh->queue, &bn->queue);
+
+    state = bn->state;
+
+    switch (bn->state) {
+
+    case NGX_STREAM_PROXY_BREAKER_CLOSED:
+
+        if ((ngx_msec_int_t) (ngx_current_msec - bn->start)
+            >= (ngx_msec_int_t) breaker->window)
+        {
+            bn->start = ngx_current_msec;
+            bn->requests = 0;
+            bn->failures = 0;
+        }
+
+        bn->requests++;
+
+        if (failed) {
+            bn->failures++;
+        }
+
+        if (bn->requests >= breaker->requests
+            && bn->failures * 100 >= bn->requests * breaker->failures)
+        {
+            bn->state = NGX_STREAM_PROXY_BREAKER_OPEN;
+            bn->start = ngx_current_msec;
+        }
+
+        break;
+
+    case NGX_STREAM_PROXY_BREAKER_HALF_OPEN:
+
+        /* a single probe decides */
+
+        bn->start = ngx_current_msec;
+        bn->probes = 0;
+
+        if (failed) {
+            bn->state = NGX_STREAM_PROXY_BREAKER_OPEN;
+
+        } else {
+            bn->state = NGX_STREAM_PROXY_BREAKER_CLOSED;
+            bn->requests = 0;
+            bn->failures = 0;
+        }
+
+        break;
+
+    default: /* NGX_STREAM_PROXY_BREAKER_OPEN */
+
+        /* outcomes of connects started before the breaker tripped */
+        break;
+    }
+
+    if (state == bn->state) {
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+        return;
+    }
+
+    state = bn->state;
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    if (state == NGX_STREAM_PROXY_BREAKER_OPEN) {
+        ngx_log_error(NGX_LOG_WARN, pc->log, 0,
+                      "circuit breaker for upstream %V is open", pc->name);
+
+    } else {
+        ngx_log_error(NGX_LOG_NOTICE, pc->log, 0,
+                      "circuit breaker for upstream %V is closed", pc->name);
+    }
+}
+
+
+static ngx_stream_proxy_breaker_node_t *
+ngx_stream_proxy_breaker_lookup(ngx_stream_proxy_breaker_zone_t *zone,
+    ngx_peer_connection_t *pc, uint32_t hash)
+{
+    ngx_int_t                         rc;
+    ngx_rbtree_node_t                *node, *sentinel;
+    ngx_stream_proxy_breaker_node_t  *bn;
+
+    node = zone->sh->rbtree.root;
+    sentinel = zone->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        bn = (ngx_stream_proxy_breaker_node_t *) &node->color;
+
+        rc = ngx_memn2cmp((u_char *) pc->sockaddr, bn->data, pc->socklen,
+                          (size_t) bn->len);
+
+        if (rc == 0) {
+            return bn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_stream_proxy_breaker_expire(ngx_stream_proxy_breaker_zone_t *zone,
+    ngx_uint_t n)
+{
+    ngx_queue_t                      *q;
+    ngx_rbtree_node_t                *node;
+    ngx_stream_proxy_breaker_node_t  *bn;
+
+    /*
+     * n == 1 deletes one or two closed entries without failures
+     * n == 0 deletes oldest entry by force
+     *        and one or two closed entries without failures
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&zone->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&zone->sh->queue);
+
+        bn = ngx_queue_data(q, ngx_stream_proxy_breaker_node_t, queue);
+
+        if (n++ != 0
+            && (bn->state != NGX_STREAM_PROXY_BREAKER_CLOSED || bn->failures))
+        {
+            return;
+        }
+
+        ngx_queue_remove(q);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) bn - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_rbtree_delete(&zone->sh->rbtree, node);
+
+        ngx_slab_free_locked(zone->shpool, node);
+    }
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_prewarm_init_peer(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf)
+{
+    ngx_stream_upstream_t                 *u;
+    ngx_stream_proxy_prewarm_peer_data_t  *wp;
+
+    u = s->upstream;
+
+    if (u->peer.get == ngx_stream_proxy_get_prewarm_peer
+        || u->peer.notify)
+    {
+        return NGX_OK;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "init prewarm peer");
+
+    wp = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_stream_proxy_prewarm_peer_data_t));
+    if (wp == NULL) {
+        return NGX_ERROR;
+    }
+
+    wp->prewarm = pscf->prewarm_pool;
+    wp->data = u->peer.data;
+    wp->original_get_peer = u->peer.get;
+    wp->original_free_peer = u->peer.free;
+
+    u->peer.data = wp;
+    u->peer.get = ngx_stream_proxy_get_prewarm_peer;
+    u->peer.free = ngx_stream_proxy_free_prewarm_peer;
+
+#if (NGX_STREAM_SSL)
+    wp->original_set_session = u->peer.set_session;
+    wp->original_save_session = u->peer.save_session;
+
+    u->peer.set_session = ngx_stream_proxy_prewarm_set_session;
+    u->peer.save_session = ngx_stream_proxy_prewarm_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_get_prewarm_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_proxy_prewarm_peer_data_t  *wp = data;
+
+    ngx_int_t                         rc;
+    ngx_queue_t                      *q, *idle;
+    ngx_connection_t                 *c;
+    ngx_stream_proxy_prewarm_item_t  *item;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get prewarm peer");
+
+    pc->cached = 0;
+
+    rc = wp->original_get_peer(pc, wp->data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    /* search for a warm connection to the peer chosen by balancer */
+
+    idle = &wp->prewarm->idle;
+
+    for (q = ngx_queue_head(idle);
+         q != ngx_queue_sentinel(idle);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_stream_proxy_prewarm_item_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
+                         item->socklen, pc->socklen)
+            == 0)
+        {
+            ngx_queue_remove(q);
+            ngx_queue_insert_head(&wp->prewarm->free, q);
+
+            goto found;
+        }
+    }
+
+    return NGX_OK;
+
+found:
+
+    c = item->peer.connection;
+    item->peer.connection = NULL;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get prewarm peer: using connection %p", c);
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    c->idle = 0;
+    c->data = NULL;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_stream_proxy_free_prewarm_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_proxy_prewarm_peer_data_t  *wp = data;
+
+    /* a warm connection is used once, it is not returned to the pool */
+
+    wp->original_free_peer(pc, wp->data, state);
+}
+
+
+#if (NGX_STREAM_SSL)
+
+static ngx_int_t
+ngx_stream_proxy_prewarm_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_proxy_prewarm_peer_data_t  *wp = data;
+
+    return wp->original_set_session(pc, wp->data);
+}
+
+
+static void
+ngx_stream_proxy_prewarm_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_proxy_prewarm_peer_data_t  *wp = data;
+
+    wp->original_save_session(pc, wp->data);
+}
+
+#endif
+
+
+static void
+ngx_stream_proxy_prewarm_handler(ngx_event_t *ev)
+{
+    ngx_stream_proxy_prewarm_t  *pw;
+
+    pw = ev->data;
+
+    if (ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    ngx_stream_proxy_prewarm_connect(pw);
+
+    ngx_add_timer(ev, 1000 / pw->conf->prewarm_rate);
+}
+
+
+static void
+ngx_stream_proxy_prewarm_connect(ngx_stream_proxy_prewarm_t *pw)
+{
+    ngx_int_t                         rc;
+    ngx_str_t                        *name;
+    ngx_uint_t                        n;
+    socklen_t                         socklen;
+    ngx_queue_t                      *q;
+    ngx_sockaddr_t                    sockaddr;
+    ngx_connection_t                 *c;
+    ngx_stream_proxy_srv_conf_t      *pscf;
+    ngx_stream_upstream_rr_peer_t    *peer;
+    ngx_stream_upstream_rr_peers_t   *peers;
+    ngx_stream_proxy_prewarm_item_t  *item;
+
+    if (ngx_queue_empty(&pw->free)) {
+        return;
+    }
+
+    pscf = pw->conf;
+    peers = pscf->upstream->peer.data;
+
+    name = NULL;
+    socklen = 0;
+
+    ngx_stream_upstream_rr_peers_rlock(peers);
+
+    /* find the first usable peer which lacks warm connections */
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (peer->down || peer->socklen > sizeof(ngx_sockaddr_t)) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && ngx_time() - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        n = 0;
+
+        for (q = ngx_queue_head(&pw->idle);
+             q != ngx_queue_sentinel(&pw->idle);
+             q = ngx_queue_next(q))
+        {
+            item = ngx_queue_data(q, ngx_stream_proxy_prewarm_item_t, queue);
+
+            if (ngx_memn2cmp((u_char *) &item->sockaddr,
+                             (u_char *) peer->sockaddr,
+                             item->socklen, peer->socklen)
+                == 0)
+            {
+                n++;
+            }
+        }
+
+        for (q = ngx_queue_head(&pw->connecting);
+             q != ngx_queue_sentinel(&pw->connecting);
+             q = ngx_queue_next(q))
+        {
+            item = ngx_queue_data(q, ngx_stream_proxy_prewarm_item_t, queue);
+
+            if (ngx_memn2cmp((u_char *) &item->sockaddr,
+                             (u_char *) peer->sockaddr,
+                             item->socklen, peer->socklen)
+                == 0)
+            {
+                n++;
+            }
+        }
+
+        if (n < pscf->prewarm) {
+            ngx_memcpy(&sockaddr, peer->sockaddr, peer->socklen);
+            socklen = peer->socklen;
+            name = &peer->name;
+            break;
+        }
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    if (name == NULL) {
+        return;
+    }
+
+    q = ngx_queue_head(&pw->free);
+    item = ngx_queue_data(q, ngx_stream_proxy_prewarm_item_t, queue);
+
+    ngx_memcpy(&item->sockaddr, &sockaddr, socklen);
+    item->socklen = socklen;
+
+    ngx_memzero(&item->peer, sizeof(ngx_peer_connection_t));
+
+    item->peer.sockaddr = &item->sockaddr.sockaddr;
+    item->peer.socklen = socklen;
+    item->peer.name = name;
+    item->peer.get = ngx_event_get_peer;
+    item->peer.log = ngx_cycle->log;
+    item->peer.log_error = NGX_ERROR_ERR;
+    item->peer.type = SOCK_STREAM;
+
+    /* pools are only created for a static proxy_bind */
+
+    if (pscf->local) {
+        item->peer.local = ngx_stream_proxy_next_local(pscf->local);
+#if (NGX_HAVE_TRANSPARENT_PROXY)
+        item->peer.transparent = pscf->local->transparent;
+#endif
+    }
+
+    if (pscf->socket_keepalive) {
+        item->peer.so_keepalive = 1;
+    }
+
+    rc = ngx_event_connect_peer(&item->peer);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                   "prewarm connect to %V: %i", name, rc);
+
+    if (rc != NGX_OK && rc != NGX_AGAIN) {
+        if (item->peer.connection) {
+            ngx_close_connection(item->peer.connection);
+            item->peer.connection = NULL;
+        }
+
+        return;
+    }
+
+    ngx_queue_remove(q);
+
+    c = item->peer.connection;
+
+    c->data = item;
+    c->pool = NULL;
+
+    if (rc == NGX_AGAIN) {
+        c->read->handler = ngx_stream_proxy_prewarm_connect_handler;
+        c->write->handler = ngx_stream_proxy_prewarm_connect_handler;
+
+        ngx_add_timer(c->write, pscf->connect_timeout);
+
+        ngx_queue_insert_head(&pw->connecting, q);
+
+        return;
+    }
+
+    ngx_stream_proxy_prewarm_ready(item);
+}
+
+
+static void
+ngx_stream_proxy_prewarm_connect_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                 *c;
+    ngx_stream_proxy_prewarm_item_t  *item;
+
+    c = ev->data;
+    item = c->data;
+
+    ngx_queue_remove(&item->queue);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "prewarm connect to %V timed out", item->peer.name);
+        ngx_stream_proxy_prewarm_close(item);
+        return;
+    }
+
+    if (ngx_stream_proxy_test_connect(c) != NGX_OK) {
+        ngx_stream_proxy_prewarm_close(item);
+        return;
+    }
+
+    ngx_stream_proxy_prewarm_ready(item);
+}
+
+
+static void
+ngx_stream_proxy_prewarm_ready(ngx_stream_proxy_prewarm_item_t *item)
+{
+    ngx_connection_t  *c;
+
+    c = item->peer.connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "prewarm connection to %V ready", item->peer.name);
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->write->handler = ngx_stream_proxy_prewarm_dummy_handler;
+    c->read->handler = ngx_stream_proxy_prewarm_close_handler;
+
+    c->idle = 1;
+
+    ngx_add_timer(c->read, item->prewarm->conf->prewarm_timeout);
+
+    ngx_queue_insert_head(&item->prewarm->idle, &item->queue);
+
+    if (c->read->ready) {
+        ngx_stream_proxy_prewarm_close_handler(c->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_queue_remove(&item->queue);
+        ngx_stream_proxy_prewarm_close(item);
+    }
+}
+
+
+static void
+ngx_stream_proxy_prewarm_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "prewarm dummy handler");
+}
+
+
+static void
+ngx_stream_proxy_prewarm_close_handler(ngx_event_t *ev)
+{
+    int                               n;
+    char                              buf[1];
+    ngx_connection_t                 *c;
+    ngx_stream_proxy_prewarm_item_t  *item;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "prewarm close handler");
+
+    c = ev->data;
+
+    if (c->close || c->read->timedout) {
+        goto close;
+    }
+
+    /*
+     * the liveness check: the peer is expected to stay silent until
+     * it gets the PROXY protocol header, anything else means that
+     * the connection was closed or is unusable
+     */
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    item = c->data;
+
+    ngx_queue_remove(&item->queue);
+    ngx_stream_proxy_prewarm_close(item);
+}
+
+
+static void
+ngx_stream_proxy_prewarm_close(ngx_stream_proxy_prewarm_item_t *item)
+{
+    ngx_close_connection(item->peer.connection);
+    item->peer.connection = NULL;
+
+    ngx_queue_insert_head(&item->prewarm->free, &item->queue);
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_health_init(ngx_cycle_t *cycle, ngx_stream_proxy_health_t *hc)
+{
+    u_char                          *p, *buf;
+    ngx_uint_t                       i, n;
+    ngx_stream_proxy_srv_conf_t     *pscf;
+    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_stream_upstream_rr_peers_t  *peers, *set;
+
+    pscf = hc->conf;
+    peers = pscf->upstream->peer.data;
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (peers->shpool && ngx_worker != 0) {
+        /* the peers are shared, the first worker checks them */
+        return NGX_OK;
+    }
+#endif
+
+    ngx_stream_upstream_rr_peers_rlock(peers);
+
+    n = peers->number;
+
+    if (peers->next) {
+        n += peers->next->number;
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    /* the request, the peers and a response buffer for each peer */
+
+    buf = ngx_alloc(NGX_PROXY_PROTOCOL_V2_LOCAL_HEADER + hc->send.len
+                    + n * (sizeof(ngx_stream_proxy_health_peer_t)
+                           + hc->expect.len),
+                    cycle->log);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    hc->peers = (ngx_stream_proxy_health_peer_t *) buf;
+    hc->npeers = n;
+
+    p = buf + n * sizeof(ngx_stream_proxy_health_peer_t);
+
+    hc->request.data = p;
+
+    /*
+     * a backend which requires the PROXY protocol header gets one,
+     * with the LOCAL command in version 2 and UNKNOWN in version 1,
+     * so that the check is not logged as a client connection
+     */
+
+    if (pscf->proxy_protocol) {
+        if (pscf->proxy_protocol_version == 2) {
+            p = ngx_proxy_protocol_v2_write_local(p,
+                                      p + NGX_PROXY_PROTOCOL_V2_LOCAL_HEADER);
+
+        } else {
+            p = ngx_cpymem(p, "PROXY UNKNOWN" CRLF,
+                           sizeof("PROXY UNKNOWN" CRLF) - 1);
+        }
+    }
+
+    p = ngx_cpymem(p, hc->send.data, hc->send.len);
+
+    hc->request.len = p - hc->request.data;
+
+    i = 0;
+
+    ngx_stream_upstream_rr_peers_rlock(peers);
+
+    for (set = peers; set; set = set->next) {
+        for (peer = set->peer; peer && i < n; peer = peer->next, i++) {
+            ngx_memzero(&hc->peers[i], sizeof(ngx_stream_proxy_health_peer_t));
+
+            hc->peers[i].health = hc;
+            hc->peers[i].peers = set;
+            hc->peers[i].peer = peer;
+            hc->peers[i].buf = p;
+
+            p += hc->expect.len;
+        }
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    hc->npeers = i;
+
+    hc->event.handler = ngx_stream_proxy_health_handler;
+    hc->event.data = hc;
+    hc->event.log = cycle->log;
+    hc->event.cancelable = 1;
+
+    ngx_add_timer(&hc->event, 1);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_proxy_health_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                  i;
+    ngx_stream_proxy_health_t  *hc;
+
+    hc = ev->data;
+
+    if (ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    for (i = 0; i < hc->npeers; i++) {
+
+        /* a check still in progress is not restarted */
+
+        if (hc->peers[i].pc.connection == NULL) {
+            ngx_stream_proxy_health_check(&hc->peers[i]);
+        }
+    }
+
+    ngx_add_timer(ev, hc->interval);
+}
+
+
+static void
+ngx_stream_proxy_health_check(ngx_stream_proxy_health_peer_t *hp)
+{
+    ngx_int_t                       rc;
+    ngx_uint_t                      down;
+    ngx_connection_t               *c;
+    ngx_stream_proxy_health_t      *hc;
+    ngx_stream_upstream_rr_peer_t  *peer;
+
+    hc = hp->health;
+    peer = hp->peer;
+
+    ngx_stream_upstream_rr_peers_rlock(hp->peers);
+    ngx_stream_upstream_rr_peer_lock(hp->peers, peer);
+
+    down = peer->down;
+
+    ngx_stream_upstream_rr_peer_unlock(hp->peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(hp->peers);
+
+    /* a peer marked down in the configuration is left alone */
+
+    if (down && !hp->down) {
+        return;
+    }
+
+    ngx_memzero(&hp->pc, sizeof(ngx_peer_connection_t));
+
+    hp->pc.sockaddr = peer->sockaddr;
+    hp->pc.socklen = peer->socklen;
+    hp->pc.name = &peer->name;
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = ngx_cycle->log;
+    hp->pc.log_error = NGX_ERROR_ERR;
+    hp->pc.type = SOCK_STREAM;
+
+    if (hc->conf->local && hc->conf->local->value == NULL) {
+        hp->pc.local = ngx_stream_proxy_next_local(hc->conf->local);
+#if (NGX_HAVE_TRANSPARENT_PROXY)
+        hp->pc.transparent = hc->conf->local->transparent;
+#endif
+    }
+
+    hp->sent = 0;
+    hp->received = 0;
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                   "health check connect to %V: %i", hp->pc.name, rc);
+
+    if (rc != NGX_OK && rc != NGX_AGAIN) {
+        ngx_stream_proxy_health_done(hp, 0);
+        return;
+    }
+
+    c = hp->pc.connection;
+
+    c->data = hp;
+    c->pool = NULL;
+
+    c->write->handler = ngx_stream_proxy_health_write_handler;
+    c->read->handler = ngx_stream_proxy_health_read_handler;
+
+    /* the timer covers the whole check */
+
+    ngx_add_timer(c->read, hc->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_stream_proxy_health_write_handler(c->write);
+    }
+}
+
+
+static void
+ngx_stream_proxy_health_write_handler(ngx_event_t *ev)
+{
+    ssize_t                          n;
+    ngx_connection_t                *c;
+    ngx_stream_proxy_health_t       *hc;
+    ngx_stream_proxy_health_peer_t  *hp;
+
+    c = ev->data;
+    hp = c->data;
+    hc = hp->health;
+
+    if (hp->sent == 0 && ngx_stream_proxy_test_connect(c) != NGX_OK) {
+        ngx_stream_proxy_health_done(hp, 0);
+        return;
+    }
+
+    while (hp->sent < hc->request.len) {
+
+        n = c->send(c, hc->request.data + hp->sent,
+                    hc->request.len - hp->sent);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(ev, 0) != NGX_OK) {
+                ngx_stream_proxy_health_done(hp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_stream_proxy_health_done(hp, 0);
+            return;
+        }
+
+        hp->sent += n;
+    }
+
+    if (hc->expect.len == 0) {
+        ngx_stream_proxy_health_done(hp, 1);
+        return;
+    }
+
+    /* the request is sent, an empty request still counts as connected */
+
+    if (hp->sent == 0) {
+        hp->sent = 1;
+    }
+
+    ev->handler = ngx_stream_proxy_health_dummy_handler;
+
+    if (c->read->ready) {
+        ngx_stream_proxy_health_read_handler(c->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_stream_proxy_health_done(hp, 0);
+    }
+}
+
+
+static void
+ngx_stream_proxy_health_read_handler(ngx_event_t *ev)
+{
+    ssize_t                          n;
+    ngx_connection_t                *c;
+    ngx_stream_proxy_health_t       *hc;
+    ngx_stream_proxy_health_peer_t  *hp;
+
+    c = ev->data;
+    hp = c->data;
+    hc = hp->health;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", hp->pc.name);
+        ngx_stream_proxy_health_done(hp, 0);
+        return;
+    }
+
+    if (hp->sent == 0) {
+
+        /* the connect is not complete yet */
+
+        if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+            ngx_stream_proxy_health_done(hp, 0);
+        }
+
+        return;
+    }
+
+    while (hp->received < hc->expect.len) {
+
+        n = c->recv(c, hp->buf + hp->received,
+                    hc->expect.len - hp->received);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+                ngx_stream_proxy_health_done(hp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_stream_proxy_health_done(hp, 0);
+            return;
+        }
+
+        if (ngx_memcmp(hp->buf + hp->received,
+                       hc->expect.data + hp->received, n)
+            != 0)
+        {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "health check of %V: unexpected response",
+                          hp->pc.name);
+            ngx_stream_proxy_health_done(hp, 0);
+            return;
+        }
+
+        hp->received += n;
+    }
+
+    ngx_stream_proxy_health_done(hp, 1);
+}
+
+
+static void
+ngx_stream_proxy_health_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "health check dummy handler");
+}
+
+
+static void
+ngx_stream_proxy_health_done(ngx_stream_proxy_health_peer_t *hp,
+    ngx_uint_t ok)
+{
+    ngx_uint_t                      down;
+    ngx_stream_proxy_health_t      *hc;
+    ngx_stream_upstream_rr_peer_t  *peer;
+
+    hc = hp->health;
+    peer = hp->peer;
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+        hp->pc.connection = NULL;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                   "health check of %V: %ui", hp->pc.name, ok);
+
+    if (ok) {
+        hp->fails = 0;
+        hp->passes++;
+
+        if (!hp->down || hp->passes < hc->passes) {
+            return;
+        }
+
+        down = 0;
+
+    } else {
+        hp->passes = 0;
+        hp->fails++;
+
+        if (hp->down || hp->fails < hc->fails) {
+            return;
+        }
+
+        down = 1;
+    }
+
+    ngx_stream_upstream_rr_peers_rlock(hp->peers);
+    ngx_stream_upstream_rr_peer_lock(hp->peers, peer);
+
+    if (down && peer->down) {
+
+        /* marked down by someone else meanwhile */
+
+        ngx_stream_upstream_rr_peer_unlock(hp->peers, peer);
+        ngx_stream_upstream_rr_peers_unlock(hp->peers);
+        return;
+    }
+
+    peer->down = down;
+
+    ngx_stream_upstream_rr_peer_unlock(hp->peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(hp->peers);
+
+    hp->down = down;
+
+    if (down) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "upstream %V failed %ui health checks, marked down",
+                      &peer->name, hp->fails);
+
+    } else {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "upstream %V passed %ui health checks, marked up",
+                      &peer->name, hp->passes);
+    }
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i, j, n;
+    ngx_stream_proxy_health_t       **hcp;
+    ngx_stream_proxy_prewarm_t      **pwp, *pw;
+    ngx_stream_upstream_rr_peers_t   *peers;
+    ngx_stream_proxy_main_conf_t     *pmcf;
+    ngx_stream_proxy_prewarm_item_t  *items;
+
+    pmcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_proxy_module);
+    if (pmcf == NULL) {
+        return NGX_OK;
+    }
+
+    pwp = pmcf->prewarm.elts;
+
+    for (i = 0; i < pmcf->prewarm.nelts; i++) {
+        pw = pwp[i];
+
+        peers = pw->conf->upstream->peer.data;
+
+        ngx_stream_upstream_rr_peers_rlock(peers);
+        n = peers->number * pw->conf->prewarm;
+        ngx_stream_upstream_rr_peers_unlock(peers);
+
+        if (n == 0) {
+            continue;
+        }
+
+        items = ngx_alloc(n * sizeof(ngx_stream_proxy_prewarm_item_t),
+                          cycle->log);
+        if (items == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_queue_init(&pw->idle);
+        ngx_queue_init(&pw->connecting);
+        ngx_queue_init(&pw->free);
+
+        for (j = 0; j < n; j++) {
+            items[j].prewarm = pw;
+            items[j].peer.connection = NULL;
+            ngx_queue_insert_tail(&pw->free, &items[j].queue);
+        }
+
+        pw->event.handler = ngx_stream_proxy_prewarm_handler;
+        pw->event.data = pw;
+        pw->event.log = cycle->log;
+        pw->event.cancelable = 1;
+
+        ngx_add_timer(&pw->event, 1);
+    }
+
+
+    hcp = pmcf->health_checks.elts;
+
+    for (i = 0; i < pmcf->health_checks.nelts; i++) {
+        if (ngx_stream_proxy_health_init(cycle, hcp[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                 *p;
+    ngx_connection_t       *pc;
+    ngx_stream_session_t   *s;
+    ngx_stream_upstream_t  *u;
+
+    s = log->data;
+
+    u = s->upstream;
+
+    p = buf;
+
+    if (u->peer.name) {
+        p = ngx_snprintf(p, len, ", upstream: \"%V\"", u->peer.name);
+        len -= p - buf;
+    }
+
+    pc = u->peer.connection;
+
+    p = ngx_snprintf(p, len,
+                     ", bytes from/to client:%O/%O"
+                     ", bytes from/to upstream:%O/%O",
+                     s->received, s->connection->sent,
+                     u->received, pc ? pc->sent : 0);
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_budget_yields_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    u_char                        *p;
+    ngx_uint_t                     n;
+    ngx_stream_proxy_main_conf_t  *pmcf;
+
+    if (data) {
+
+        /* yields of all sessions of this worker so far */
+
+        pmcf = ngx_stream_get_module_main_conf(s, ngx_stream_proxy_module);
+        n = pmcf->budget_yields;
+
+    } else {
+
+        if (s->upstream == NULL) {
+            v->not_found = 1;
+            return NGX_OK;
+        }
+
+        n = s->upstream->budget_yields;
+    }
+
+    p = ngx_pnalloc(s->connection->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", n) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_pass_cache_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    if (s->upstream == NULL || s->upstream->pass_cache == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    if (s->upstream->pass_cache == NGX_STREAM_PROXY_PASS_CACHE_HIT) {
+        v->len = sizeof("HIT") - 1;
+        v->data = (u_char *) "HIT";
+
+    } else {
+        v->len = sizeof("MISS") - 1;
+        v->data = (u_char *) "MISS";
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_qos_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    u_char                        *p;
+    ngx_stream_proxy_ctx_t        *ctx;
+    ngx_stream_proxy_qos_class_t  *cls;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL || ctx->qos_class == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    cls = ctx->qos_class;
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    if (data == NGX_STREAM_PROXY_QOS_CLASS) {
+        v->len = cls->name.len;
+        v->data = cls->name.data;
+
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(s->connection->pool, NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    switch (data) {
+
+    case NGX_STREAM_PROXY_QOS_WAIT:
+        v->len = ngx_sprintf(p, "%M", ctx->qos_wait) - p;
+        break;
+
+    case NGX_STREAM_PROXY_QOS_CLASS_BYTES:
+        v->len = ngx_sprintf(p, "%O", cls->bytes) - p;
+        break;
+
+    default: /* NGX_STREAM_PROXY_QOS_CLASS_WAIT */
+        v->len = ngx_sprintf(p, "%M", cls->wait) - p;
+        break;
+    }
+
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_add_variables(ngx_conf_t *cf)
+{
+    ngx_stream_variable_t  *var, *v;
+
+    for (v = ngx_stream_proxy_vars; v->name.len; v++) {
+        var = ngx_stream_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_init(ngx_conf_t *cf)
+{
+    u_char                           *p;
+    size_t                            len, bucket;
+    ngx_str_t                         key;
+    ngx_int_t                         rc;
+    ngx_uint_t                        i;
+    ngx_hash_init_t                   hash;
+    ngx_hash_keys_arrays_t            ha;
+    ngx_stream_proxy_main_conf_t     *pmcf;
+    ngx_stream_upstream_srv_conf_t  **uscfp;
+    ngx_stream_upstream_main_conf_t  *umcf;
+
+    pmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_proxy_module);
+    umcf = ngx_stream_conf_get_module_main_conf(cf,
+                                                ngx_stream_upstream_module);
+
+    if (umcf->upstreams.nelts == 0) {
+        return NGX_OK;
+    }
+
+    ha.temp_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cf->log);
+    if (ha.temp_pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    ha.pool = cf->pool;
+
+    if (ngx_hash_keys_array_init(&ha, NGX_HASH_LARGE) != NGX_OK) {
+        goto failed;
+    }
+
+    bucket = 64;
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->host.len >= NGX_MAXHOSTNAMELEN) {
+            continue;
+        }
+
+        p = ngx_pnalloc(cf->pool, uscfp[i]->host.len + sizeof(":65535") - 1);
+        if (p == NULL) {
+            goto failed;
+        }
+
+        key.data = p;
+        key.len = ngx_sprintf(p, "%V:%d", &uscfp[i]->host,
+                              (int) uscfp[i]->port)
+                  - p;
+
+        /* the first matching block wins, as with the linear search */
+
+        rc = ngx_hash_add_key(&ha, &key, uscfp[i], 0);
+
+        if (rc == NGX_ERROR) {
+            goto failed;
+        }
+
+        len = ngx_align(key.len + 2, sizeof(void *)) + 2 * sizeof(void *);
+
+        if (len > bucket) {
+            bucket = len;
+        }
+    }
+
+    hash.hash = &pmcf->upstreams;
+    hash.key = ngx_hash_key_lc;
+    hash.max_size = ngx_max(512, 4 * ha.keys.nelts);
+    hash.bucket_size = ngx_align(bucket, ngx_cacheline_size);
+    hash.name = "proxy_upstreams_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+
+    if (ngx_hash_init(&hash, ha.keys.elts, ha.keys.nelts) != NGX_OK) {
+        goto failed;
+    }
+
+    ngx_destroy_pool(ha.temp_pool);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_destroy_pool(ha.temp_pool);
+
+    return NGX_ERROR;
+}
+
+
+static void *
+ngx_stream_proxy_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_proxy_main_conf_t  *pmcf;
+
+    pmcf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_proxy_main_conf_t));
+    if (pmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&pmcf->qos_classes, cf->pool, 4,
+                       sizeof(ngx_stream_proxy_qos_class_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&pmcf->prewarm, cf->pool, 4,
+                       sizeof(ngx_stream_proxy_prewarm_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&pmcf->health_checks, cf->pool, 4,
+                       sizeof(ngx_stream_proxy_health_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return pmcf;
+}
+
+
+static char *
+ngx_stream_proxy_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_stream_proxy_main_conf_t *pmcf = conf;
+
+    ngx_uint_t                     i;
+    ngx_stream_proxy_qos_class_t  *cls;
+
+    /* the array does not grow any more, so queues may be set up */
+
+    cls = pmcf->qos_classes.elts;
+
+    for (i = 0; i < pmcf->qos_classes.nelts; i++) {
+        ngx_queue_init(&cls[i].queue);
+    }
+
+    pmcf->qos_event.handler = ngx_stream_proxy_qos_handler;
+    pmcf->qos_event.data = pmcf;
+    pmcf->qos_event.log = &cf->cycle->new_log;
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_proxy_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_proxy_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->ssl_protocols = 0;
+     *     conf->ssl_ciphers = { 0, NULL };
+     *     conf->ssl_trusted_certificate = { 0, NULL };
+     *     conf->ssl_crl = { 0, NULL };
+     *
+     *     conf->ssl = NULL;
+     *     conf->udp_cache = NULL;
+     *     conf->prewarm_pool = NULL;
+     *     conf->health = NULL;
+     *     conf->hedge = NULL;
+     *     conf->proxy_protocol_trusted_tree = NULL;
+     *     conf->pass_cache = NULL;
+     *     conf->resolve_cache = NULL;
+     *     conf->upstream = NULL;
+     *     conf->upstream_value = NULL;
+     */
+
+    conf->connect_timeout = NGX_CONF_UNSET_MSEC;
+    conf->connect_stagger = NGX_CONF_UNSET_MSEC;
+    conf->connect_hedge = NGX_CONF_UNSET_UINT;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->next_upstream_timeout = NGX_CONF_UNSET_MSEC;
+    conf->buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->read_budget = NGX_CONF_UNSET_SIZE;
+    conf->read_budget_iterations = NGX_CONF_UNSET_UINT;
+    conf->coalesce = NGX_CONF_UNSET_SIZE;
+    conf->coalesce_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upload_rate = NGX_CONF_UNSET_PTR;
+    conf->download_rate = NGX_CONF_UNSET_PTR;
+    conf->qos = NGX_CONF_UNSET_PTR;
+    conf->rate_burst = NGX_CONF_UNSET_SIZE;
+    conf->rate_zone = NGX_CONF_UNSET_PTR;
+    conf->breaker = NGX_CONF_UNSET_PTR;
+    conf->requests = NGX_CONF_UNSET_UINT;
+    conf->responses = NGX_CONF_UNSET_UINT;
+    conf->next_upstream_tries = NGX_CONF_UNSET_UINT;
+    conf->next_upstream = NGX_CONF_UNSET;
+    conf->proxy_protocol = NGX_CONF_UNSET;
+    conf->local = NGX_CONF_UNSET_PTR;
+    conf->socket_keepalive = NGX_CONF_UNSET;
+    conf->half_close = NGX_CONF_UNSET;
+    conf->udp_batch = NGX_CONF_UNSET_UINT;
+    conf->udp_gso = NGX_CONF_UNSET;
+    conf->udp_gro = NGX_CONF_UNSET;
+    conf->udp_socket_cache = NGX_CONF_UNSET_UINT;
+    conf->pass_cache_size = NGX_CONF_UNSET_UINT;
+    conf->resolve_cache_size = NGX_CONF_UNSET_UINT;
+    conf->udp_socket_cache_timeout = NGX_CONF_UNSET_MSEC;
+    conf->udp_id_len = NGX_CONF_UNSET_UINT;
+    conf->prewarm = NGX_CONF_UNSET_UINT;
+    conf->prewarm_timeout = NGX_CONF_UNSET_MSEC;
+    conf->prewarm_rate = NGX_CONF_UNSET_UINT;
+    conf->proxy_protocol_version = NGX_CONF_UNSET;
+    conf->proxy_protocol_trusted = NGX_CONF_UNSET_PTR;
+
+#if (NGX_STREAM_SSL)
+    conf->ssl_enable = NGX_CONF_UNSET;
+    conf->ssl_session_reuse = NGX_CONF_UNSET;
+    conf->ssl_name = NGX_CONF_UNSET_PTR;
+    conf->ssl_server_name = NGX_CONF_UNSET;
+    conf->ssl_verify = NGX_CONF_UNSET;
+    conf->ssl_verify_depth = NGX_CONF_UNSET_UINT;
+    conf->ssl_certificate = NGX_CONF_UNSET_PTR;
+    conf->ssl_certificate_key = NGX_CONF_UNSET_PTR;
+    conf->ssl_passwords = NGX_CONF_UNSET_PTR;
+    conf->ssl_certificate_cache = NGX_CONF_UNSET_PTR;
+    conf->ssl_conf_commands = NGX_CONF_UNSET_PTR;
+    conf->ssl_ktls = NGX_CONF_UNSET;
+#endif
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_stream_proxy_srv_conf_t *prev = parent;
+    ngx_stream_proxy_srv_conf_t *conf = child;
+
+    ngx_uint_t                          i, n;
+    ngx_stream_proxy_prewarm_t         *pw, **pwp;
+    ngx_stream_proxy_health_t         **hcp;
+    ngx_stream_proxy_main_conf_t       *pmcf;
+    ngx_stream_proxy_pass_cache_t      *pass;
+    ngx_stream_upstream_server_t       *us;
+    ngx_stream_proxy_resolve_cache_t   *resolve;
+    ngx_stream_proxy_udp_cache_t       *cache;
+    ngx_stream_proxy_udp_cache_item_t  *item;
+
+    ngx_conf_merge_msec_value(conf->connect_timeout,
+                              prev->connect_timeout, 60000);
+
+    ngx_conf_merge_msec_value(conf->connect_stagger,
+                              prev->connect_stagger, 0);
+
+    ngx_conf_merge_uint_value(conf->connect_hedge, prev->connect_hedge, 0);
+
+    /*
+     * racing attempts share the balancer data, which is only possible
+     * with the round robin balancer, see ngx_stream_proxy_race_data()
+     */
+
+    if ((conf->connect_stagger || conf->connect_hedge)
+        && conf->upstream && conf->upstream->peer.init_upstream
+        && conf->upstream->peer.init_upstream
+           != ngx_stream_upstream_init_round_robin)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%s\" requires the round robin balancer "
+                           "in upstream \"%V\"",
+                           conf->connect_stagger ? "proxy_connect_stagger"
+                                                 : "proxy_connect_hedge",
+                           &conf->upstream->host);
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->connect_hedge) {
+        conf->hedge = ngx_pcalloc(cf->pool, NGX_STREAM_PROXY_HEDGE_SLOTS
+                                  * sizeof(ngx_stream_proxy_hedge_slot_t));
+        if (conf->hedge == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ngx_conf_merge_msec_value(conf->timeout,
+                              prev->timeout, 10 * 60000);
+
+    ngx_conf_merge_msec_value(conf->next_upstream_timeout,
+                              prev->next_upstream_timeout, 0);
+
+    ngx_conf_merge_size_value(conf->buffer_size,
+                              prev->buffer_size, 16384);
+
+    ngx_conf_merge_size_value(conf->read_budget, prev->read_budget, 0);
+
+    ngx_conf_merge_uint_value(conf->read_budget_iterations,
+                              prev->read_budget_iterations, 0);
+
+    ngx_conf_merge_size_value(conf->coalesce, prev->coalesce, 0);
+
+    ngx_conf_merge_msec_value(conf->coalesce_timeout,
+                              prev->coalesce_timeout, 1);
+
+    ngx_conf_merge_ptr_value(conf->upload_rate, prev->upload_rate, NULL);
+
+    ngx_conf_merge_ptr_value(conf->download_rate, prev->download_rate, NULL);
+
+    ngx_conf_merge_ptr_value(conf->qos, prev->qos, NULL);
+
+    /* sessions only enter a qos queue when they yield on a read budget */
+
+    if (conf->qos && conf->read_budget == 0
+        && conf->read_budget_iterations == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"proxy_qos\" requires \"proxy_read_budget\" "
+                           "or \"proxy_read_budget_iterations\"");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_size_value(conf->rate_burst, prev->rate_burst, 0);
+
+    ngx_conf_merge_ptr_value(conf->rate_zone, prev->rate_zone, NULL);
+
+    ngx_conf_merge_ptr_value(conf->breaker, prev->breaker, NULL);
+
+    ngx_conf_merge_uint_value(conf->requests,
+                              prev->requests, 0);
+    
+    ngx_conf_merge_uint_value(conf->proxy_protocol_version,
+                              prev->proxy_protocol_version, 1);
+
+    ngx_conf_merge_uint_value(conf->responses,
+                              prev->responses, NGX_MAX_INT32_VALUE);
+
+    ngx_conf_merge_uint_value(conf->next_upstream_tries,
+                              prev->next_upstream_tries, 0);
+
+    ngx_conf_merge_value(conf->next_upstream, prev->next_upstream, 1);
+
+    ngx_conf_merge_value(conf->proxy_protocol, prev->proxy_protocol, 0);
+
+    ngx_conf_merge_ptr_value(conf->local, prev->local, NULL);
+
+    ngx_conf_merge_value(conf->socket_keepalive,
+                              prev->socket_keepalive, 0);
+
+    ngx_conf_merge_value(conf->half_close, prev->half_close, 0);
+
+    ngx_conf_merge_uint_value(conf->udp_batch, prev->udp_batch, 1);
+
+    ngx_conf_merge_value(conf->udp_gso, prev->udp_gso, 0);
+
+    /* datagrams are only segmented by the batched send chain */
+
+    if (conf->udp_gso && conf->udp_batch < 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"proxy_udp_gso\" requires \"proxy_udp_batch\" "
+                           "greater than 1");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_value(conf->udp_gro, prev->udp_gro, 0);
+
+    ngx_conf_merge_uint_value(conf->udp_socket_cache,
+                              prev->udp_socket_cache, 0);
+
+    ngx_conf_merge_msec_value(conf->udp_socket_cache_timeout,
+                              prev->udp_socket_cache_timeout, 60000);
+
+    if (conf->udp_id_len == NGX_CONF_UNSET_UINT) {
+        conf->udp_id_len = prev->udp_id_len;
+        conf->udp_id_offset = prev->udp_id_offset;
+    }
+
+    if (conf->udp_id_len == NGX_CONF_UNSET_UINT) {
+        conf->udp_id_len = 0;
+        conf->udp_id_offset = 0;
+    }
+
+    if (conf->udp_socket_cache) {
+
+        /*
+         * the cache is filled at run time, so each worker has its own;
+         * the limit is per peer, there is room for all peers of a static
+         * upstream or for a fixed number of peers otherwise
+         */
+
+        n = 0;
+
+        if (conf->upstream && conf->upstream->servers) {
+            us = conf->upstream->servers->elts;
+
+            for (i = 0; i < conf->upstream->servers->nelts; i++) {
+                n += ngx_max(us[i].naddrs, 1);
+            }
+        }
+
+        if (n == 0) {
+            n = NGX_STREAM_PROXY_UDP_CACHE_PEERS;
+        }
+
+        n *= conf->udp_socket_cache;
+
+        cache = ngx_palloc(cf->pool, sizeof(ngx_stream_proxy_udp_cache_t));
+        if (cache == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        item = ngx_palloc(cf->pool,
+                          sizeof(ngx_stream_proxy_udp_cache_item_t) * n);
+        if (item == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        cache->max_cached = conf->udp_socket_cache;
+        cache->timeout = conf->udp_socket_cache_timeout;
+        cache->id_offset = conf->udp_id_offset;
+        cache->id_len = conf->udp_id_len;
+
+        ngx_queue_init(&cache->cache);
+        ngx_queue_init(&cache->free);
+
+        for (i = 0; i < n; i++) {
+            ngx_queue_insert_head(&cache->free, &item[i].queue);
+            item[i].cache = cache;
+        }
+
+        conf->udp_cache = cache;
+    }
+
+    ngx_conf_merge_uint_value(conf->pass_cache_size,
+                              prev->pass_cache_size, 0);
+
+    if (conf->pass_cache_size && conf->upstream_value) {
+
+        /* filled at run time, nodes are allocated from the worker heap */
+
+        pass = ngx_palloc(cf->pool, sizeof(ngx_stream_proxy_pass_cache_t));
+        if (pass == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_rbtree_init(&pass->rbtree, &pass->sentinel,
+                        ngx_str_rbtree_insert_value);
+        ngx_queue_init(&pass->queue);
+
+        pass->max = conf->pass_cache_size;
+        pass->count = 0;
+        pass->hits = 0;
+        pass->misses = 0;
+
+        conf->pass_cache = pass;
+    }
+
+    ngx_conf_merge_uint_value(conf->resolve_cache_size,
+                              prev->resolve_cache_size, 0);
+
+    if (conf->resolve_cache_size && conf->upstream_value) {
+
+        resolve = ngx_palloc(cf->pool,
+                             sizeof(ngx_stream_proxy_resolve_cache_t));
+        if (resolve == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_rbtree_init(&resolve->rbtree, &resolve->sentinel,
+                        ngx_str_rbtree_insert_value);
+        ngx_queue_init(&resolve->queue);
+
+        resolve->max = conf->resolve_cache_size;
+        resolve->count = 0;
+
+        conf->resolve_cache = resolve;
+    }
+
+    ngx_conf_merge_uint_value(conf->prewarm, prev->prewarm, 0);
+
+    ngx_conf_merge_msec_value(conf->prewarm_timeout,
+                              prev->prewarm_timeout, 60000);
+
+    ngx_conf_merge_uint_value(conf->prewarm_rate, prev->prewarm_rate, 10);
+
+    if (conf->prewarm_rate == 0 || conf->prewarm_rate > 1000) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"proxy_prewarm_rate\" must be between 1 and 1000");
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * warm connections are opened to the peers of a static upstream;
+     * the PROXY protocol header goes first on the wire, so any such
+     * connection can serve any TCP client
+     */
+
+    if (conf->prewarm && conf->upstream && conf->upstream_value == NULL
+        && (conf->local == NULL || conf->local->value == NULL)
+        && ngx_stream_proxy_listen_type(cf, conf, SOCK_STREAM))
+    {
+        pmcf = ngx_stream_conf_get_module_main_conf(cf,
+                                                    ngx_stream_proxy_module);
+
+        pw = ngx_pcalloc(cf->pool, sizeof(ngx_stream_proxy_prewarm_t));
+        if (pw == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        pw->conf = conf;
+
+        pwp = ngx_array_push(&pmcf->prewarm);
+        if (pwp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *pwp = pw;
+
+        conf->prewarm_pool = pw;
+    }
+
+    if (conf->health) {
+
+        if (conf->upstream == NULL || conf->upstream_value) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"proxy_health_check\" requires "
+                               "\"proxy_pass\" with a static upstream");
+            return NGX_CONF_ERROR;
+        }
+
+        /* the probes are TCP connects */
+
+        if (ngx_stream_proxy_listen_type(cf, conf, SOCK_DGRAM)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"proxy_health_check\" is not supported "
+                               "for udp servers");
+            return NGX_CONF_ERROR;
+        }
+
+        pmcf = ngx_stream_conf_get_module_main_conf(cf,
+                                                    ngx_stream_proxy_module);
+
+        hcp = ngx_array_push(&pmcf->health_checks);
+        if (hcp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *hcp = conf->health;
+
+        conf->health->conf = conf;
+
+        if (conf->health->timeout == NGX_CONF_UNSET_MSEC) {
+            conf->health->timeout = conf->connect_timeout;
+        }
+    }
+
+    ngx_conf_merge_str_value(conf->proxy_protocol_tlv_alpn, prev->proxy_protocol_tlv_alpn, NULL);
+
+    ngx_conf_merge_str_value(conf->proxy_protocol_tlv_auth, prev->proxy_protocol_tlv_auth, NULL);
+
+    ngx_conf_merge_ptr_value(conf->proxy_protocol_trusted,
+                              prev->proxy_protocol_trusted, NULL);
+
+    if (conf->proxy_protocol_trusted == prev->proxy_protocol_trusted) {
+        conf->proxy_protocol_trusted_tree = prev->proxy_protocol_trusted_tree;
+    }
+
+    if (conf->proxy_protocol_trusted
+        && conf->proxy_protocol_trusted_tree == NULL)
+    {
+        conf->proxy_protocol_trusted_tree =
+                 ngx_cidr_tree_create(cf->pool, conf->proxy_protocol_trusted);
+
+        if (conf->proxy_protocol_trusted_tree == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (conf->proxy_protocol_trusted == prev->proxy_protocol_trusted) {
+            prev->proxy_protocol_trusted_tree =
+                                         conf->proxy_protocol_trusted_tree;
+        }
+    }
+
+#if (NGX_STREAM_SSL)
+
+    if (ngx_stream_proxy_merge_ssl(cf, conf, prev) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_value(conf->ssl_enable, prev->ssl_enable, 0);
+
+    ngx_conf_merge_value(conf->ssl_session_reuse,
+                              prev->ssl_session_reuse, 1);
+
+    ngx_conf_merge_bitmask_value(conf->ssl_protocols, prev->ssl_protocols,
+                              (NGX_CONF_BITMASK_SET|NGX_SSL_TLSv1
+                               |NGX_SSL_TLSv1_1|NGX_SSL_TLSv1_2));
+
+    ngx_conf_merge_str_value(conf->ssl_ciphers, prev->ssl_ciphers, "DEFAULT");
+
+    ngx_conf_merge_ptr_value(conf->ssl_name, prev->ssl_name, NULL);
+
+    ngx_conf_merge_value(conf->ssl_server_name, prev->ssl_server_name, 0);
+
+    ngx_conf_merge_value(conf->ssl_verify, prev->ssl_verify, 0);
+
+    ngx_conf_merge_uint_value(conf->ssl_verify_depth,
+                              prev->ssl_verify_depth, 1);
+
+    ngx_conf_merge_str_value(conf->ssl_trusted_certificate,
+                              prev->ssl_trusted_certificate, "");
+
+    ngx_conf_merge_str_value(conf->ssl_crl, prev->ssl_crl, "");
+
+    ngx_conf_merge_ptr_value(conf->ssl_certificate,
+                              prev->ssl_certificate, NULL);
+
+    ngx_conf_merge_ptr_value(conf->ssl_certificate_key,
+                              prev->ssl_certificate_key, NULL);
+
+    ngx_conf_merge_ptr_value(conf->ssl_passwords, prev->ssl_passwords, NULL);
+
+    ngx_conf_merge_ptr_value(conf->ssl_certificate_cache,
+                              prev->ssl_certificate_cache, NULL);
+
+    ngx_conf_merge_ptr_value(conf->ssl_conf_commands,
+                              prev->ssl_conf_commands, NULL);
+
+    ngx_conf_merge_value(conf->ssl_ktls, prev->ssl_ktls, 0);
+
+    if (conf->ssl_enable && ngx_stream_proxy_set_ssl(cf, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_uint_t
+ngx_stream_proxy_listen_type(ngx_conf_t *cf, ngx_stream_proxy_srv_conf_t *conf,
+    int type)
+{
+    ngx_uint_t                    i;
+    ngx_stream_listen_t          *ls;
+    ngx_stream_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    ls = cmcf->listen.elts;
+
+    for (i = 0; i < cmcf->listen.nelts; i++) {
+
+        if (ls[i].type == type
+            && ls[i].ctx->srv_conf[ngx_stream_proxy_module.ctx_index] == conf)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+#if (NGX_STREAM_SSL)
+
+static ngx_int_t
+ngx_stream_proxy_merge_ssl(ngx_conf_t *cf, ngx_stream_proxy_srv_conf_t *conf,
+    ngx_stream_proxy_srv_conf_t *prev)
+{
+    ngx_uint_t  preserve;
+
+    if (conf->ssl_protocols == 0
+        && conf->ssl_ciphers.data == NULL
+        && conf->ssl_certificate == NGX_CONF_UNSET_PTR
+        && conf->ssl_certificate_key == NGX_CONF_UNSET_PTR
+        && conf->ssl_passwords == NGX_CONF_UNSET_PTR
+        && conf->ssl_verify == NGX_CONF_UNSET
+        && conf->ssl_verify_depth == NGX_CONF_UNSET_UINT
+        && conf->ssl_trusted_certificate.data == NULL
+        && conf->ssl_crl.data == NULL
+        && conf->ssl_session_reuse == NGX_CONF_UNSET
+        && conf->ssl_conf_commands == NGX_CONF_UNSET_PTR
+        && conf->ssl_ktls == NGX_CONF_UNSET)
+    {
+        if (prev->ssl) {
+            conf->ssl = prev->ssl;
+            return NGX_OK;
+        }
+
+        preserve = 1;
+
+    } else {
+        preserve = 0;
+    }
+
+    conf->ssl = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_t));
+    if (conf->ssl == NULL) {
+        return NGX_ERROR;
+    }
+
+    conf->ssl->log = cf->log;
+
+    /*
+     * special handling to preserve conf->ssl
+     * in the "stream" section to inherit it to all servers
+     */
+
+    if (preserve) {
+        prev->ssl = conf->ssl;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_set_ssl(ngx_conf_t *cf, ngx_stream_proxy_srv_conf_t *pscf)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    if (pscf->ssl->ctx) {
+        return NGX_OK;
+    }
+
+    if (ngx_ssl_create(pscf->ssl, pscf->ssl_protocols, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        ngx_ssl_cleanup_ctx(pscf->ssl);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_ssl_cleanup_ctx;
+    cln->data = pscf->ssl;
+
+    if (ngx_ssl_ciphers(cf, pscf->ssl, &pscf->ssl_ciphers, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (pscf->ssl_certificate
+        && pscf->ssl_certificate->value.len)
+    {
+        if (pscf->ssl_certificate_key == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "no \"proxy_ssl_certificate_key\" is defined "
+                          "for certificate \"%V\"",
+                          &pscf->ssl_certificate->value);
+            return NGX_ERROR;
+        }
+
+        if (pscf->ssl_certificate->lengths
+            || pscf->ssl_certificate_key->lengths)
+        {
+            pscf->ssl_passwords =
+                           ngx_ssl_preserve_passwords(cf, pscf->ssl_passwords);
+            if (pscf->ssl_passwords == NULL) {
+                return NGX_ERROR;
+            }
+
+        } else {
+            if (ngx_ssl_certificate(cf, pscf->ssl,
+                                    &pscf->ssl_certificate->value,
+                                    &pscf->ssl_certificate_key->value,
+                                    pscf->ssl_passwords)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (pscf->ssl_verify) {
+        if (pscf->ssl_trusted_certificate.len == 0) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "no proxy_ssl_trusted_certificate for proxy_ssl_verify");
+            return NGX_ERROR;
+        }
+
+        if (ngx_ssl_trusted_certificate(cf, pscf->ssl,
+                                        &pscf->ssl_trusted_certificate,
+                                        pscf->ssl_verify_depth)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ngx_ssl_crl(cf, pscf->ssl, &pscf->ssl_crl) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_ssl_client_session_cache(cf, pscf->ssl, pscf->ssl_session_reuse)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (pscf->ssl_ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(pscf->ssl->ctx, SSL_OP_ENABLE_KTLS);
+#else
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "\"proxy_ssl_ktls\" is not supported by this "
+                      "OpenSSL version, ignored");
+#endif
+    }
+
+    if (ngx_ssl_conf_commands(cf, pscf->ssl, pscf->ssl_conf_commands)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static char *
+ngx_stream_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_proxy_srv_conf_t *pscf = conf;
+
+    ngx_url_t                            u;
+    ngx_str_t                           *value, *url;
+    ngx_stream_complex_value_t           cv;
+    ngx_stream_core_srv_conf_t          *cscf;
+    ngx_stream_compile_complex_value_t   ccv;
+
+    if (pscf->upstream || pscf->upstream_value) {
+        return "is duplicate";
+    }
+
+    cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
+
+    cscf->handler = ngx_stream_proxy_handler;
+
+    value = cf->args->elts;
+
+    url = &value[1];
+
+    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = url;
+    ccv.complex_value = &cv;
+
+    if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cv.lengths) {
+        pscf->upstream_value = ngx_palloc(cf->pool,
+                                          sizeof(ngx_stream_complex_value_t));
+        if (pscf->upstream_value == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *pscf->upstream_value = cv;
+
+        return NGX_CONF_OK;
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = *url;
+    u.no_resolve = 1;
+
+    pscf->upstream = ngx_stream_upstream_add(cf, &u, 0);
+    if (pscf->upstream == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_proxy_srv_conf_t *pscf = conf;
+
+    ngx_int_t                            rc;
+    ngx_str_t                           *value;
+    ngx_uint_t                           i, n;
+    ngx_addr_t                          *addr;
+    ngx_stream_complex_value_t           cv;
+    ngx_stream_upstream_local_t         *local;
+    ngx_stream_compile_complex_value_t   ccv;
+
+    if (pscf->local != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        pscf->local = NULL;
+        return NGX_CONF_OK;
+    }
+
+    n = cf->args->nelts - 1;
+
+    if (n > 1 && ngx_strcmp(value[n].data, "transparent") == 0) {
+        n--;
+    }
+
+    local = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_local_t));
+    if (local == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    pscf->local = local;
 
-    c = s->connection;
-    u = s->upstream;
-    pc = u->connected ? u->peer.connection : NULL;
+    for (i = 1; i <= n; i++) {
 
-    if (c->type == SOCK_DGRAM) {
+        ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
 
-        if (pscf->requests && u->requests < pscf->requests) {
-            return NGX_DECLINED;
+        ccv.cf = cf;
+        ccv.value = &value[i];
+        ccv.complex_value = &cv;
+
+        if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
         }
 
-        if (pscf->requests) {
-            ngx_delete_udp_connection(c);
+        if (cv.lengths == NULL) {
+            continue;
         }
 
-        if (pscf->responses == NGX_MAX_INT32_VALUE
-            || u->responses < pscf->responses * u->requests)
-        {
-            return NGX_DECLINED;
+        if (n > 1) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "variables are not allowed "
+                               "with several addresses");
+            return NGX_CONF_ERROR;
         }
 
-        if (pc == NULL || c->buffered || pc->buffered) {
-            return NGX_DECLINED;
+        local->value = ngx_palloc(cf->pool,
+                                  sizeof(ngx_stream_complex_value_t));
+        if (local->value == NULL) {
+            return NGX_CONF_ERROR;
         }
 
-        handler = c->log->handler;
-        c->log->handler = NULL;
+        *local->value = cv;
+    }
 
-        ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                      "udp done"
-                      ", packets from/to client:%ui/%ui"
-                      ", bytes from/to client:%O/%O"
-                      ", bytes from/to upstream:%O/%O",
-                      u->requests, u->responses,
-                      s->received, c->sent, u->received, pc ? pc->sent : 0);
+    if (local->value == NULL) {
+        local->addr = ngx_palloc(cf->pool, n * sizeof(ngx_addr_t));
+        if (local->addr == NULL) {
+            return NGX_CONF_ERROR;
+        }
 
-        c->log->handler = handler;
+        local->naddrs = n;
 
-        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+        for (i = 1; i <= n; i++) {
+            addr = &local->addr[i - 1];
 
-        return NGX_OK;
+            rc = ngx_parse_addr_port(cf->pool, addr, value[i].data,
+                                     value[i].len);
+
+            switch (rc) {
+            case NGX_OK:
+                addr->name = value[i];
+                break;
+
+            case NGX_DECLINED:
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid address \"%V\"", &value[i]);
+                /* fall through */
+
+            default:
+                return NGX_CONF_ERROR;
+            }
+
+            /*
+             * rotation only helps if the kernel picks the port at connect
+             * time, which ngx_event_connect_peer() requests with
+             * IP_BIND_ADDRESS_NO_PORT for addresses without a port
+             */
+
+            if (n > 1 && ngx_inet_get_port(addr->sockaddr) != 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "port is not allowed in \"%V\" "
+                                   "with several addresses", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            /* any of the addresses must be usable for any peer */
+
+            if (i > 1
+                && addr->sockaddr->sa_family
+                   != local->addr[0].sockaddr->sa_family)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "address \"%V\" is of another family "
+                                   "than \"%V\"", &value[i], &value[1]);
+                return NGX_CONF_ERROR;
+            }
+        }
     }
 
-    /* c->type == SOCK_STREAM */
+    if (n < cf->args->nelts - 1) {
+#if (NGX_HAVE_TRANSPARENT_PROXY)
+        ngx_core_conf_t  *ccf;
 
-    if (pc == NULL
-        || (!c->read->eof && !pc->read->eof)
-        || (!c->read->eof && c->buffered)
-        || (!pc->read->eof && pc->buffered))
+        ccf = (ngx_core_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                               ngx_core_module);
+
+        ccf->transparent = 1;
+        local->transparent = 1;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "transparent proxying is not supported "
+                           "on this platform, ignored");
+#endif
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_proxy_connect_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_proxy_srv_conf_t *pscf = conf;
+
+    ngx_int_t   n;
+    ngx_str_t  *value;
+
+    if (pscf->connect_hedge != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        pscf->connect_hedge = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (value[1].len < 2 || value[1].data[0] != 'p') {
+        goto invalid;
+    }
+
+    n = ngx_atoi(value[1].data + 1, value[1].len - 1);
+
+    if (n < 1 || n > 99) {
+        goto invalid;
+    }
+
+    pscf->connect_hedge = n;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid percentile \"%V\", must be \"p1\"..\"p99\"",
+                       &value[1]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_stream_proxy_udp_socket_cache_id(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_proxy_srv_conf_t *pscf = conf;
+
+    u_char     *p;
+    ngx_int_t   offset, len;
+    ngx_str_t  *value;
+
+    if (pscf->udp_id_len != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        pscf->udp_id_len = 0;
+        return NGX_CONF_OK;
+    }
+
+    p = ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    offset = ngx_atoi(value[1].data, p - value[1].data);
+    len = ngx_atoi(p + 1, value[1].data + value[1].len - p - 1);
+
+    if (offset == NGX_ERROR || len == NGX_ERROR
+        || len == 0 || len > NGX_STREAM_PROXY_UDP_ID_MAX)
     {
-        return NGX_DECLINED;
+        goto invalid;
     }
 
-    if (pscf->half_close) {
-        /* avoid closing live connections until both read ends get EOF */
-        if (!(c->read->eof && pc->read->eof && !c->buffered && !pc->buffered)) {
-             return NGX_DECLINED;
+    pscf->udp_id_offset = offset;
+    pscf->udp_id_len = len;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid id \"%V\", \"offset:length\" with length "
+                       "up to %d is expected", &value[1],
+                       NGX_STREAM_PROXY_UDP_ID_MAX);
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_stream_proxy_udp_offload_check(ngx_conf_t *cf, void *post, void *data)
+{
+#if !(defined UDP_SEGMENT && defined UDP_GRO)
+    ngx_flag_t  *fp = data;
+
+    if (*fp) {
+        return "is not supported on this platform";
+    }
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_proxy_protocol_trusted(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_proxy_srv_conf_t *pscf = conf;
+
+    ngx_int_t    rc;
+    ngx_str_t   *value;
+    ngx_cidr_t  *cidr;
+
+    value = cf->args->elts;
+
+    if (pscf->proxy_protocol_trusted == NGX_CONF_UNSET_PTR) {
+        pscf->proxy_protocol_trusted = ngx_array_create(cf->pool, 2,
+                                                        sizeof(ngx_cidr_t));
+        if (pscf->proxy_protocol_trusted == NULL) {
+            return NGX_CONF_ERROR;
         }
     }
 
-    handler = c->log->handler;
-    c->log->handler = NULL;
+    cidr = ngx_array_push(pscf->proxy_protocol_trusted);
+    if (cidr == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-    ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                  "%s disconnected"
-                  ", bytes from/to client:%O/%O"
-                  ", bytes from/to upstream:%O/%O",
-                  from_upstream ? "upstream" : "client",
-                  s->received, c->sent, u->received, pc ? pc->sent : 0);
+#if (NGX_HAVE_UNIX_DOMAIN)
 
-    c->log->handler = handler;
+    if (ngx_strcmp(value[1].data, "unix:") == 0) {
+        cidr->family = AF_UNIX;
+        return NGX_CONF_OK;
+    }
 
-    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+#endif
 
-    return NGX_OK;
+    rc = ngx_ptocidr(&value[1], cidr);
+
+    if (rc == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "low address bits of %V are meaningless",
+                           &value[1]);
+    }
+
+    return NGX_CONF_OK;
 }
 
 
-static void
-ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
+static char *
+ngx_stream_proxy_qos_class(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_msec_t                    timeout;
-    ngx_connection_t             *pc;
-    ngx_stream_upstream_t        *u;
-    ngx_stream_proxy_srv_conf_t  *pscf;
+    ngx_stream_proxy_main_conf_t *pmcf = conf;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
-                   "stream proxy next upstream");
+    ngx_int_t                      weight;
+    ngx_str_t                     *value;
+    ngx_uint_t                     i;
+    ngx_stream_proxy_qos_class_t  *cls;
 
-    u = s->upstream;
-    pc = u->peer.connection;
+    value = cf->args->elts;
 
-    if (pc && pc->buffered) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                      "buffered data on next upstream");
-        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
-        return;
+    cls = pmcf->qos_classes.elts;
+
+    for (i = 0; i < pmcf->qos_classes.nelts; i++) {
+        if (cls[i].name.len == value[1].len
+            && ngx_strncmp(cls[i].name.data, value[1].data, value[1].len)
+               == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate qos class \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
     }
 
-    if (s->connection->type == SOCK_DGRAM) {
-        u->upstream_out = NULL;
+    weight = ngx_atoi(value[2].data, value[2].len);
+
+    if (weight == NGX_ERROR || weight < 1 || weight > 1000) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid weight \"%V\", "
+                           "it must be between 1 and 1000", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    cls = ngx_array_push(&pmcf->qos_classes);
+    if (cls == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(cls, sizeof(ngx_stream_proxy_qos_class_t));
+
+    cls->name = value[1];
+    cls->weight = weight;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_proxy_rate_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                              *p;
+    ssize_t                              size;
+    ngx_str_t                           *value, name, s;
+    ngx_uint_t                           i;
+    ngx_shm_zone_t                      *shm_zone;
+    ngx_stream_proxy_rate_zone_t        *ctx;
+    ngx_stream_compile_complex_value_t   ccv;
+
+    value = cf->args->elts;
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_stream_proxy_rate_zone_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = &ctx->key;
+
+    if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    size = 0;
+    name.len = 0;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_stream_proxy_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ctx = shm_zone->data;
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V \"%V\" is already bound to key \"%V\"",
+                           &cmd->name, &name, &ctx->key.value);
+        return NGX_CONF_ERROR;
     }
 
-    if (u->peer.sockaddr) {
-        u->peer.free(&u->peer, u->peer.data, NGX_PEER_FAILED);
-        u->peer.sockaddr = NULL;
-    }
+    shm_zone->init = ngx_stream_proxy_init_rate_zone;
+    shm_zone->data = ctx;
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+    return NGX_CONF_OK;
+}
 
-    timeout = pscf->next_upstream_timeout;
 
-    if (u->peer.tries == 0
-        || !pscf->next_upstream
-        || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
-    {
-        ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
-        return;
-    }
+static char *
+ngx_stream_proxy_rate_shared(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_proxy_srv_conf_t *pscf = conf;
 
-    if (pc) {
-        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
-                       "close proxy upstream connection: %d", pc->fd);
+    ngx_str_t  *value;
 
-#if (NGX_STREAM_SSL)
-        if (pc->ssl) {
-            pc->ssl->no_wait_shutdown = 1;
-            pc->ssl->no_send_shutdown = 1;
+    if (pscf->rate_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
 
-            (void) ngx_ssl_shutdown(pc);
-        }
-#endif
+    value = cf->args->elts;
 
-        u->state->bytes_received = u->received;
-        u->state->bytes_sent = pc->sent;
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        pscf->rate_zone = NULL;
+        return NGX_CONF_OK;
+    }
 
-        ngx_close_connection(pc);
-        u->peer.connection = NULL;
+    pscf->rate_zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                            &ngx_stream_proxy_module);
+    if (pscf->rate_zone == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    ngx_stream_proxy_connect(s);
+    return NGX_CONF_OK;
 }
 
 
-static void
-ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
+static ngx_int_t
+ngx_stream_proxy_init_rate_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_uint_t              state;
-    ngx_connection_t       *pc;
-    ngx_stream_upstream_t  *u;
+    ngx_stream_proxy_rate_zone_t  *octx = data;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
-                   "finalize stream proxy: %i", rc);
+    size_t                         len;
+    ngx_stream_proxy_rate_zone_t  *ctx;
 
-    u = s->upstream;
+    ctx = shm_zone->data;
 
-    if (u == NULL) {
-        goto noupstream;
-    }
+    if (octx) {
+        if (ctx->key.value.len != octx->key.value.len
+            || ngx_strncmp(ctx->key.value.data, octx->key.value.data,
+                           ctx->key.value.len)
+               != 0)
+        {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "proxy_rate_zone \"%V\" uses the \"%V\" key "
+                          "while previously it used the \"%V\" key",
+                          &shm_zone->shm.name, &ctx->key.value,
+                          &octx->key.value);
+            return NGX_ERROR;
+        }
 
-    if (u->resolved && u->resolved->ctx) {
-        ngx_resolve_name_done(u->resolved->ctx);
-        u->resolved->ctx = NULL;
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
     }
 
-    pc = u->peer.connection;
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    if (u->state) {
-        if (u->state->response_time == (ngx_msec_t) -1) {
-            u->state->response_time = ngx_current_msec - u->start_time;
-        }
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
 
-        if (pc) {
-            u->state->bytes_received = u->received;
-            u->state->bytes_sent = pc->sent;
-        }
+        return NGX_OK;
     }
 
-    if (u->peer.free && u->peer.sockaddr) {
-        state = 0;
+    ctx->sh = ngx_slab_alloc(ctx->shpool,
+                             sizeof(ngx_stream_proxy_rate_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
 
-        if (pc && pc->type == SOCK_DGRAM
-            && (pc->read->error || pc->write->error))
-        {
-            state = NGX_PEER_FAILED;
-        }
+    ctx->shpool->data = ctx->sh;
 
-        u->peer.free(&u->peer, u->peer.data, state);
-        u->peer.sockaddr = NULL;
-    }
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_stream_proxy_rate_rbtree_insert_value);
 
-    if (pc) {
-        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
-                       "close stream proxy upstream connection: %d", pc->fd);
+    ngx_queue_init(&ctx->sh->queue);
 
-#if (NGX_STREAM_SSL)
-        if (pc->ssl) {
-            pc->ssl->no_wait_shutdown = 1;
-            (void) ngx_ssl_shutdown(pc);
-        }
-#endif
+    len = sizeof(" in proxy_rate_zone \"\"") + shm_zone->shm.name.len;
 
-        ngx_close_connection(pc);
-        u->peer.connection = NULL;
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
     }
 
-noupstream:
+    ngx_sprintf(ctx->shpool->log_ctx, " in proxy_rate_zone \"%V\"%Z",
+                &shm_zone->shm.name);
 
-    ngx_stream_finalize_session(s, rc);
+    return NGX_OK;
 }
 
 
-static u_char *
-ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf, size_t len)
+static void
+ngx_stream_proxy_rate_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
 {
-    u_char                 *p;
-    ngx_connection_t       *pc;
-    ngx_stream_session_t   *s;
-    ngx_stream_upstream_t  *u;
+    ngx_rbtree_node_t             **p;
+    ngx_stream_proxy_rate_node_t   *rn, *rnt;
 
-    s = log->data;
+    for ( ;; ) {
 
-    u = s->upstream;
+        if (node->key < temp->key) {
 
-    p = buf;
+            p = &temp->left;
 
-    if (u->peer.name) {
-        p = ngx_snprintf(p, len, ", upstream: \"%V\"", u->peer.name);
-        len -= p - buf;
-    }
+        } else if (node->key > temp->key) {
 
-    pc = u->peer.connection;
+            p = &temp->right;
 
-    p = ngx_snprintf(p, len,
-                     ", bytes from/to client:%O/%O"
-                     ", bytes from/to upstream:%O/%O",
-                     s->received, s->connection->sent,
-                     u->received, pc ? pc->sent : 0);
+        } else { /* node->key == temp->key */
 
-    return p;
+            rn = (ngx_stream_proxy_rate_node_t *) &node->color;
+            rnt = (ngx_stream_proxy_rate_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(rn->data, rnt->data, rn->len, rnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
 }
 
 
-static void *
-ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
+static char *
+ngx_stream_proxy_circuit_breaker(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
 {
-    ngx_stream_proxy_srv_conf_t  *conf;
+    ngx_stream_proxy_srv_conf_t *pscf = conf;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_proxy_srv_conf_t));
-    if (conf == NULL) {
-        return NULL;
+    u_char                           *p;
+    ssize_t                           size;
+    ngx_int_t                         n;
+    ngx_str_t                        *value, name, s;
+    ngx_uint_t                        i;
+    ngx_shm_zone_t                   *shm_zone;
+    ngx_stream_proxy_breaker_t       *breaker;
+    ngx_stream_proxy_breaker_zone_t  *ctx;
+
+    if (pscf->breaker != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
     }
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->ssl_protocols = 0;
-     *     conf->ssl_ciphers = { 0, NULL };
-     *     conf->ssl_trusted_certificate = { 0, NULL };
-     *     conf->ssl_crl = { 0, NULL };
-     *
-     *     conf->ssl = NULL;
-     *     conf->upstream = NULL;
-     *     conf->upstream_value = NULL;
-     */
+    value = cf->args->elts;
 
-    conf->connect_timeout = NGX_CONF_UNSET_MSEC;
-    conf->timeout = NGX_CONF_UNSET_MSEC;
-    conf->next_upstream_timeout = NGX_CONF_UNSET_MSEC;
-    conf->buffer_size = NGX_CONF_UNSET_SIZE;
-    conf->upload_rate = NGX_CONF_UNSET_PTR;
-    conf->download_rate = NGX_CONF_UNSET_PTR;
-    conf->requests = NGX_CONF_UNSET_UINT;
-    conf->responses = NGX_CONF_UNSET_UINT;
-    conf->next_upstream_tries = NGX_CONF_UNSET_UINT;
-    conf->next_upstream = NGX_CONF_UNSET;
-    conf->proxy_protocol = NGX_CONF_UNSET;
-    conf->local = NGX_CONF_UNSET_PTR;
-    conf->socket_keepalive = NGX_CONF_UNSET;
-    conf->half_close = NGX_CONF_UNSET;
-    conf->proxy_protocol_version = NGX_CONF_UNSET;
+    if (ngx_strcmp(value[1].data, "off") == 0) {
 
-#if (NGX_STREAM_SSL)
-    conf->ssl_enable = NGX_CONF_UNSET;
-    conf->ssl_session_reuse = NGX_CONF_UNSET;
-    conf->ssl_name = NGX_CONF_UNSET_PTR;
-    conf->ssl_server_name = NGX_CONF_UNSET;
-    conf->ssl_verify = NGX_CONF_UNSET;
-    conf->ssl_verify_depth = NGX_CONF_UNSET_UINT;
-    conf->ssl_certificate = NGX_CONF_UNSET_PTR;
-    conf->ssl_certificate_key = NGX_CONF_UNSET_PTR;
-    conf->ssl_passwords = NGX_CONF_UNSET_PTR;
-    conf->ssl_conf_commands = NGX_CONF_UNSET_PTR;
-#endif
+        if (cf->args->nelts != 2) {
+            return "takes no parameters with \"off\"";
+        }
 
-    return conf;
-}
+        pscf->breaker = NULL;
+        return NGX_CONF_OK;
+    }
 
+    breaker = ngx_pcalloc(cf->pool, sizeof(ngx_stream_proxy_breaker_t));
+    if (breaker == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-static char *
-ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
-{
-    ngx_stream_proxy_srv_conf_t *prev = parent;
-    ngx_stream_proxy_srv_conf_t *conf = child;
+    breaker->failures = 50;
+    breaker->requests = 20;
+    breaker->latency = 0;
+    breaker->window = 10000;
+    breaker->open = 10000;
+    breaker->probes = 1;
 
-    ngx_conf_merge_msec_value(conf->connect_timeout,
-                              prev->connect_timeout, 60000);
+    size = 0;
+    name.len = 0;
 
-    ngx_conf_merge_msec_value(conf->timeout,
-                              prev->timeout, 10 * 60000);
+    for (i = 1; i < cf->args->nelts; i++) {
 
-    ngx_conf_merge_msec_value(conf->next_upstream_timeout,
-                              prev->next_upstream_timeout, 0);
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
 
-    ngx_conf_merge_size_value(conf->buffer_size,
-                              prev->buffer_size, 16384);
+            name.data = value[i].data + 5;
+            name.len = value[i].len - 5;
 
-    ngx_conf_merge_ptr_value(conf->upload_rate, prev->upload_rate, NULL);
+            p = (u_char *) ngx_strchr(name.data, ':');
 
-    ngx_conf_merge_ptr_value(conf->download_rate, prev->download_rate, NULL);
+            if (p) {
+                name.len = p - name.data;
 
-    ngx_conf_merge_uint_value(conf->requests,
-                              prev->requests, 0);
-    
-    ngx_conf_merge_uint_value(conf->proxy_protocol_version,
-                              prev->proxy_protocol_version, 1);
+                s.data = p + 1;
+                s.len = value[i].data + value[i].len - s.data;
 
-    ngx_conf_merge_uint_value(conf->responses,
-                              prev->responses, NGX_MAX_INT32_VALUE);
+                size = ngx_parse_size(&s);
 
-    ngx_conf_merge_uint_value(conf->next_upstream_tries,
-                              prev->next_upstream_tries, 0);
+                if (size == NGX_ERROR) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "invalid zone size \"%V\"", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
 
-    ngx_conf_merge_value(conf->next_upstream, prev->next_upstream, 1);
+                if (size < (ssize_t) (8 * ngx_pagesize)) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "zone \"%V\" is too small", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+            }
 
-    ngx_conf_merge_value(conf->proxy_protocol, prev->proxy_protocol, 0);
+            if (name.len == 0) {
+                goto invalid;
+            }
 
-    ngx_conf_merge_ptr_value(conf->local, prev->local, NULL);
+            continue;
+        }
 
-    ngx_conf_merge_value(conf->socket_keepalive,
-                              prev->socket_keepalive, 0);
+        if (ngx_strncmp(value[i].data, "failures=", 9) == 0) {
 
-    ngx_conf_merge_value(conf->half_close, prev->half_close, 0);
+            s.data = value[i].data + 9;
+            s.len = value[i].len - 9;
 
-    ngx_conf_merge_str_value(conf->proxy_protocol_tlv_alpn, prev->proxy_protocol_tlv_alpn, NULL);
+            if (s.len && s.data[s.len - 1] == '%') {
+                s.len--;
+            }
 
-    ngx_conf_merge_str_value(conf->proxy_protocol_tlv_auth, prev->proxy_protocol_tlv_auth, NULL);
+            n = ngx_atoi(s.data, s.len);
 
-#if (NGX_STREAM_SSL)
+            if (n < 1 || n > 100) {
+                goto invalid;
+            }
 
-    if (ngx_stream_proxy_merge_ssl(cf, conf, prev) != NGX_OK) {
-        return NGX_CONF_ERROR;
-    }
+            breaker->failures = n;
+            continue;
+        }
 
-    ngx_conf_merge_value(conf->ssl_enable, prev->ssl_enable, 0);
+        if (ngx_strncmp(value[i].data, "requests=", 9) == 0) {
 
-    ngx_conf_merge_value(conf->ssl_session_reuse,
-                              prev->ssl_session_reuse, 1);
+            n = ngx_atoi(value[i].data + 9, value[i].len - 9);
 
-    ngx_conf_merge_bitmask_value(conf->ssl_protocols, prev->ssl_protocols,
-                              (NGX_CONF_BITMASK_SET|NGX_SSL_TLSv1
-                               |NGX_SSL_TLSv1_1|NGX_SSL_TLSv1_2));
+            if (n < 1) {
+                goto invalid;
+            }
 
-    ngx_conf_merge_str_value(conf->ssl_ciphers, prev->ssl_ciphers, "DEFAULT");
+            breaker->requests = n;
+            continue;
+        }
 
-    ngx_conf_merge_ptr_value(conf->ssl_name, prev->ssl_name, NULL);
+        if (ngx_strncmp(value[i].data, "probes=", 7) == 0) {
 
-    ngx_conf_merge_value(conf->ssl_server_name, prev->ssl_server_name, 0);
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
 
-    ngx_conf_merge_value(conf->ssl_verify, prev->ssl_verify, 0);
+            if (n < 1) {
+                goto invalid;
+            }
 
-    ngx_conf_merge_uint_value(conf->ssl_verify_depth,
-                              prev->ssl_verify_depth, 1);
+            breaker->probes = n;
+            continue;
+        }
 
-    ngx_conf_merge_str_value(conf->ssl_trusted_certificate,
-                              prev->ssl_trusted_certificate, "");
+        if (ngx_strncmp(value[i].data, "latency=", 8) == 0) {
 
-    ngx_conf_merge_str_value(conf->ssl_crl, prev->ssl_crl, "");
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
 
-    ngx_conf_merge_ptr_value(conf->ssl_certificate,
-                              prev->ssl_certificate, NULL);
+            n = ngx_parse_time(&s, 0);
+
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            breaker->latency = n;
+            continue;
+        }
 
-    ngx_conf_merge_ptr_value(conf->ssl_certificate_key,
-                              prev->ssl_certificate_key, NULL);
+        if (ngx_strncmp(value[i].data, "window=", 7) == 0) {
 
-    ngx_conf_merge_ptr_value(conf->ssl_passwords, prev->ssl_passwords, NULL);
+            s.data = value[i].data + 7;
+            s.len = value[i].len - 7;
 
-    ngx_conf_merge_ptr_value(conf->ssl_conf_commands,
-                              prev->ssl_conf_commands, NULL);
+            n = ngx_parse_time(&s, 0);
 
-    if (conf->ssl_enable && ngx_stream_proxy_set_ssl(cf, conf) != NGX_OK) {
-        return NGX_CONF_ERROR;
-    }
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
 
-#endif
+            breaker->window = n;
+            continue;
+        }
 
-    return NGX_CONF_OK;
-}
+        if (ngx_strncmp(value[i].data, "open=", 5) == 0) {
 
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
 
-#if (NGX_STREAM_SSL)
+            n = ngx_parse_time(&s, 0);
 
-static ngx_int_t
-ngx_stream_proxy_merge_ssl(ngx_conf_t *cf, ngx_stream_proxy_srv_conf_t *conf,
-    ngx_stream_proxy_srv_conf_t *prev)
-{
-    ngx_uint_t  preserve;
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
 
-    if (conf->ssl_protocols == 0
-        && conf->ssl_ciphers.data == NULL
-        && conf->ssl_certificate == NGX_CONF_UNSET_PTR
-        && conf->ssl_certificate_key == NGX_CONF_UNSET_PTR
-        && conf->ssl_passwords == NGX_CONF_UNSET_PTR
-        && conf->ssl_verify == NGX_CONF_UNSET
-        && conf->ssl_verify_depth == NGX_CONF_UNSET_UINT
-        && conf->ssl_trusted_certificate.data == NULL
-        && conf->ssl_crl.data == NULL
-        && conf->ssl_session_reuse == NGX_CONF_UNSET
-        && conf->ssl_conf_commands == NGX_CONF_UNSET_PTR)
-    {
-        if (prev->ssl) {
-            conf->ssl = prev->ssl;
-            return NGX_OK;
+            breaker->open = n;
+            continue;
         }
 
-        preserve = 1;
+        goto invalid;
+    }
 
-    } else {
-        preserve = 0;
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
     }
 
-    conf->ssl = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_t));
-    if (conf->ssl == NULL) {
-        return NGX_ERROR;
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_stream_proxy_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    conf->ssl->log = cf->log;
+    /* the zone may be shared by several servers */
 
-    /*
-     * special handling to preserve conf->ssl
-     * in the "stream" section to inherit it to all servers
-     */
+    if (shm_zone->data == NULL) {
+        ctx = ngx_pcalloc(cf->pool, sizeof(ngx_stream_proxy_breaker_zone_t));
+        if (ctx == NULL) {
+            return NGX_CONF_ERROR;
+        }
 
-    if (preserve) {
-        prev->ssl = conf->ssl;
+        shm_zone->init = ngx_stream_proxy_init_breaker_zone;
+        shm_zone->data = ctx;
+
+    } else if (shm_zone->init != ngx_stream_proxy_init_breaker_zone) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is already used by proxy_rate_zone",
+                           &name);
+        return NGX_CONF_ERROR;
     }
 
-    return NGX_OK;
+    breaker->shm_zone = shm_zone;
+
+    pscf->breaker = breaker;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
 }
 
 
 static ngx_int_t
-ngx_stream_proxy_set_ssl(ngx_conf_t *cf, ngx_stream_proxy_srv_conf_t *pscf)
+ngx_stream_proxy_init_breaker_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_pool_cleanup_t  *cln;
+    ngx_stream_proxy_breaker_zone_t  *octx = data;
+
+    size_t                            len;
+    ngx_stream_proxy_breaker_zone_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
 
-    if (pscf->ssl->ctx) {
         return NGX_OK;
     }
 
-    if (ngx_ssl_create(pscf->ssl, pscf->ssl_protocols, NULL) != NGX_OK) {
-        return NGX_ERROR;
-    }
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    cln = ngx_pool_cleanup_add(cf->pool, 0);
-    if (cln == NULL) {
-        ngx_ssl_cleanup_ctx(pscf->ssl);
-        return NGX_ERROR;
-    }
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
 
-    cln->handler = ngx_ssl_cleanup_ctx;
-    cln->data = pscf->ssl;
+        return NGX_OK;
+    }
 
-    if (ngx_ssl_ciphers(cf, pscf->ssl, &pscf->ssl_ciphers, 0) != NGX_OK) {
+    ctx->sh = ngx_slab_alloc(ctx->shpool,
+                             sizeof(ngx_stream_proxy_breaker_shctx_t));
+    if (ctx->sh == NULL) {
         return NGX_ERROR;
     }
 
-    if (pscf->ssl_certificate
-        && pscf->ssl_certificate->value.len)
-    {
-        if (pscf->ssl_certificate_key == NULL) {
-            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
-                          "no \"proxy_ssl_certificate_key\" is defined "
-                          "for certificate \"%V\"",
-                          &pscf->ssl_certificate->value);
-            return NGX_ERROR;
-        }
-
-        if (pscf->ssl_certificate->lengths
-            || pscf->ssl_certificate_key->lengths)
-        {
-            pscf->ssl_passwords =
-                           ngx_ssl_preserve_passwords(cf, pscf->ssl_passwords);
-            if (pscf->ssl_passwords == NULL) {
-                return NGX_ERROR;
-            }
-
-        } else {
-            if (ngx_ssl_certificate(cf, pscf->ssl,
-                                    &pscf->ssl_certificate->value,
-                                    &pscf->ssl_certificate_key->value,
-                                    pscf->ssl_passwords)
-                != NGX_OK)
-            {
-                return NGX_ERROR;
-            }
-        }
-    }
+    ctx->shpool->data = ctx->sh;
 
-    if (pscf->ssl_verify) {
-        if (pscf->ssl_trusted_certificate.len == 0) {
-            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
-                      "no proxy_ssl_trusted_certificate for proxy_ssl_verify");
-            return NGX_ERROR;
-        }
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_stream_proxy_breaker_rbtree_insert_value);
 
-        if (ngx_ssl_trusted_certificate(cf, pscf->ssl,
-                                        &pscf->ssl_trusted_certificate,
-                                        pscf->ssl_verify_depth)
-            != NGX_OK)
-        {
-            return NGX_ERROR;
-        }
+    ngx_queue_init(&ctx->sh->queue);
 
-        if (ngx_ssl_crl(cf, pscf->ssl, &pscf->ssl_crl) != NGX_OK) {
-            return NGX_ERROR;
-        }
-    }
+    len = sizeof(" in proxy_circuit_breaker zone \"\"")
+          + shm_zone->shm.name.len;
 
-    if (ngx_ssl_client_session_cache(cf, pscf->ssl, pscf->ssl_session_reuse)
-        != NGX_OK)
-    {
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
         return NGX_ERROR;
     }
 
-    if (ngx_ssl_conf_commands(cf, pscf->ssl, pscf->ssl_conf_commands)
-        != NGX_OK)
-    {
-        return NGX_ERROR;
-    }
+    ngx_sprintf(ctx->shpool->log_ctx, " in proxy_circuit_breaker zone \"%V\"%Z",
+                &shm_zone->shm.name);
 
     return NGX_OK;
 }
 
-#endif
-
 
-static char *
-ngx_stream_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static void
+ngx_stream_proxy_breaker_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
 {
-    ngx_stream_proxy_srv_conf_t *pscf = conf;
-
-    ngx_url_t                            u;
-    ngx_str_t                           *value, *url;
-    ngx_stream_complex_value_t           cv;
-    ngx_stream_core_srv_conf_t          *cscf;
-    ngx_stream_compile_complex_value_t   ccv;
-
-    if (pscf->upstream || pscf->upstream_value) {
-        return "is duplicate";
-    }
+    ngx_rbtree_node_t                **p;
+    ngx_stream_proxy_breaker_node_t   *bn, *bnt;
 
-    cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
+    for ( ;; ) {
 
-    cscf->handler = ngx_stream_proxy_handler;
+        if (node->key < temp->key) {
 
-    value = cf->args->elts;
+            p = &temp->left;
 
-    url = &value[1];
+        } else if (node->key > temp->key) {
 
-    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+            p = &temp->right;
 
-    ccv.cf = cf;
-    ccv.value = url;
-    ccv.complex_value = &cv;
+        } else { /* node->key == temp->key */
 
-    if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
-        return NGX_CONF_ERROR;
-    }
+            bn = (ngx_stream_proxy_breaker_node_t *) &node->color;
+            bnt = (ngx_stream_proxy_breaker_node_t *) &temp->color;
 
-    if (cv.lengths) {
-        pscf->upstream_value = ngx_palloc(cf->pool,
-                                          sizeof(ngx_stream_complex_value_t));
-        if (pscf->upstream_value == NULL) {
-            return NGX_CONF_ERROR;
+            p = (ngx_memn2cmp(bn->data, bnt->data, bn->len, bnt->len) < 0)
+                ? &temp->left : &temp->right;
         }
 
-        *pscf->upstream_value = cv;
-
-        return NGX_CONF_OK;
-    }
-
-    ngx_memzero(&u, sizeof(ngx_url_t));
-
-    u.url = *url;
-    u.no_resolve = 1;
+        if (*p == sentinel) {
+            break;
+        }
 
-    pscf->upstream = ngx_stream_upstream_add(cf, &u, 0);
-    if (pscf->upstream == NULL) {
-        return NGX_CONF_ERROR;
+        temp = *p;
     }
 
-    return NGX_CONF_OK;
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
 }
 
 
 static char *
-ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_stream_proxy_health_check_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
 {
     ngx_stream_proxy_srv_conf_t *pscf = conf;
 
-    ngx_int_t                            rc;
-    ngx_str_t                           *value;
-    ngx_stream_complex_value_t           cv;
-    ngx_stream_upstream_local_t         *local;
-    ngx_stream_compile_complex_value_t   ccv;
+    ngx_int_t                   n;
+    ngx_str_t                  *value, s;
+    ngx_uint_t                  i;
+    ngx_stream_proxy_health_t  *hc;
 
-    if (pscf->local != NGX_CONF_UNSET_PTR) {
+    if (pscf->health) {
         return "is duplicate";
     }
 
-    value = cf->args->elts;
-
-    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
-        pscf->local = NULL;
-        return NGX_CONF_OK;
+    hc = ngx_pcalloc(cf->pool, sizeof(ngx_stream_proxy_health_t));
+    if (hc == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     hc->send = { 0, NULL };
+     *     hc->expect = { 0, NULL };
+     *     hc->peers = NULL;
+     */
 
-    ccv.cf = cf;
-    ccv.value = &value[1];
-    ccv.complex_value = &cv;
+    hc->interval = 5000;
+    hc->timeout = NGX_CONF_UNSET_MSEC;
+    hc->fails = 1;
+    hc->passes = 1;
 
-    if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
-        return NGX_CONF_ERROR;
-    }
+    value = cf->args->elts;
 
-    local = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_local_t));
-    if (local == NULL) {
-        return NGX_CONF_ERROR;
-    }
+    for (i = 1; i < cf->args->nelts; i++) {
 
-    pscf->local = local;
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
 
-    if (cv.lengths) {
-        local->value = ngx_palloc(cf->pool, sizeof(ngx_stream_complex_value_t));
-        if (local->value == NULL) {
-            return NGX_CONF_ERROR;
+            s.data = value[i].data + 9;
+            s.len = value[i].len - 9;
+
+            n = ngx_parse_time(&s, 0);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hc->interval = n;
+            continue;
         }
 
-        *local->value = cv;
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
 
-    } else {
-        local->addr = ngx_palloc(cf->pool, sizeof(ngx_addr_t));
-        if (local->addr == NULL) {
-            return NGX_CONF_ERROR;
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+
+            n = ngx_parse_time(&s, 0);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hc->timeout = n;
+            continue;
         }
 
-        rc = ngx_parse_addr_port(cf->pool, local->addr, value[1].data,
-                                 value[1].len);
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
 
-        switch (rc) {
-        case NGX_OK:
-            local->addr->name = value[1];
-            break;
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
 
-        case NGX_DECLINED:
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid address \"%V\"", &value[1]);
-            /* fall through */
+            if (n < 1) {
+                goto invalid;
+            }
 
-        default:
-            return NGX_CONF_ERROR;
+            hc->fails = n;
+            continue;
         }
-    }
 
-    if (cf->args->nelts > 2) {
-        if (ngx_strcmp(value[2].data, "transparent") == 0) {
-#if (NGX_HAVE_TRANSPARENT_PROXY)
-            ngx_core_conf_t  *ccf;
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
 
-            ccf = (ngx_core_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
-                                                   ngx_core_module);
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
 
-            ccf->transparent = 1;
-            local->transparent = 1;
-#else
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "transparent proxying is not supported "
-                               "on this platform, ignored");
-#endif
-        } else {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid parameter \"%V\"", &value[2]);
-            return NGX_CONF_ERROR;
+            if (n < 1) {
+                goto invalid;
+            }
+
+            hc->passes = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "send=", 5) == 0) {
+            hc->send.data = value[i].data + 5;
+            hc->send.len = value[i].len - 5;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "expect=", 7) == 0) {
+            hc->expect.data = value[i].data + 7;
+            hc->expect.len = value[i].len - 7;
+            continue;
         }
+
+        goto invalid;
     }
 
+    pscf->health = hc;
+
     return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
 }
@@ -130,7 +130,9 @@ typedef struct {
     time_t                             start_sec;
     ngx_uint_t                         requests;
     ngx_uint_t                         responses;
+    ngx_uint_t                         budget_yields;
     ngx_msec_t                         start_time;
+    ngx_msec_t                         activity;
 
     size_t                             upload_rate;
     size_t                             download_rate;
@@ -146,6 +148,7 @@ typedef struct {
     unsigned                           connected:1;
     unsigned                           proxy_protocol:1;
     unsigned                           half_closed:1;
+    unsigned                           pass_cache:2;
 } ngx_stream_upstream_t;
 
 
@@ -0,0 +1,566 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+/* latencies are kept in microseconds, the average moves by 1/8 */
+
+#define NGX_STREAM_UPSTREAM_EWMA_SHIFT  3
+
+/* the least connect time, in milliseconds, a failed attempt counts as */
+
+#define NGX_STREAM_UPSTREAM_EWMA_FAILED  1000
+
+
+typedef struct {
+    ngx_atomic_t                       inflight;
+    ngx_atomic_int_t                   connect;
+    ngx_atomic_int_t                   first_byte;
+} ngx_stream_upstream_ewma_state_t;
+
+
+typedef struct {
+    ngx_uint_t                         number;
+    ngx_uint_t                         allocated;
+    ngx_slab_pool_t                   *shpool;
+    ngx_shm_zone_t                    *shm_zone;
+
+    /* primary peers first, then backup peers */
+    ngx_stream_upstream_ewma_state_t  *states;
+} ngx_stream_upstream_ewma_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_stream_upstream_rr_peer_data_t    rrp;
+
+    ngx_stream_session_t                 *session;
+    ngx_stream_upstream_ewma_srv_conf_t  *conf;
+
+    /* index of the first state of the current peers */
+    ngx_uint_t                            base;
+    ngx_stream_upstream_ewma_state_t     *state;
+} ngx_stream_upstream_ewma_peer_data_t;
+
+
+static ngx_int_t ngx_stream_upstream_init_ewma_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_get_ewma_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_stream_upstream_free_ewma_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_uint_t ngx_stream_upstream_ewma_cost(
+    ngx_stream_upstream_ewma_state_t *st, ngx_stream_upstream_rr_peer_t *peer);
+static void ngx_stream_upstream_ewma_update(ngx_atomic_int_t *avg,
+    ngx_msec_t sample);
+static ngx_int_t ngx_stream_upstream_ewma_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void *ngx_stream_upstream_ewma_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_stream_upstream_ewma_commands[] = {
+
+    { ngx_string("ewma"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_NOARGS,
+      ngx_stream_upstream_ewma,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_ewma_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_stream_upstream_ewma_create_conf,  /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_ewma_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_ewma_module_ctx,  /* module context */
+    ngx_stream_upstream_ewma_commands,     /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_upstream_init_ewma(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    size_t                                size;
+    ngx_str_t                             name;
+    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_ewma_srv_conf_t  *ecf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, cf->log, 0, "init ewma");
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_ewma_peer;
+
+    ecf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_ewma_module);
+
+    peers = us->peer.data;
+
+    ecf->number = peers->number;
+
+    if (peers->next) {
+        ecf->number += peers->next->number;
+    }
+
+    /* the averages are shared by all workers */
+
+    name.len = sizeof("ewma_") - 1 + us->host.len;
+
+    name.data = ngx_pnalloc(cf->pool, name.len);
+    if (name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(name.data, "ewma_%V", &us->host);
+
+    size = 8 * ngx_pagesize
+           + ngx_align(ecf->number * sizeof(ngx_stream_upstream_ewma_state_t),
+                       ngx_pagesize);
+
+    ecf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                          &ngx_stream_upstream_ewma_module);
+    if (ecf->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    ecf->shm_zone->init = ngx_stream_upstream_ewma_init_zone;
+    ecf->shm_zone->data = ecf;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_ewma_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_ewma_peer_data_t  *ep;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "init ewma peer");
+
+    ep = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_stream_upstream_ewma_peer_data_t));
+    if (ep == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.data = &ep->rrp;
+
+    if (ngx_stream_upstream_init_round_robin_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ep->session = s;
+    ep->conf = ngx_stream_conf_upstream_srv_conf(us,
+                                               ngx_stream_upstream_ewma_module);
+    ep->base = 0;
+    ep->state = NULL;
+
+    s->upstream->peer.get = ngx_stream_upstream_get_ewma_peer;
+    s->upstream->peer.free = ngx_stream_upstream_free_ewma_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_get_ewma_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_upstream_ewma_peer_data_t  *ep = data;
+
+    time_t                               now;
+    uintptr_t                            m;
+    ngx_uint_t                           i, n, p, seen, cost[2], pick[2];
+    ngx_stream_upstream_rr_peer_t       *peer, *best[2];
+    ngx_stream_upstream_rr_peers_t      *peers;
+    ngx_stream_upstream_ewma_state_t    *states;
+    ngx_stream_upstream_rr_peer_data_t  *rrp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get ewma peer, try: %ui", pc->tries);
+
+    rrp = &ep->rrp;
+
+    ep->state = NULL;
+
+    if (rrp->peers->single) {
+        return ngx_stream_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    states = ep->conf->states;
+
+    peers = rrp->peers;
+
+    ngx_stream_upstream_rr_peers_wlock(peers);
+
+again:
+
+    /*
+     * power of two choices: two of the usable peers are sampled
+     * uniformly, and the one with the lower cost is used
+     */
+
+    best[0] = NULL;
+    best[1] = NULL;
+    pick[0] = 0;
+    pick[1] = 0;
+    seen = 0;
+
+    for (peer = peers->peer, i = 0;
+         peer;
+         peer = peer->next, i++)
+    {
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            continue;
+        }
+
+        if (peer->down) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        /* reservoir sampling of two */
+
+        if (seen < 2) {
+            n = seen;
+
+        } else {
+            n = ngx_random() % (seen + 1);
+        }
+
+        seen++;
+
+        if (n < 2) {
+            best[n] = peer;
+            pick[n] = i;
+        }
+    }
+
+    if (best[0] == NULL) {
+        goto failed;
+    }
+
+    p = 0;
+
+    if (best[1]) {
+        cost[0] = ngx_stream_upstream_ewma_cost(&states[ep->base + pick[0]],
+                                                best[0]);
+        cost[1] = ngx_stream_upstream_ewma_cost(&states[ep->base + pick[1]],
+                                                best[1]);
+
+        if (cost[1] < cost[0]) {
+            p = 1;
+
+        } else if (cost[1] == cost[0]) {
+            p = ngx_random() & 1;
+        }
+
+        ngx_log_debug4(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get ewma peer, cost %ui: %ui, %ui: %ui",
+                       pick[0], cost[0], pick[1], cost[1]);
+    }
+
+    peer = best[p];
+    i = pick[p];
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    rrp->current = peer;
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    rrp->tried[n] |= m;
+
+    ep->state = &states[ep->base + i];
+    (void) ngx_atomic_fetch_add(&ep->state->inflight, 1);
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+failed:
+
+    if (peers->next) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get ewma peer, backup servers");
+
+        ep->base += peers->number;
+
+        rrp->peers = peers->next;
+
+        n = (rrp->peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        for (i = 0; i < n; i++) {
+            rrp->tried[i] = 0;
+        }
+
+        ngx_stream_upstream_rr_peers_unlock(peers);
+
+        peers = rrp->peers;
+
+        ngx_stream_upstream_rr_peers_wlock(peers);
+
+        goto again;
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_stream_upstream_free_ewma_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_upstream_ewma_peer_data_t  *ep = data;
+
+    ngx_msec_t                         penalty;
+    ngx_stream_upstream_t             *u;
+    ngx_stream_upstream_ewma_state_t  *st;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free ewma peer %ui %ui", pc->tries, state);
+
+    st = ep->state;
+
+    if (st) {
+        ep->state = NULL;
+
+        (void) ngx_atomic_fetch_add(&st->inflight, (ngx_atomic_int_t) -1);
+
+        u = ep->session->upstream;
+
+        if (state & NGX_PEER_FAILED) {
+
+            /*
+             * a failed attempt counts as twice the connect time estimate,
+             * but at least as a second, also for peers without samples
+             */
+
+            penalty = (ngx_msec_t) (2 * st->connect / 1000);
+
+            if (penalty < NGX_STREAM_UPSTREAM_EWMA_FAILED) {
+                penalty = NGX_STREAM_UPSTREAM_EWMA_FAILED;
+            }
+
+            ngx_stream_upstream_ewma_update(&st->connect, penalty);
+
+        } else if (u->state) {
+
+            if (u->state->connect_time != (ngx_msec_t) -1) {
+                ngx_stream_upstream_ewma_update(&st->connect,
+                                                u->state->connect_time);
+            }
+
+            if (u->state->first_byte_time != (ngx_msec_t) -1) {
+                ngx_stream_upstream_ewma_update(&st->first_byte,
+                                                u->state->first_byte_time);
+            }
+        }
+    }
+
+    ngx_stream_upstream_free_round_robin_peer(pc, &ep->rrp, state);
+}
+
+
+static ngx_uint_t
+ngx_stream_upstream_ewma_cost(ngx_stream_upstream_ewma_state_t *st,
+    ngx_stream_upstream_rr_peer_t *peer)
+{
+    ngx_uint_t  latency;
+
+    latency = st->first_byte ? st->first_byte : st->connect;
+
+    /* peers without samples are tried first, then weighed by load */
+
+    return (latency + 1) * (st->inflight + 1) / peer->weight;
+}
+
+
+static void
+ngx_stream_upstream_ewma_update(ngx_atomic_int_t *avg, ngx_msec_t sample)
+{
+    ngx_atomic_int_t  old, usec;
+
+    /*
+     * a lost update between workers is harmless,
+     * the next sample corrects the average
+     */
+
+    usec = (ngx_atomic_int_t) sample * 1000;
+    old = *avg;
+
+    if (old == 0) {
+        *avg = usec ? usec : 1;
+        return;
+    }
+
+    *avg = old + ((usec - old) >> NGX_STREAM_UPSTREAM_EWMA_SHIFT);
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_ewma_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_stream_upstream_ewma_srv_conf_t  *oecf = data;
+
+    size_t                                size;
+    ngx_slab_pool_t                      *shpool;
+    ngx_stream_upstream_ewma_srv_conf_t  *ecf;
+
+    ecf = shm_zone->data;
+
+    size = ecf->number * sizeof(ngx_stream_upstream_ewma_state_t);
+
+    /*
+     * on reload, old workers keep using the states until they exit, so
+     * the array is kept while it is large enough; a larger one is then
+     * allocated, and the old one is left to the old workers
+     */
+
+    if (oecf && oecf->allocated >= ecf->number) {
+        ecf->shpool = oecf->shpool;
+        ecf->states = oecf->states;
+        ecf->allocated = oecf->allocated;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ecf->shpool = shpool;
+        ecf->states = shpool->data;
+        ecf->allocated = ecf->number;
+        return NGX_OK;
+    }
+
+    ecf->shpool = shpool;
+
+    ecf->states = ngx_slab_calloc(shpool, size);
+    if (ecf->states == NULL) {
+        return NGX_ERROR;
+    }
+
+    ecf->allocated = ecf->number;
+
+    shpool->data = ecf->states;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_stream_upstream_ewma_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_ewma_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_stream_upstream_ewma_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->number = 0;
+     *     conf->allocated = 0;
+     *     conf->shpool = NULL;
+     *     conf->shm_zone = NULL;
+     *     conf->states = NULL;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_ewma(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_stream_upstream_init_ewma;
+
+    uscf->flags = NGX_STREAM_UPSTREAM_CREATE
+                  |NGX_STREAM_UPSTREAM_WEIGHT
+                  |NGX_STREAM_UPSTREAM_MAX_CONNS
+                  |NGX_STREAM_UPSTREAM_MAX_FAILS
+                  |NGX_STREAM_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_STREAM_UPSTREAM_DOWN
+                  |NGX_STREAM_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,631 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+/* a prime, much larger than the number of peers */
+
+#define NGX_STREAM_UPSTREAM_MAGLEV_SIZE  65537
+
+
+typedef struct {
+    ngx_stream_complex_value_t         *key;
+    ngx_uint_t                          bound;
+
+    /* peer indexes, built once at configuration */
+    uint16_t                           *table;
+    ngx_uint_t                          number;
+
+    /* per worker: peers by index and in-flight sessions */
+    ngx_stream_upstream_rr_peers_t     *primary;
+    ngx_stream_upstream_rr_peer_t     **peers;
+    ngx_uint_t                         *conns;
+    ngx_uint_t                          total;
+} ngx_stream_upstream_maglev_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_stream_upstream_rr_peer_data_t      rrp;
+
+    ngx_stream_upstream_maglev_srv_conf_t  *conf;
+
+    uint32_t                                hash;
+    uint32_t                                skip;
+    ngx_uint_t                              probe;
+    ngx_uint_t                              tries;
+    ngx_int_t                               index;
+
+    ngx_event_get_peer_pt                   get_rr_peer;
+} ngx_stream_upstream_maglev_peer_data_t;
+
+
+static ngx_int_t ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_init_maglev_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_maglev_key(ngx_stream_session_t *s,
+    ngx_stream_upstream_maglev_srv_conf_t *mcf, ngx_str_t *key);
+static ngx_int_t ngx_stream_upstream_get_maglev_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_stream_upstream_free_maglev_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static void *ngx_stream_upstream_maglev_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_maglev(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_stream_upstream_maglev_commands[] = {
+
+    { ngx_string("maglev"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      ngx_stream_upstream_maglev,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_maglev_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_stream_upstream_maglev_create_conf, /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_maglev_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_maglev_module_ctx, /* module context */
+    ngx_stream_upstream_maglev_commands,   /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    uint16_t                               *table;
+    uint32_t                               *offset, *skip, *next;
+    ngx_uint_t                              i, w, c, filled;
+    ngx_stream_upstream_rr_peer_t          *peer;
+    ngx_stream_upstream_rr_peers_t         *peers;
+    ngx_stream_upstream_maglev_srv_conf_t  *mcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, cf->log, 0, "init maglev");
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_maglev_peer;
+
+    mcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_maglev_module);
+
+    peers = us->peer.data;
+
+    if (peers->number > 0xffff) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "too many servers for maglev in upstream \"%V\"",
+                           &us->host);
+        return NGX_ERROR;
+    }
+
+    mcf->number = peers->number;
+
+    table = ngx_palloc(cf->pool,
+                       NGX_STREAM_UPSTREAM_MAGLEV_SIZE * sizeof(uint16_t));
+    if (table == NULL) {
+        return NGX_ERROR;
+    }
+
+    offset = ngx_palloc(cf->temp_pool, 3 * peers->number * sizeof(uint32_t));
+    if (offset == NULL) {
+        return NGX_ERROR;
+    }
+
+    skip = offset + peers->number;
+    next = skip + peers->number;
+
+    /* each peer prefers the table slots in its own permutation */
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        offset[i] = ngx_crc32_long(peer->name.data, peer->name.len)
+                    % NGX_STREAM_UPSTREAM_MAGLEV_SIZE;
+        skip[i] = ngx_murmur_hash2(peer->name.data, peer->name.len)
+                  % (NGX_STREAM_UPSTREAM_MAGLEV_SIZE - 1) + 1;
+        next[i] = 0;
+    }
+
+    for (c = 0; c < NGX_STREAM_UPSTREAM_MAGLEV_SIZE; c++) {
+        table[c] = 0xffff;
+    }
+
+    /* peers take turns, a peer with weight N claims N slots per turn */
+
+    filled = 0;
+
+    for ( ;; ) {
+
+        for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+            for (w = 0; w < peer->weight; w++) {
+
+                do {
+                    c = (offset[i] + (uint64_t) next[i] * skip[i])
+                        % NGX_STREAM_UPSTREAM_MAGLEV_SIZE;
+                    next[i]++;
+
+                } while (table[c] != 0xffff);
+
+                table[c] = (uint16_t) i;
+
+                if (++filled == NGX_STREAM_UPSTREAM_MAGLEV_SIZE) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+
+    mcf->table = table;
+
+    mcf->peers = ngx_pcalloc(cf->pool, peers->number
+                                     * sizeof(ngx_stream_upstream_rr_peer_t *));
+    if (mcf->peers == NULL) {
+        return NGX_ERROR;
+    }
+
+    mcf->conns = ngx_pcalloc(cf->pool, peers->number * sizeof(ngx_uint_t));
+    if (mcf->conns == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_maglev_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_str_t                                key;
+    ngx_uint_t                               i;
+    ngx_stream_upstream_rr_peer_t           *peer;
+    ngx_stream_upstream_maglev_srv_conf_t   *mcf;
+    ngx_stream_upstream_maglev_peer_data_t  *mp;
+
+    mp = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_stream_upstream_maglev_peer_data_t));
+    if (mp == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.data = &mp->rrp;
+
+    if (ngx_stream_upstream_init_round_robin_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.get = ngx_stream_upstream_get_maglev_peer;
+    s->upstream->peer.free = ngx_stream_upstream_free_maglev_peer;
+
+    mcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_maglev_module);
+
+    if (mcf->primary == NULL) {
+
+        /*
+         * the peers may have been moved to a shared memory zone
+         * after the table was built, so they are indexed on first use
+         */
+
+        mcf->primary = mp->rrp.peers;
+
+        for (peer = mcf->primary->peer, i = 0;
+             peer && i < mcf->number;
+             peer = peer->next, i++)
+        {
+            mcf->peers[i] = peer;
+        }
+    }
+
+    if (ngx_stream_upstream_maglev_key(s, mcf, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "upstream maglev key len:%uz", key.len);
+
+    mp->conf = mcf;
+    mp->hash = ngx_crc32_long(key.data, key.len);
+    mp->skip = ngx_murmur_hash2(key.data, key.len)
+               % (NGX_STREAM_UPSTREAM_MAGLEV_SIZE - 1) + 1;
+    mp->probe = 0;
+    mp->tries = 0;
+    mp->index = -1;
+    mp->get_rr_peer = ngx_stream_upstream_get_round_robin_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_maglev_key(ngx_stream_session_t *s,
+    ngx_stream_upstream_maglev_srv_conf_t *mcf, ngx_str_t *key)
+{
+    u_char                *p;
+    in_addr_t              addr;
+    ngx_str_t             *src;
+    ngx_connection_t      *c;
+    struct sockaddr_in    *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6   *sin6;
+#endif
+
+    if (mcf->key) {
+        return ngx_stream_complex_value(s, mcf->key, key);
+    }
+
+    c = s->connection;
+
+    /*
+     * the real client address from the PROXY protocol header,
+     * hashed in binary form so that case does not matter; IPv4-mapped
+     * IPv6 addresses are hashed as IPv4 ones
+     */
+
+    if (c->proxy_protocol && c->proxy_protocol->src_addr.len) {
+        src = &c->proxy_protocol->src_addr;
+
+        addr = ngx_inet_addr(src->data, src->len);
+
+        if (addr != INADDR_NONE) {
+            p = ngx_pnalloc(c->pool, sizeof(in_addr_t));
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(p, &addr, sizeof(in_addr_t));
+
+            key->data = p;
+            key->len = sizeof(in_addr_t);
+
+            return NGX_OK;
+        }
+
+#if (NGX_HAVE_INET6)
+        p = ngx_pnalloc(c->pool, 16);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_inet6_addr(src->data, src->len, p) == NGX_OK) {
+            key->data = p;
+            key->len = 16;
+
+            if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *) p)) {
+                key->data = p + 12;
+                key->len = sizeof(in_addr_t);
+            }
+
+            return NGX_OK;
+        }
+#endif
+
+        *key = *src;
+
+        return NGX_OK;
+    }
+
+    switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) c->sockaddr;
+
+        key->data = sin6->sin6_addr.s6_addr;
+        key->len = 16;
+
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            key->data += 12;
+            key->len = sizeof(in_addr_t);
+        }
+
+        break;
+#endif
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) c->sockaddr;
+
+        key->data = (u_char *) &sin->sin_addr.s_addr;
+        key->len = sizeof(in_addr_t);
+
+        break;
+
+    default:
+        key->data = (u_char *) c->sockaddr;
+        key->len = c->socklen;
+
+        break;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_get_maglev_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_upstream_maglev_peer_data_t  *mp = data;
+
+    time_t                                  now;
+    uintptr_t                               m;
+    ngx_uint_t                              n, p, limit;
+    ngx_stream_upstream_rr_peer_t          *peer;
+    ngx_stream_upstream_rr_peers_t         *peers;
+    ngx_stream_upstream_maglev_srv_conf_t  *mcf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get maglev peer, try: %ui", pc->tries);
+
+    mcf = mp->conf;
+    peers = mp->rrp.peers;
+
+    mp->index = -1;
+
+    ngx_stream_upstream_rr_peers_rlock(peers);
+
+    if (mp->tries > 20 || peers->single || peers != mcf->primary) {
+        ngx_stream_upstream_rr_peers_unlock(peers);
+        return mp->get_rr_peer(pc, &mp->rrp);
+    }
+
+    now = ngx_time();
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    /*
+     * the key probes the table along its own permutation, so
+     * an unusable or overloaded peer only moves its own keys
+     */
+
+    for ( ;; ) {
+
+        p = mcf->table[(mp->hash + (uint64_t) mp->probe * mp->skip)
+                       % NGX_STREAM_UPSTREAM_MAGLEV_SIZE];
+
+        mp->probe++;
+
+        peer = mcf->peers[p];
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "get maglev peer, probe: %ui, peer: %ui",
+                       mp->probe, p);
+
+        n = p / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+        if (mp->rrp.tried[n] & m) {
+            goto next;
+        }
+
+        ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+        if (peer->down) {
+            ngx_stream_upstream_rr_peer_unlock(peers, peer);
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            ngx_stream_upstream_rr_peer_unlock(peers, peer);
+            goto next;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            ngx_stream_upstream_rr_peer_unlock(peers, peer);
+            goto next;
+        }
+
+        if (mcf->bound) {
+
+            /* bounded load: ceil(bound * (total + 1) / number) */
+
+            limit = (mcf->bound * (mcf->total + 1) + 100 * mcf->number - 1)
+                    / (100 * mcf->number);
+
+            if (mcf->conns[p] >= limit) {
+                ngx_stream_upstream_rr_peer_unlock(peers, peer);
+                goto next;
+            }
+        }
+
+        break;
+
+    next:
+
+        if (++mp->tries > 20) {
+            ngx_stream_upstream_rr_peers_unlock(peers);
+            return mp->get_rr_peer(pc, &mp->rrp);
+        }
+    }
+
+    mp->rrp.current = peer;
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    ngx_stream_upstream_rr_peer_unlock(peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    mp->rrp.tried[n] |= m;
+
+    mcf->conns[p]++;
+    mcf->total++;
+    mp->index = p;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_upstream_free_maglev_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_upstream_maglev_peer_data_t  *mp = data;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free maglev peer %ui %ui", pc->tries, state);
+
+    if (mp->index >= 0) {
+        mp->conf->conns[mp->index]--;
+        mp->conf->total--;
+        mp->index = -1;
+    }
+
+    ngx_stream_upstream_free_round_robin_peer(pc, &mp->rrp, state);
+}
+
+
+static void *
+ngx_stream_upstream_maglev_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_maglev_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_stream_upstream_maglev_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->key = NULL;
+     *     conf->table = NULL;
+     *     conf->primary = NULL;
+     *     conf->peers = NULL;
+     *     conf->conns = NULL;
+     *     conf->total = 0;
+     */
+
+    conf->bound = 125;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_maglev(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_upstream_maglev_srv_conf_t  *mcf = conf;
+
+    ngx_int_t                            n;
+    ngx_str_t                           *value, s;
+    ngx_uint_t                           i;
+    ngx_stream_upstream_srv_conf_t      *uscf;
+    ngx_stream_compile_complex_value_t   ccv;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "bound=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            if (ngx_strcmp(s.data, "off") == 0) {
+                mcf->bound = 0;
+                continue;
+            }
+
+            /* a load factor, "1.25" allows 25% above the average */
+
+            n = ngx_atofp(s.data, s.len, 2);
+
+            if (n == NGX_ERROR || n < 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid bound \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            mcf->bound = n;
+
+            continue;
+        }
+
+        if (mcf->key) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        mcf->key = ngx_palloc(cf->pool, sizeof(ngx_stream_complex_value_t));
+        if (mcf->key == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &value[i];
+        ccv.complex_value = mcf->key;
+
+        if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    uscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_stream_upstream_init_maglev;
+
+    uscf->flags = NGX_STREAM_UPSTREAM_CREATE
+                  |NGX_STREAM_UPSTREAM_WEIGHT
+                  |NGX_STREAM_UPSTREAM_MAX_CONNS
+                  |NGX_STREAM_UPSTREAM_MAX_FAILS
+                  |NGX_STREAM_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_STREAM_UPSTREAM_DOWN;
+
+    return NGX_CONF_OK;
+}